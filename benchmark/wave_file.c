@@ -0,0 +1,166 @@
+// Measures how fast WFC steps when its wave is placed in a file
+// (see wfc_setWaveFile()), compared to when it's kept in memory,
+// for outputs of increasing size.
+//
+// Sizes keep doubling until the wave no longer fits into the memory budget,
+// so that results are reported on both sides of that point. The budget is
+// given in MiB as the first argument. By default, it's the memory limit of
+// the cgroup the benchmark runs in, or all physical memory if there is none.
+// Past the budget, the wave is only measured in the file, since keeping it in
+// memory would have the process swapping or killed.
+//
+// Going past all physical memory takes a while, so run this with its memory
+// limited instead, for example:
+//
+//     systemd-run --user --scope -p MemoryMax=256M
+//         bin/benchmark/wave_file 0 /var/tmp/wave.bin
+//
+// (all on one line), where zero means the default budget.
+//
+// The wave file should be on a disk, rather than on a RAM-backed
+// file system like /tmp often is.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stb_image.h"
+
+#define WFC_IMPLEMENTATION
+#include "wfc.h"
+
+const char *const srcPath = "external/samples/Flowers.png";
+const int n = 3;
+const int options = wfc_optFlipH;
+const int steps = 2000;
+
+double wallClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Returns the value read from a file holding a single number,
+// or zero if there is no such file.
+unsigned long long readLimit(const char *path) {
+    unsigned long long limit = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return 0;
+    // cgroup v2 says "max" if there is no limit, which fails to parse.
+    if (fscanf(file, "%llu", &limit) != 1) limit = 0;
+    fclose(file);
+
+    return limit;
+}
+
+// Smallest of the cgroup memory limit and physical memory, in bytes.
+unsigned long long defaultBudget(void) {
+    unsigned long long budget =
+        (unsigned long long)sysconf(_SC_PHYS_PAGES) *
+        (unsigned long long)sysconf(_SC_PAGESIZE);
+
+    const char *const paths[] = {
+        "/sys/fs/cgroup/memory.max",
+        "/sys/fs/cgroup/memory/memory.limit_in_bytes",
+    };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); ++i) {
+        unsigned long long limit = readLimit(paths[i]);
+        if (limit > 0 && limit < budget) budget = limit;
+    }
+
+    return budget;
+}
+
+// Returns the number of steps per second, or a negative value on error.
+// Memory used by the state after stepping is written to used.
+double measure(
+    int srcW, int srcH, const unsigned char *src, int dstSz, FILE *file,
+    size_t *used) {
+    wfc_State *state = wfc_init(
+        n, options, 4,
+        srcW, srcH, src,
+        dstSz, dstSz);
+    if (state == NULL) return -1.0;
+    if (file != NULL && wfc_setWaveFile(state, fileno(file)) != 0) {
+        wfc_free(state);
+        return -1.0;
+    }
+    wfc_setSeed(state, 1600001001);
+
+    double t0 = wallClock();
+    int done = 0;
+    while (done < steps && !wfc_step(state)) ++done;
+    double t1 = wallClock();
+
+    *used = wfc_memoryUsage(state);
+    wfc_free(state);
+
+    return (double)done / (t1 - t0);
+}
+
+int main(int argc, char *argv[]) {
+    const double mib = 1024.0 * 1024.0;
+
+    unsigned long long budget =
+        argc > 1 ? strtoull(argv[1], NULL, 10) * 1024ull * 1024ull : 0;
+    if (budget == 0) budget = defaultBudget();
+    const char *path = argc > 2 ? argv[2] : "bin/benchmark/wave.bin";
+
+    int srcW, srcH;
+    unsigned char *src = stbi_load(srcPath, &srcW, &srcH, NULL, 4);
+    assert(src != NULL);
+
+    FILE *file = fopen(path, "w+b");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s\n", path);
+        stbi_image_free(src);
+        return 1;
+    }
+
+    printf("input=%s steps=%d args={n=%d opt=%x} file=%s budget=%.1fMiB\n",
+        srcPath, steps, n, options, path, (double)budget / mib);
+
+    // Stops after the first size whose wave doesn't fit into the budget.
+    bool fits = true;
+    for (int sz = 256; fits; sz *= 2) {
+        wfc_Analysis analysis;
+        int code = wfc_analyze(
+            n, options, 4,
+            srcW, srcH, src,
+            sz, sz,
+            NULL, &analysis);
+        if (code != 0) {
+            printf("\tdst=%dx%d is too large for WFC\n", sz, sz);
+            break;
+        }
+
+        fits = analysis.totalSize <= budget;
+        printf("\tdst=%dx%d wave=%.1fMiB total=%.1fMiB (%s budget)\n",
+            sz, sz, (double)analysis.waveSize / mib,
+            (double)analysis.totalSize / mib, fits ? "within" : "over");
+        fflush(stdout);
+
+        size_t used = 0;
+        if (fits) {
+            double inMemory = measure(srcW, srcH, src, sz, NULL, &used);
+            printf("\t\tmemory=%.1f/s used=%.1fMiB\n",
+                inMemory, (double)used / mib);
+        } else {
+            printf("\t\tmemory=skipped\n");
+        }
+        fflush(stdout);
+
+        double inFile = measure(srcW, srcH, src, sz, file, &used);
+        printf("\t\tfile=%.1f/s used=%.1fMiB\n", inFile, (double)used / mib);
+        fflush(stdout);
+    }
+
+    fclose(file);
+    remove(path);
+    stbi_image_free(src);
+
+    return 0;
+}
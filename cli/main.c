@@ -5,6 +5,13 @@
 #include <string.h>
 #include <time.h>
 
+#ifdef WFC_USE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "stb_image.h"
 #include "stb_image_write.h"
 
@@ -22,6 +29,162 @@ void printProgress(const struct WfcWrapper wfc, int dstW, int dstH) {
     fflush(stdout);
 }
 
+void printSize(const char *label, size_t sz) {
+    fprintf(stdout, "%s%.1f MiB (%zu B)\n",
+        label, (double)sz / (1024.0 * 1024.0), sz);
+}
+
+void printAnalysis(const wfc_Analysis analysis) {
+    printSize("Pattern data:       ", analysis.patternsSize);
+    printSize("Overlaps:           ", analysis.overlapsSize);
+    printSize("Wave:               ", analysis.waveSize);
+    printSize("State:              ", analysis.stateSize);
+    printSize("Gathering scratch:  ", analysis.scratchSize);
+    printSize("Projected total:    ", analysis.totalSize);
+}
+
+// Loads the model from the cache directory if it's there. Otherwise, gathers
+// patterns as usual and saves the model there for later runs.
+// Returns null if WFC could not be initialized.
+struct wfc_State* initCached(
+    const char *cacheDir,
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    bool *hit) {
+#ifdef WFC_USE_MMAP
+    if (mkdir(cacheDir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating directory %s\n", cacheDir);
+    }
+
+    char *path = malloc(strlen(cacheDir) + 32);
+    sprintf(path, "%s/%016llx.wfcmodel", cacheDir,
+        wfc_modelKey(n, options, bytesPerPixel, srcW, srcH, src));
+
+    struct wfc_State *state = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        state = wfc_initFromModel(
+            n, options, bytesPerPixel,
+            srcW, srcH, src,
+            dstW, dstH, NULL,
+            NULL, NULL,
+            fd);
+        close(fd);
+    }
+    *hit = state != NULL;
+
+    if (state == NULL) {
+        state = wfc_initEx(
+            n, options, bytesPerPixel,
+            srcW, srcH, src,
+            dstW, dstH, NULL,
+            NULL, NULL);
+
+        // Other runs may have the cached file mapped, so it is replaced
+        // with a fully written one rather than written over.
+        if (state != NULL) {
+            char *tmpPath = malloc(strlen(path) + 32);
+            sprintf(tmpPath, "%s.tmp.%ld", path, (long)getpid());
+
+            bool ok = false;
+            fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (fd >= 0) {
+                ok = wfc_saveModel(state, src, fd) == 0;
+                if (close(fd) != 0) ok = false;
+            }
+            if (ok) ok = rename(tmpPath, path) == 0;
+            if (!ok) {
+                fprintf(stderr, "Error writing to %s\n", path);
+                remove(tmpPath);
+            }
+
+            free(tmpPath);
+        }
+    }
+
+    free(path);
+
+    return state;
+#else
+    (void)cacheDir;
+    (void)n;
+    (void)options;
+    (void)bytesPerPixel;
+    (void)srcW;
+    (void)srcH;
+    (void)src;
+    (void)dstW;
+    (void)dstH;
+    *hit = false;
+    fprintf(stderr, "Caching is not supported on this platform.\n");
+    return NULL;
+#endif
+}
+
+// Saves the current state to path. It's written to a temporary file first,
+// so that the previous checkpoint survives if this is interrupted.
+// Returns non-zero on error.
+int saveCheckpoint(const char *path, const struct WfcWrapper wfc) {
+    size_t sz = wfcSaveState(wfc, NULL, 0);
+    unsigned char *buf = malloc(sz);
+    if (buf == NULL) return -1;
+    wfcSaveState(wfc, buf, sz);
+
+    char *tmpPath = malloc(strlen(path) + sizeof(".tmp"));
+    sprintf(tmpPath, "%s.tmp", path);
+
+    int ret = 0;
+
+    FILE *file = fopen(tmpPath, "wb");
+    if (file == NULL) {
+        ret = -1;
+    } else {
+        if (fwrite(buf, 1, sz, file) != sz) ret = -1;
+        if (fclose(file) != 0) ret = -1;
+    }
+
+    // Renaming over an existing file fails on some platforms.
+    if (ret == 0 && rename(tmpPath, path) != 0) {
+        remove(path);
+        if (rename(tmpPath, path) != 0) ret = -1;
+    }
+
+    free(tmpPath);
+    free(buf);
+
+    return ret;
+}
+
+// Returns 1 if the checkpoint at path was loaded, 0 if there isn't one,
+// or a negative value on error.
+int loadCheckpoint(const char *path, struct WfcWrapper *wfc) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return 0;
+
+    int ret = 1;
+    unsigned char *buf = NULL;
+
+    long sz = -1;
+    if (fseek(file, 0, SEEK_END) == 0) sz = ftell(file);
+    if (sz < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        ret = -1;
+    } else {
+        buf = malloc(sz > 0 ? (size_t)sz : 1);
+        if (buf == NULL ||
+            fread(buf, 1, (size_t)sz, file) != (size_t)sz ||
+            wfcLoadState(wfc, buf, (size_t)sz) != 0) {
+            ret = -1;
+        }
+    }
+
+    free(buf);
+    fclose(file);
+
+    return ret;
+}
+
 int main(int argc, char *argv[]) {
     int ret = 0;
 
@@ -29,6 +192,7 @@ int main(int argc, char *argv[]) {
 
     unsigned char *srcPixels = NULL;
     unsigned char *dstPixels = NULL;
+    char *checkpointPath = NULL;
     struct WfcWrapper wfc = {0};
 
     struct Args args;
@@ -51,12 +215,64 @@ int main(int argc, char *argv[]) {
         goto cleanup;
     }
 
-    dstPixels = malloc(args.dstW * args.dstH * bytesPerPixel);
-
-    srand(args.seed);
     int wfcOptions = argsToWfcOptions(args);
 
-    if (wfcInit(
+    if (args.dryRun) {
+        wfc_Analysis analysis;
+        if (wfc_analyze(
+                args.n, wfcOptions, bytesPerPixel,
+                srcW, srcH, srcPixels,
+                args.dstW, args.dstH,
+                NULL,
+                &analysis) != 0) {
+            fprintf(stderr, "WFC analysis failed.\n");
+            ret = 1;
+            goto cleanup;
+        }
+
+        printPrelude(args, srcW, srcH, analysis.patternCount);
+        fprintf(stdout, "\n");
+        printAnalysis(analysis);
+        fflush(stdout);
+
+        // Initializing can take as long as generating a small image, so the
+        // measurement is only made when asked for. Only rows of the wave
+        // that get modified take up their own memory, so a newly initialized
+        // state uses less than projected.
+        if (args.measureInit) {
+            if (wfcInit(
+                    args.n, wfcOptions, bytesPerPixel,
+                    srcW, srcH, srcPixels,
+                    args.dstW, args.dstH, NULL,
+                    NULL,
+                    &wfc) != 0) {
+                fprintf(stderr, "WFC init failed.\n");
+                ret = 1;
+                goto cleanup;
+            }
+            printSize("Used after init:    ", wfcMemoryUsage(wfc));
+        }
+
+        goto cleanup;
+    }
+
+    dstPixels = malloc(args.dstW * args.dstH * bytesPerPixel);
+
+    bool cacheHit = false;
+    if (args.cacheDir != NULL) {
+        struct wfc_State *state = initCached(
+            args.cacheDir,
+            args.n, wfcOptions, bytesPerPixel,
+            srcW, srcH, srcPixels,
+            args.dstW, args.dstH,
+            &cacheHit);
+        if (state == NULL) {
+            fprintf(stderr, "WFC init failed.\n");
+            ret = 1;
+            goto cleanup;
+        }
+        wfcWrap(state, bytesPerPixel, args.dstW, args.dstH, &wfc);
+    } else if (wfcInit(
             args.n, wfcOptions, bytesPerPixel,
             srcW, srcH, srcPixels,
             args.dstW, args.dstH, NULL,
@@ -67,21 +283,55 @@ int main(int argc, char *argv[]) {
         goto cleanup;
     }
 
+    // Checkpoints can only hold the position of the state's own random number
+    // generator, so it's used instead of rand(). It's used even without them,
+    // so that the same seed always generates the same image.
+    wfcSetSeed(&wfc, args.seed);
+
+    int resumed = 0;
+    if (args.checkpointEvery > 0 || args.resume) {
+        checkpointPath = malloc(strlen(args.pathOut) + sizeof(".checkpoint"));
+        sprintf(checkpointPath, "%s.checkpoint", args.pathOut);
+
+        if (args.resume) {
+            resumed = loadCheckpoint(checkpointPath, &wfc);
+            if (resumed < 0) {
+                fprintf(stderr, "Error loading checkpoint %s\n",
+                    checkpointPath);
+                ret = 1;
+                goto cleanup;
+            }
+        }
+    }
+
     printPrelude(args, srcW, srcH, wfcPatternCount(wfc));
+    if (args.cacheDir != NULL) {
+        fprintf(stdout, "Cache:      %s\n", cacheHit ? "hit" : "miss");
+    }
+    if (args.resume) {
+        fprintf(stdout, "Checkpoint: %s\n", resumed ? "resumed" : "none");
+    }
     fprintf(stdout, "\n");
 
     printProgress(wfc, args.dstW, args.dstH);
     int printCounter = 0;
+    int checkpointCounter = 0;
 
     while (1) {
         int status = wfcStep(&wfc);
         if (status == wfc_failed) {
             if (wfcBacktrack(&wfc) != 0) {
                 fprintf(stdout, "WFC failed.\n");
+                // There is nothing left to resume.
+                if (checkpointPath != NULL) remove(checkpointPath);
                 ret = 1;
                 goto cleanup;
             } else {
                 fprintf(stdout, "WFC is backtracking.\n");
+                // Otherwise, the same steps would be taken again.
+                // The count is saved in checkpoints, so that a resumed run
+                // is seeded the same way as an uninterrupted one.
+                wfcSetSeed(&wfc, args.seed ^ (unsigned)wfc.backtracks);
             }
         } else if (status == wfc_completed) {
             fprintf(stdout, "WFC completed.\n");
@@ -94,8 +344,19 @@ int main(int argc, char *argv[]) {
             printProgress(wfc, args.dstW, args.dstH);
             printCounter = 0;
         }
+
+        if (args.checkpointEvery > 0 &&
+            ++checkpointCounter == args.checkpointEvery) {
+            if (saveCheckpoint(checkpointPath, wfc) != 0) {
+                fprintf(stderr, "Error writing checkpoint %s\n",
+                    checkpointPath);
+            }
+            checkpointCounter = 0;
+        }
     }
 
+    if (checkpointPath != NULL) remove(checkpointPath);
+
     wfcBlit(wfc, srcPixels, dstPixels);
 
     if (writeOut(&args, bytesPerPixel, dstPixels) != 0) {
@@ -104,6 +365,7 @@ int main(int argc, char *argv[]) {
     }
 
 cleanup:
+    free(checkpointPath);
     wfcFree(wfc);
     free(dstPixels);
     stbi_image_free(srcPixels);
@@ -7,6 +7,11 @@ struct Args {
     bool flipH, flipV;
     bool rot;
     bool edgeH, edgeV;
+    const char *cacheDir;
+    int checkpointEvery;
+    bool resume;
+    bool dryRun;
+    bool measureInit;
 };
 
 int parseArgs(int argc, char * const *argv, struct Args *args, bool outReq) {
@@ -14,21 +19,20 @@ int parseArgs(int argc, char * const *argv, struct Args *args, bool outReq) {
     bool flip;
     bool edge;
 
-    unargs_Param paramOut;
-    if (outReq) {
-        paramOut = unargs_stringReq(
-            "o",
-            "Output image file path.",
-            &args->pathOut
-        );
-    } else {
-        paramOut = unargs_string(
-            "o",
-            "Output image file path.",
-            NULL,
-            &args->pathOut
-        );
-    }
+    args->cacheDir = NULL;
+    args->checkpointEvery = 0;
+    args->resume = false;
+    args->dryRun = false;
+    args->measureInit = false;
+
+    // Output is not needed for dry runs, so whether it was given is checked
+    // after parsing.
+    unargs_Param paramOut = unargs_string(
+        "o",
+        "Output image file path.",
+        NULL,
+        &args->pathOut
+    );
 
     unargs_Param params[] = {
         unargs_stringReq(
@@ -98,13 +102,53 @@ int parseArgs(int argc, char * const *argv, struct Args *args, bool outReq) {
             " so that patterns may not wrap around them.",
             &edge
         ),
+        // Only the CLI uses these, so they must be the last params.
+        unargs_string(
+            "cache-dir",
+            "Directory to cache patterns gathered from the input in."
+            " Later runs with the same input, N and options load them"
+            " from there instead of gathering them again.",
+            NULL,
+            &args->cacheDir
+        ),
+        unargs_int(
+            "checkpoint-every",
+            "Saves progress every this many steps next to the output image,"
+            " so that an interrupted run can be resumed. Zero disables it.",
+            0,
+            &args->checkpointEvery
+        ),
+        unargs_bool(
+            "resume",
+            "Continues from the progress saved by -checkpoint-every,"
+            " if there is any. Other arguments must be the same as before.",
+            &args->resume
+        ),
+        unargs_bool(
+            "dry-run",
+            "Prints the memory WFC would use, without generating the image.",
+            &args->dryRun
+        ),
+        unargs_bool(
+            "measure-init",
+            "With -dry-run, also initializes WFC"
+            " and prints the memory it actually uses.",
+            &args->measureInit
+        ),
     };
-
-    int status = unargs_parse(
-        argc, argv, sizeof(params) / sizeof(*params), params);
+    const int cliParamCnt = 5;
+    const int paramCnt = (int)(sizeof(params) / sizeof(*params)) -
+        (outReq ? 0 : cliParamCnt);
+
+    int status = unargs_parse(argc, argv, paramCnt, params);
+    if (status == unargs_ok && outReq &&
+        !args->dryRun && args->pathOut == NULL) {
+        fprintf(stderr, "Output image file path is required.\n");
+        status = unargs_err_args;
+    }
     if (status == unargs_err_args) {
         fprintf(stdout, "\n");
-        unargs_help(argv[0], sizeof(params) / sizeof(*params), params);
+        unargs_help(argv[0], paramCnt, params);
 
         fprintf(stdout, "\n");
         fprintf(stdout, "Example(s):\n");
@@ -117,6 +161,11 @@ int parseArgs(int argc, char * const *argv, struct Args *args, bool outReq) {
                 "\t%s external/samples/Angular.png "
                 "-n 3 -w 64 -h 64 -flip -rot\n",
                 argv[0]);
+        } else {
+            fprintf(stdout,
+                "\t%s external/samples/Angular.png "
+                "-n 3 -w 64 -h 64 -flip -rot -dry-run\n",
+                argv[0]);
         }
 
         return -1;
@@ -152,6 +201,11 @@ int verifyArgs(struct Args args, int srcW, int srcH) {
         return -1;
     }
 
+    if (args.checkpointEvery < 0) {
+        fprintf(stderr, "Steps between checkpoints must not be negative.\n");
+        return -1;
+    }
+
     if (args.pathOut != NULL && getImageFormat(args.pathOut) == IMG_INVALID) {
         fprintf(stderr,
             "Invalid output file name. Supported output extensions are:"
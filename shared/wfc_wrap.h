@@ -4,15 +4,14 @@ struct WfcWrapper {
     int len, cap;
     struct wfc_State **states;
     int counter;
+    int backtracks;
 
     int bytesPerPixel;
 };
 
-int wfcInit(
-    int n, int options, int bytesPerPixel,
-    int srcW, int srcH, const unsigned char *src,
-    int dstW, int dstH, const unsigned char *dst,
-    bool *keep,
+// Takes ownership of an already initialized state.
+void wfcWrap(
+    struct wfc_State *state, int bytesPerPixel, int dstW, int dstH,
     struct WfcWrapper *wfc) {
     wfc->dstW = dstW;
     wfc->dstH = dstH;
@@ -22,19 +21,25 @@ int wfcInit(
     wfc->cap = 10;
     wfc->states = malloc((size_t)wfc->cap * sizeof(*wfc->states));
 
-    struct wfc_State *state = wfc_initEx(n, options, bytesPerPixel,
-        srcW, srcH, src, dstW, dstH, dst, NULL, keep);
-    if (state == NULL) {
-        free(wfc->states);
-        wfc->states = NULL;
-
-        return -1;
-    }
     wfc->states[wfc->len++] = state;
 
     wfc->counter = 0;
+    wfc->backtracks = 0;
 
     wfc->bytesPerPixel = bytesPerPixel;
+}
+
+int wfcInit(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    bool *keep,
+    struct WfcWrapper *wfc) {
+    struct wfc_State *state = wfc_initEx(n, options, bytesPerPixel,
+        srcW, srcH, src, dstW, dstH, dst, NULL, keep);
+    if (state == NULL) return -1;
+
+    wfcWrap(state, bytesPerPixel, dstW, dstH, wfc);
 
     return 0;
 }
@@ -45,6 +50,103 @@ int wfcPatternCount(const struct WfcWrapper wfc) {
     return pattCnt;
 }
 
+// Includes states kept for backtracking.
+size_t wfcMemoryUsage(const struct WfcWrapper wfc) {
+    size_t sz = 0;
+    for (int i = 0; i < wfc.len; ++i) sz += wfc_memoryUsage(wfc.states[i]);
+    return sz;
+}
+
+// Seeds the current state. States kept for backtracking are not affected.
+void wfcSetSeed(struct WfcWrapper *wfc, unsigned seed) {
+    wfc_setSeed(wfc->states[wfc->len - 1], seed);
+}
+
+// Saves all states, including the ones kept for backtracking, along with
+// what decides when the next one is kept. Loading this lets WFC continue
+// exactly as it would have. Returns the size needed, see wfc_saveState().
+size_t wfcSaveState(const struct WfcWrapper wfc, void *buf, size_t bufSz) {
+    const int header[3] = {wfc.len, wfc.counter, wfc.backtracks};
+
+    size_t total = sizeof(header);
+    for (int i = 0; i < wfc.len; ++i) {
+        total += sizeof(size_t) + wfc_saveState(wfc.states[i], NULL, 0);
+    }
+    if (buf == NULL || bufSz < total) return total;
+
+    unsigned char *p = buf;
+    memcpy(p, header, sizeof(header));
+    p += sizeof(header);
+    for (int i = 0; i < wfc.len; ++i) {
+        size_t sz = wfc_saveState(wfc.states[i], NULL, 0);
+        memcpy(p, &sz, sizeof(sz));
+        p += sizeof(sz);
+        wfc_saveState(wfc.states[i], p, sz);
+        p += sz;
+    }
+
+    return total;
+}
+
+// Loads what was saved with wfcSaveState(), replacing all states.
+// Nothing is changed on error.
+int wfcLoadState(struct WfcWrapper *wfc, const void *buf, size_t bufSz) {
+    int header[3];
+    if (bufSz < sizeof(header)) return wfc_callerError;
+    memcpy(header, buf, sizeof(header));
+    const int len = header[0];
+    if (len < 1 || len > wfc->cap || header[1] < 0 || header[2] < 0) {
+        return wfc_callerError;
+    }
+
+    struct wfc_State **states = calloc((size_t)wfc->cap, sizeof(*states));
+    if (states == NULL) return wfc_outOfMemory;
+
+    const unsigned char *p = (const unsigned char*)buf + sizeof(header);
+    size_t left = bufSz - sizeof(header);
+
+    int code = 0;
+    for (int i = 0; i < len && code == 0; ++i) {
+        size_t sz;
+        if (left < sizeof(sz)) {
+            code = wfc_callerError;
+            break;
+        }
+        memcpy(&sz, p, sizeof(sz));
+        p += sizeof(sz);
+        left -= sizeof(sz);
+        if (left < sz) {
+            code = wfc_callerError;
+            break;
+        }
+
+        states[i] = wfc_clone(wfc->states[wfc->len - 1]);
+        if (states[i] == NULL) {
+            code = wfc_outOfMemory;
+            break;
+        }
+        code = wfc_loadState(states[i], p, sz);
+        p += sz;
+        left -= sz;
+    }
+    if (code == 0 && left != 0) code = wfc_callerError;
+
+    if (code != 0) {
+        for (int i = 0; i < len; ++i) wfc_free(states[i]);
+        free(states);
+        return code;
+    }
+
+    for (int i = 0; i < wfc->len; ++i) wfc_free(wfc->states[i]);
+    free(wfc->states);
+    wfc->states = states;
+    wfc->len = len;
+    wfc->counter = header[1];
+    wfc->backtracks = header[2];
+
+    return 0;
+}
+
 int wfcStatus(const struct WfcWrapper wfc) {
     return wfc_status(wfc.states[wfc.len - 1]);
 }
@@ -72,6 +174,7 @@ int wfcBacktrack(struct WfcWrapper *wfc) {
     wfc_free(wfc->states[wfc->len - 1]);
     --wfc->len;
     wfc->counter = 0;
+    ++wfc->backtracks;
 
     return 0;
 }
@@ -1,9 +1,38 @@
+// Tests may pass a pointer to the number of threads to use as context.
+#define WFC_THREADS(ctx) \
+    ((ctx) != NULL ? *(const int*)(ctx) : wfc__threadCnt())
+
+#ifdef TEST_PARALLEL_FOR
+// Stands in for a job system. Runs indexes backwards,
+// so that tests catch results that depend on their order.
+static int parallelForCalls = 0;
+#define WFC_PARALLEL_FOR(ctx, cnt, fn, data) \
+    do { \
+        ++parallelForCalls; \
+        for (int i_ = (cnt) - 1; i_ >= 0; --i_) (fn)((data), i_); \
+    } while (0)
+#endif
+
+#include <stdlib.h>
+
+// Tests may make allocations fail once this many more have been made.
+// Negative means that allocations never fail.
+static int mallocsLeft = -1;
+static void* testMalloc(size_t sz) {
+    if (mallocsLeft == 0) return NULL;
+    if (mallocsLeft > 0) --mallocsLeft;
+
+    return malloc(sz);
+}
+#define WFC_MALLOC(ctx, sz) testMalloc(sz)
+
 #define WFC_IMPLEMENTATION
 #include "wfc.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "testing.h"
@@ -856,6 +885,288 @@ cleanup:
     return ret;
 }
 
+static int testCloneDiverge(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    wfc_State *stateA = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_clone(stateA);
+    assert(stateB != NULL);
+    wfc_State *clone = NULL;
+
+    wfc_setSeed(stateA, 42);
+    wfc_setSeed(stateB, 42);
+    for (int i = 0; i < 4; ++i) {
+        wfc_step(stateA);
+        wfc_step(stateB);
+    }
+
+    // The clone shares what it hasn't modified with stateA,
+    // which must not be affected by the clone being run to completion.
+    clone = wfc_clone(stateA);
+    assert(clone != NULL);
+    wfc_setSeed(clone, 7);
+    while (!wfc_step(clone));
+
+    for (int y = 0; y < dstH; ++y) {
+        for (int x = 0; x < dstW; ++x) {
+            for (int p = 0; p < wfc_patternCount(stateA); ++p) {
+                if (wfc_patternPresentAt(stateA, p, x, y) !=
+                    wfc_patternPresentAt(stateB, p, x, y)) {
+                    PRINT_TEST_FAIL();
+                    ret = -1;
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    while (!wfc_step(stateA));
+    while (!wfc_step(stateB));
+
+    wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(clone);
+    wfc_free(stateB);
+    wfc_free(stateA);
+
+    return ret;
+}
+
+static int testSaveState(void) {
+    enum { n = 3, srcW = 8, srcH = 8, dstW = 32, dstH = 32 };
+
+    int ret = 0;
+
+    // Enough patterns for points to be stored both as bit packs and lists.
+    uint32_t src[srcW * srcH];
+    for (int i = 0; i < srcW * srcH; ++i) src[i] = (uint32_t)(i * 7 % 5);
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    wfc_State *stateA = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateB != NULL);
+    wfc_State *other = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH + 1);
+    assert(other != NULL);
+    unsigned char *buf = NULL;
+
+    wfc_setSeed(stateA, 42);
+    for (int i = 0; i < 16 && !wfc_step(stateA); ++i);
+
+    size_t sz = wfc_saveState(stateA, NULL, 0);
+    if (sz == 0 || wfc_saveState(stateA, NULL, sz) != sz) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    buf = (unsigned char*)malloc(sz);
+    assert(buf != NULL);
+    // Nothing gets written if the buffer is too small.
+    memset(buf, 0xAB, sz);
+    if (wfc_saveState(stateA, buf, sz - 1) != sz || buf[0] != 0xAB) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    if (wfc_saveState(stateA, buf, sz) != sz) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+
+    // Flags in the header must be exactly 0 or 1.
+    struct wfc__StateFile header;
+    memcpy(&header, buf, sizeof(header));
+    header.rngSeeded = 2;
+    memcpy(buf, &header, sizeof(header));
+    int badFlagCode = wfc_loadState(stateB, buf, sz);
+    header.rngSeeded = 1;
+    memcpy(buf, &header, sizeof(header));
+
+    if (badFlagCode != wfc_callerError ||
+        wfc_loadState(other, buf, sz) != wfc_callerError ||
+        wfc_loadState(stateB, buf, sz - 1) != wfc_callerError ||
+        wfc_loadState(stateB, buf, sz) != 0) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (wfc_status(stateB) != wfc_status(stateA) ||
+        wfc_collapsedCount(stateB) != wfc_collapsedCount(stateA)) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    for (int y = 0; y < dstH; ++y) {
+        for (int x = 0; x < dstW; ++x) {
+            for (int p = 0; p < wfc_patternCount(stateA); ++p) {
+                if (wfc_patternPresentAt(stateA, p, x, y) !=
+                    wfc_patternPresentAt(stateB, p, x, y)) {
+                    PRINT_TEST_FAIL();
+                    ret = 1;
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    // The loaded state continues from the same position of its generator,
+    // so it goes through the same steps.
+    while (!wfc_step(stateA));
+    while (!wfc_step(stateB));
+    if (wfc_status(stateB) != wfc_status(stateA)) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    if (wfc_status(stateA) == wfc_completed) {
+        wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+        wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+        if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+            PRINT_TEST_FAIL();
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    free(buf);
+    wfc_free(other);
+    wfc_free(stateB);
+    wfc_free(stateA);
+
+    return ret;
+}
+
+static int testReplay(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16, prefix = 5 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    wfc_State *stateA = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateB != NULL);
+    wfc_State *prefixState = wfc_clone(stateA);
+    assert(prefixState != NULL);
+
+    wfc_setSeed(stateA, 42);
+    wfc_setSeed(prefixState, 42);
+    wfc_setObservationLog(stateA, true);
+    while (!wfc_step(stateA));
+    for (int i = 0; i < prefix; ++i) wfc_step(prefixState);
+
+    const int *log;
+    int steps = wfc_observationLog(stateA, &log);
+    if (wfc_status(stateA) != wfc_completed || steps <= prefix) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+
+    // Fast-forwarding to a step gives the same wave as stepping there.
+    if (wfc_replay(stateB, log, prefix) != 0) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    for (int y = 0; y < dstH; ++y) {
+        for (int x = 0; x < dstW; ++x) {
+            for (int p = 0; p < wfc_patternCount(stateB); ++p) {
+                if (wfc_patternPresentAt(stateB, p, x, y) !=
+                    wfc_patternPresentAt(prefixState, p, x, y)) {
+                    PRINT_TEST_FAIL();
+                    ret = 1;
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    // Observing a pattern that was already removed is an error.
+    for (int p = 0; p < wfc_patternCount(stateB); ++p) {
+        int pnt = log[prefix * 2];
+        if (wfc_patternPresentAt(stateB, p, pnt % dstW, pnt / dstW)) continue;
+
+        const int bad[] = {pnt, p};
+        if (wfc_replay(stateB, bad, 1) != wfc_callerError) {
+            PRINT_TEST_FAIL();
+            ret = 1;
+            goto cleanup;
+        }
+        break;
+    }
+
+    if (wfc_replay(stateB, log + prefix * 2, steps - prefix) !=
+        wfc_completed) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(prefixState);
+    wfc_free(stateB);
+    wfc_free(stateA);
+
+    return ret;
+}
+
 static int testCollapsedCount(void) {
     enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
 
@@ -945,11 +1256,9 @@ static int testKeep(void) {
     return 0;
 }
 
-static int testCallerError(void) {
+static int testCancel(void) {
     enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
 
-    int ret = 0;
-
     uint32_t src[srcW * srcH] = {
         5,5,5,5,
         5,5,6,5,
@@ -958,88 +1267,1991 @@ static int testCallerError(void) {
     };
     uint32_t dst[dstW * dstH];
 
-    wfc_State *state = wfc_init(
-        n, 0, sizeof(*src),
-        srcW, srcH, (unsigned char*)&src,
-        dstW, dstH);
-    assert(state != NULL);
+    volatile int cancel = 1;
 
-    wfc_State *stateCompleted = wfc_init(
+    if (wfc_generateLimited(
         n, 0, sizeof(*src),
         srcW, srcH, (unsigned char*)&src,
-        dstW, dstH);
-    assert(stateCompleted != NULL);
-    while (!wfc_step(stateCompleted));
-    assert(wfc_status(stateCompleted) == wfc_completed);
-
-    unsigned char *srcBytes = (unsigned char*)&src;
-    unsigned char *dstBytes = (unsigned char*)&dst;
-
-    if (wfc_generate(
-        -1, 0, sizeof(*src),
-        srcW, srcH, srcBytes,
-        dstW, dstH, dstBytes) != wfc_callerError) {
-        PRINT_TEST_FAIL();
-        ret = -1;
-        goto cleanup;
-    }
-    if (wfc_generate(
-        n, 0, 0,
-        srcW, srcH, srcBytes,
-        dstW, dstH, dstBytes) != wfc_callerError) {
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, NULL,
+        0.0, &cancel) != wfc_cancelled) {
         PRINT_TEST_FAIL();
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
-    if (wfc_generate(
+
+    // Failing to initialize is not the caller's fault.
+    mallocsLeft = 0;
+    int code = wfc_generateLimited(
         n, 0, sizeof(*src),
-        0, srcH, srcBytes,
-        dstW, dstH, dstBytes) != wfc_callerError) {
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, NULL,
+        0.0, NULL);
+    mallocsLeft = -1;
+    if (code != wfc_outOfMemory) {
         PRINT_TEST_FAIL();
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
-    if (wfc_generate(
+
+    return 0;
+}
+
+static int testTimeLimit(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 64, dstH = 64 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+
+    wfc_State *state = wfc_init(
         n, 0, sizeof(*src),
-        srcW, 0, srcBytes,
-        dstW, dstH, dstBytes) != wfc_callerError) {
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+
+    // Generating the whole image takes a lot longer than this.
+    if (wfc_setLimits(state, 1e-6, NULL) != 0) {
         PRINT_TEST_FAIL();
         ret = -1;
         goto cleanup;
     }
-    if (wfc_generate(
-        n, 0, sizeof(*src),
-        srcW, srcH, NULL,
-        dstW, dstH, dstBytes) != wfc_callerError) {
+
+    while (!wfc_step(state));
+    if (wfc_status(state) != wfc_timedOut) {
         PRINT_TEST_FAIL();
         ret = -1;
         goto cleanup;
     }
-    if (wfc_generate(
-        n, 0, sizeof(*src),
-        srcW, srcH, srcBytes,
-        0, dstH, dstBytes) != wfc_callerError) {
+
+    // Stopped states can no longer be stepped.
+    if (wfc_step(state) != wfc_timedOut) {
         PRINT_TEST_FAIL();
         ret = -1;
         goto cleanup;
     }
-    if (wfc_generate(
+
+cleanup:
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testAsync(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+
+    wfc_Async *async = wfc_startAsync(
         n, 0, sizeof(*src),
-        srcW, srcH, srcBytes,
-        dstW, 0, dstBytes) != wfc_callerError) {
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, NULL);
+    assert(async != NULL);
+
+    if (wfc_wait(async) != wfc_completed ||
+        wfc_poll(async) != wfc_completed) {
         PRINT_TEST_FAIL();
         ret = -1;
         goto cleanup;
     }
-    if (wfc_generate(
-        n, 0, sizeof(*src),
-        srcW, srcH, srcBytes,
-        dstW, dstH, NULL) != wfc_callerError) {
+
+    if (wfc_asyncCollapsedCount(async) != dstW * dstH) {
         PRINT_TEST_FAIL();
         ret = -1;
         goto cleanup;
     }
-    if (wfc_generate(
+
+    for (int i = 0; i < dstW * dstH; ++i) {
+        if (dst[i] != 5 && dst[i] != 6) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    wfc_freeAsync(async);
+
+    return ret;
+}
+
+static int testAsyncCancel(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 64, dstH = 64 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+
+    wfc_Async *async = wfc_startAsync(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, NULL);
+    assert(async != NULL);
+
+    if (wfc_cancel(async) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Without threads, the run is done before wfc_startAsync() returns.
+    int status = wfc_wait(async);
+    if (status != wfc_cancelled && status != wfc_completed) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_freeAsync(async);
+
+    return ret;
+}
+
+static int testSeed(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    wfc_State *stateA = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_clone(stateA);
+    assert(stateB != NULL);
+
+    if (wfc_setSeed(stateA, 42) != 0 || wfc_setSeed(stateB, 42) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    while (!wfc_step(stateA));
+    while (!wfc_step(stateB));
+    if (wfc_status(stateA) != wfc_completed ||
+        wfc_status(stateB) != wfc_completed) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(stateB);
+    wfc_free(stateA);
+
+    return ret;
+}
+
+static int testPortfolio(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    wfc_State *state = NULL;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+    uint32_t dstRepro[dstW * dstH];
+
+    unsigned seeds[] = {11, 22, 33, 44, 55};
+    const int seedCnt = sizeof(seeds) / sizeof(*seeds);
+    unsigned winningSeed = 0;
+
+    if (wfc_generatePortfolio(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, NULL,
+        3, seedCnt, seeds, &winningSeed) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    bool seedFound = false;
+    for (int i = 0; i < seedCnt; ++i) {
+        if (seeds[i] == winningSeed) seedFound = true;
+    }
+    if (!seedFound) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // The winning seed must reproduce the same result.
+    state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_setSeed(state, winningSeed);
+    while (!wfc_step(state));
+    if (wfc_status(state) != wfc_completed) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstRepro);
+    if (memcmp(dst, dstRepro, sizeof(dst)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Failing to initialize is not the caller's fault.
+    mallocsLeft = 0;
+    int code = wfc_generatePortfolio(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, NULL,
+        3, seedCnt, seeds, NULL);
+    mallocsLeft = -1;
+    if (code != wfc_outOfMemory) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testBatch(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16, cnt = 5 };
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[cnt][dstW * dstH];
+    uint32_t dstSingle[dstW * dstH];
+
+    unsigned seeds[cnt] = {1, 2, 3, 4, 5};
+    unsigned char *dsts[cnt];
+    for (int i = 0; i < cnt; ++i) dsts[i] = (unsigned char*)&dst[i];
+    int statuses[cnt];
+
+    if (wfc_generateBatch(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH,
+        NULL,
+        2, cnt, seeds, dsts, statuses) != 0) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    for (int i = 0; i < cnt; ++i) {
+        if (statuses[i] != wfc_completed) {
+            PRINT_TEST_FAIL();
+            return -1;
+        }
+
+        // Each output must be the same as if it was generated on its own.
+        wfc_State *state = wfc_init(
+            n, 0, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH);
+        assert(state != NULL);
+        wfc_setSeed(state, seeds[i]);
+        while (!wfc_step(state));
+        wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstSingle);
+        wfc_free(state);
+
+        if (memcmp(dst[i], dstSingle, sizeof(dstSingle)) != 0) {
+            PRINT_TEST_FAIL();
+            return -1;
+        }
+    }
+
+    // Failing to initialize is not the caller's fault.
+    mallocsLeft = 0;
+    int code = wfc_generateBatch(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH,
+        NULL,
+        2, cnt, seeds, dsts, statuses);
+    mallocsLeft = -1;
+    if (code != wfc_outOfMemory) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int testVariations(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16, cnt = 4 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[cnt][dstW * dstH];
+    uint32_t dstSingle[dstW * dstH];
+
+    unsigned seeds[cnt] = {1, 2, 3, 4};
+    unsigned char *dsts[cnt];
+    for (int i = 0; i < cnt; ++i) dsts[i] = (unsigned char*)&dst[i];
+    int statuses[cnt];
+
+    wfc_State *state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_setSeed(state, 42);
+
+    int code = wfc_generateVariations(
+        state, (unsigned char*)&src, 0.5,
+        2, cnt, seeds, dsts, statuses);
+    if (code != 0 || wfc_collapsedCount(state) < dstW * dstH / 2) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < cnt; ++i) {
+        if (statuses[i] != wfc_completed) {
+            PRINT_TEST_FAIL();
+            ret = 1;
+            goto cleanup;
+        }
+
+        // The state is left where the outputs branched off,
+        // so each output can be generated again from a clone of it.
+        wfc_State *clone = wfc_clone(state);
+        assert(clone != NULL);
+        wfc_setSeed(clone, seeds[i]);
+        while (!wfc_step(clone));
+        wfc_blit(clone, (unsigned char*)&src, (unsigned char*)&dstSingle);
+        wfc_free(clone);
+
+        if (memcmp(dst[i], dstSingle, sizeof(dstSingle)) != 0) {
+            PRINT_TEST_FAIL();
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    if (wfc_generateVariations(
+            state, (unsigned char*)&src, 1.5,
+            2, cnt, seeds, dsts, statuses) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+
+    // Running out of memory before branching off stops all outputs.
+    wfc_free(state);
+    state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_setObservationLog(state, true);
+
+    mallocsLeft = 0;
+    code = wfc_generateVariations(
+        state, (unsigned char*)&src, 0.5,
+        2, cnt, seeds, dsts, statuses);
+    mallocsLeft = -1;
+    if (code != wfc_outOfMemory) {
+        PRINT_TEST_FAIL();
+        ret = 1;
+        goto cleanup;
+    }
+    for (int i = 0; i < cnt; ++i) {
+        if (statuses[i] != wfc_outOfMemory) {
+            PRINT_TEST_FAIL();
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testParallelPropagation(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 48, dstH = 48 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    // Fixed edges make initialization propagate from the whole wave.
+    int threadsA = 1, threadsB = 4;
+    wfc_State *stateA = wfc_initEx(
+        n, wfc_optEdgeFix, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        &threadsA, NULL);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_initEx(
+        n, wfc_optEdgeFix, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        &threadsB, NULL);
+    assert(stateB != NULL);
+    // Running out of memory for the workers' buffers is the same as well.
+    wfc_State *stateC = NULL;
+    for (int i = 0; stateC == NULL && i < 1000; ++i) {
+        mallocsLeft = i;
+        stateC = wfc_initEx(
+            n, wfc_optEdgeFix, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            &threadsB, NULL);
+    }
+    mallocsLeft = -1;
+
+    if (stateC == NULL ||
+        wfc_status(stateA) != wfc_status(stateB) ||
+        wfc_status(stateA) != wfc_status(stateC) ||
+        wfc_collapsedCount(stateA) != wfc_collapsedCount(stateB) ||
+        wfc_collapsedCount(stateA) != wfc_collapsedCount(stateC)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    for (int p = 0; p < wfc_patternCount(stateA); ++p) {
+        for (int y = 0; y < dstH; ++y) {
+            for (int x = 0; x < dstW; ++x) {
+                if (wfc_patternPresentAt(stateA, p, x, y) !=
+                        wfc_patternPresentAt(stateB, p, x, y) ||
+                    wfc_patternPresentAt(stateA, p, x, y) !=
+                        wfc_patternPresentAt(stateC, p, x, y) ||
+                    wfc_modifiedAt(stateA, x, y) !=
+                        wfc_modifiedAt(stateB, x, y)) {
+                    PRINT_TEST_FAIL();
+                    ret = -1;
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    wfc_setSeed(stateA, 42);
+    wfc_setSeed(stateB, 42);
+
+    while (!wfc_step(stateA));
+    while (!wfc_step(stateB));
+    if (wfc_status(stateA) != wfc_status(stateB)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_status(stateA) == wfc_completed) {
+        wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+        wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+        if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    wfc_free(stateC);
+    wfc_free(stateB);
+    wfc_free(stateA);
+
+    return ret;
+}
+
+static int testParallelModel(void) {
+    enum { n = 3, srcW = 16, srcH = 16, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH];
+    for (int i = 0; i < srcW * srcH; ++i) {
+        src[i] = (uint32_t)(i * 7 % 5 + i / 37 % 3);
+    }
+
+    const int options = wfc_optFlipH | wfc_optFlipV | wfc_optRotate;
+
+    // Patterns and overlaps are gathered in blocks spread across threads,
+    // and must end up the same regardless of how many there are.
+    int threadsA = 1, threadsB = 4;
+    wfc_State *stateA = wfc_initEx(
+        n, options, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        &threadsA, NULL);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_initEx(
+        n, options, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        &threadsB, NULL);
+    assert(stateB != NULL);
+
+    const struct wfc__Model *modelA = stateA->model;
+    const struct wfc__Model *modelB = stateB->model;
+    if (modelA->pattCnt != modelB->pattCnt ||
+        memcmp(modelA->patts, modelB->patts,
+            (size_t)modelA->pattCnt * sizeof(*modelA->patts)) != 0 ||
+        memcmp(modelA->overlaps.a, modelB->overlaps.a,
+            WFC__A3D_SIZE(modelA->overlaps)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(stateB);
+    wfc_free(stateA);
+
+    return ret;
+}
+
+// Returns whether every NxN block of dst appears in src, where src wraps.
+// If wrap is true, blocks of dst also wrap around its edges.
+static bool allBlocksInSrc(
+    int n,
+    int srcW, int srcH, const uint32_t *src,
+    int dstW, int dstH, const uint32_t *dst,
+    bool wrap) {
+    int lastY = wrap ? dstH - 1 : dstH - n;
+    int lastX = wrap ? dstW - 1 : dstW - n;
+
+    for (int y = 0; y <= lastY; ++y) {
+        for (int x = 0; x <= lastX; ++x) {
+            bool found = false;
+            for (int sy = 0; sy < srcH && !found; ++sy) {
+                for (int sx = 0; sx < srcW && !found; ++sx) {
+                    bool match = true;
+                    for (int dy = 0; dy < n && match; ++dy) {
+                        for (int dx = 0; dx < n && match; ++dx) {
+                            match =
+                                dst[(y + dy) % dstH * dstW + (x + dx) % dstW] ==
+                                src[(sy + dy) % srcH * srcW + (sx + dx) % srcW];
+                        }
+                    }
+                    found = match;
+                }
+            }
+
+            if (!found) return false;
+        }
+    }
+
+    return true;
+}
+
+static int testTiled(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 48, dstH = 48, tileLen = 12 };
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    if (wfc_generateTiled(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dstA,
+        NULL,
+        1, tileLen, tileLen, 42) != 0) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+    if (wfc_generateTiled(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dstB,
+        NULL,
+        4, tileLen, tileLen, 42) != 0) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    // The image must not depend on the number of threads.
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    if (!allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dstA, false)) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    return 0;
+}
+
+struct StreamRows {
+    int w, bytes, nextY, stopY;
+    unsigned char *dst;
+};
+
+static int streamRow(void *user, int y, const unsigned char *row) {
+    struct StreamRows *rows = user;
+
+    if (y != rows->nextY) return 1;
+    ++rows->nextY;
+
+    memcpy(rows->dst + (size_t)y * (size_t)rows->w * (size_t)rows->bytes,
+        row, (size_t)rows->w * (size_t)rows->bytes);
+
+    return rows->nextY == rows->stopY;
+}
+
+static int testStream(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 24, dstH = 50, bandH = 8 };
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+
+    struct StreamRows rows = {dstW, sizeof(*src), 0, -1, (unsigned char*)dst};
+    if (wfc_generateStream(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH,
+        NULL,
+        bandH, 42, streamRow, &rows) != 0) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+    if (rows.nextY != dstH) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    if (!allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dst, false)) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    // Without a height, rows keep coming until the callback stops them.
+    rows.nextY = 0;
+    rows.stopY = dstH;
+    if (wfc_generateStream(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, 0,
+        NULL,
+        bandH, 42, streamRow, &rows) != wfc_cancelled) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+    if (rows.nextY != dstH) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    if (!allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dst, false)) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    if (wfc_generateStream(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH,
+        NULL,
+        n - 1, 42, streamRow, &rows) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int testWorld(void) {
+    enum { n = 3, srcW = 4, srcH = 4, chunkLen = 10, chunkCnt = 3 };
+    enum { dstLen = chunkLen * chunkCnt };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t chunk[chunkLen * chunkLen];
+    uint32_t dstA[dstLen * dstLen];
+    uint32_t dstB[dstLen * dstLen];
+
+    // Middle chunk first, then corners, then the chunks between them,
+    // and the other way around in the second world.
+    const int order[chunkCnt * chunkCnt][2] = {
+        {1, 1}, {0, 0}, {2, 2}, {2, 0}, {0, 2}, {1, 0}, {0, 1}, {2, 1}, {1, 2},
+    };
+
+    wfc_World *worlds[2] = {NULL, NULL};
+    uint32_t *dsts[2] = {dstA, dstB};
+
+    for (int i = 0; i < 2; ++i) {
+        worlds[i] = wfc_initWorld(
+            n, 0, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            chunkLen, chunkLen,
+            NULL,
+            41);
+        assert(worlds[i] != NULL);
+
+        for (int k = 0; k < chunkCnt * chunkCnt; ++k) {
+            const int j = i == 0 ? k : chunkCnt * chunkCnt - 1 - k;
+            int cx = order[j][0] - 1, cy = order[j][1] - 1;
+
+            if (wfc_generateChunk(
+                    worlds[i], cx, cy, (unsigned char*)&chunk) != 0) {
+                PRINT_TEST_FAIL();
+                ret = -1;
+                goto cleanup;
+            }
+
+            for (int y = 0; y < chunkLen; ++y) {
+                memcpy(
+                    &dsts[i][(order[j][1] * chunkLen + y) * dstLen +
+                        order[j][0] * chunkLen],
+                    &chunk[y * chunkLen], sizeof(*chunk) * chunkLen);
+            }
+        }
+    }
+
+    // Chunks come out the same regardless of the order they're generated in.
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (!allBlocksInSrc(n, srcW, srcH, src, dstLen, dstLen, dstA, false)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Chunks that others depend on are generated along with them.
+    if (wfc_chunkGenerated(worlds[0], 1, -1) != 1 ||
+        wfc_chunkGenerated(worlds[0], 2, -2) != 1 ||
+        wfc_chunkGenerated(worlds[0], 5, 5) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Generating a chunk again gives the same pixels.
+    if (wfc_generateChunk(worlds[0], 0, 0, (unsigned char*)&chunk) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    for (int y = 0; y < chunkLen; ++y) {
+        if (memcmp(&dstA[(chunkLen + y) * dstLen + chunkLen],
+                &chunk[y * chunkLen], sizeof(*chunk) * chunkLen) != 0) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    wfc_freeWorld(worlds[1]);
+    wfc_freeWorld(worlds[0]);
+
+    return ret;
+}
+
+static int testCoarseToFine(void) {
+    enum { n = 3, srcW = 8, srcH = 8, dstW = 32, dstH = 32, factor = 2 };
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,5,5,5,5,
+        5,5,5,5,5,5,5,5,
+        5,5,5,5,6,6,5,5,
+        5,5,5,5,6,6,5,5,
+        5,5,6,6,6,6,5,5,
+        5,5,6,6,6,6,5,5,
+        5,5,5,5,5,5,5,5,
+        5,5,5,5,5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+
+    if (wfc_generateCoarseToFine(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL,
+        factor, 42) != wfc_completed) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    if (!allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dst, true)) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    if (wfc_generateCoarseToFine(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL,
+        0, 42) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int testRegions(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 32, dstH = 32 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+    bool keep[dstW * dstH];
+
+    wfc_State *state = NULL, *stateA = NULL, *stateB = NULL, *stateC = NULL;
+
+    state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_setSeed(state, 42);
+    if (wfc_runRegions(state, 2) != wfc_completed) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dst);
+
+    // Two holes far apart from each other get filled in independently.
+    for (int y = 0; y < dstH; ++y) {
+        for (int x = 0; x < dstW; ++x) {
+            bool holeA = x >= 4 && x < 12 && y >= 4 && y < 12;
+            bool holeB = x >= 18 && x < 28 && y >= 16 && y < 26;
+            keep[y * dstW + x] = !holeA && !holeB;
+        }
+    }
+
+    stateA = wfc_initEx(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, (unsigned char*)&dst,
+        NULL, keep);
+    assert(stateA != NULL);
+    stateB = wfc_clone(stateA);
+    assert(stateB != NULL);
+    stateC = wfc_clone(stateA);
+    assert(stateC != NULL);
+
+    wfc_setSeed(stateA, 7);
+    wfc_setSeed(stateB, 7);
+    wfc_setSeed(stateC, 7);
+
+    // Running out of memory along the way can be recovered from
+    // by running again, though regions may be split up differently.
+    // The state shares rows with the others, so it needs to copy them.
+    int code = 0, outOfMemoryCnt = 0;
+    for (int i = 0; i < 10000; ++i) {
+        // Each run first allocates 4 buffers of its own.
+        mallocsLeft = 4 + i % 3;
+        code = wfc_runRegions(stateC, 2);
+        mallocsLeft = -1;
+
+        if (code != wfc_outOfMemory) break;
+        ++outOfMemoryCnt;
+    }
+    if (code != wfc_completed || outOfMemoryCnt == 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_blit(stateC, (unsigned char*)&src, (unsigned char*)&dstB);
+    for (int i = 0; i < dstW * dstH; ++i) {
+        if (keep[i] && dstB[i] != dst[i]) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+    if (wfc_runRegions(stateA, 1) != wfc_completed ||
+        wfc_runRegions(stateB, 4) != wfc_completed ||
+        wfc_collapsedCount(stateA) != wfc_collapsedCount(stateB)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+
+    // The result must not depend on the number of threads.
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < dstW * dstH; ++i) {
+        if (keep[i] && dstA[i] != dst[i]) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    mallocsLeft = -1;
+    wfc_free(stateC);
+    wfc_free(stateB);
+    wfc_free(stateA);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testSpeculation(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 48, dstH = 48 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    int threadsA = 1, threadsB = 4;
+    wfc_State *serial = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(serial != NULL);
+    wfc_State *stateA = wfc_initEx(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        &threadsA, NULL);
+    assert(stateA != NULL);
+    wfc_State *stateB = wfc_initEx(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        &threadsB, NULL);
+    assert(stateB != NULL);
+
+    wfc_setSeed(serial, 42);
+    wfc_setSeed(stateA, 42);
+    wfc_setSeed(stateB, 42);
+    wfc_setSpeculation(stateA, 8, 12);
+    wfc_setSpeculation(stateB, 8, 12);
+
+    int serialSteps = 0, stepsA = 0;
+    while (!wfc_step(serial)) ++serialSteps;
+    while (!wfc_step(stateA)) ++stepsA;
+    while (!wfc_step(stateB));
+
+    if (wfc_status(stateA) != wfc_completed ||
+        wfc_status(stateB) != wfc_completed ||
+        stepsA >= serialSteps) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_blit(stateA, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(stateB, (unsigned char*)&src, (unsigned char*)&dstB);
+
+    // The image must not depend on the number of threads.
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0 ||
+        !allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dstA, true)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(stateB);
+    wfc_free(stateA);
+    wfc_free(serial);
+
+    return ret;
+}
+
+static int testCollapsedRows(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 24, dstH = 24 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    wfc_State *state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_State *clone = NULL;
+
+    wfc_setSeed(state, 42);
+    while (!wfc_step(state));
+    if (wfc_status(state) != wfc_completed) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Rows of a completed state only store which pattern each point has.
+    for (int y = 0; y < dstH; ++y) {
+        for (int x = 0; x < dstW; ++x) {
+            int present = 0;
+            for (int p = 0; p < wfc_patternCount(state); ++p) {
+                present += wfc_patternPresentAt(state, p, x, y);
+            }
+            if (present != 1) {
+                PRINT_TEST_FAIL();
+                ret = -1;
+                goto cleanup;
+            }
+        }
+    }
+
+    clone = wfc_clone(state);
+    assert(clone != NULL);
+
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(clone, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (memcmp(dstA, dstB, sizeof(dstA)) != 0 ||
+        !allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dstA, true)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(clone);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testSparsePoints(void) {
+    enum { n = 3, srcW = 8, srcH = 8, dstW = 32, dstH = 32 };
+
+    int ret = 0;
+
+    // Enough patterns that most points start out dense
+    // and get turned into lists as they lose patterns.
+    uint32_t src[srcW * srcH];
+    for (int i = 0; i < srcW * srcH; ++i) src[i] = (uint32_t)(i * 7 % 5);
+    uint32_t dst[dstW * dstH];
+
+    wfc_State *state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_State *clone = NULL;
+
+    wfc_setSeed(state, 42);
+    for (int i = 0; i < 8 && !wfc_step(state); ++i);
+
+    clone = wfc_clone(state);
+    assert(clone != NULL);
+
+    for (int y = 0; y < dstH; ++y) {
+        for (int x = 0; x < dstW; ++x) {
+            int present = 0;
+            for (int p = 0; p < wfc_patternCount(state); ++p) {
+                bool a = wfc_patternPresentAt(state, p, x, y);
+                bool b = wfc_patternPresentAt(clone, p, x, y);
+                if (a != b) {
+                    PRINT_TEST_FAIL();
+                    ret = -1;
+                    goto cleanup;
+                }
+                present += a;
+            }
+            if (present == 0 && wfc_status(state) != wfc_failed) {
+                PRINT_TEST_FAIL();
+                ret = -1;
+                goto cleanup;
+            }
+        }
+    }
+
+    while (!wfc_step(state));
+    if (wfc_status(state) == wfc_completed) {
+        wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dst);
+        if (!allBlocksInSrc(n, srcW, srcH, src, dstW, dstH, dst, true)) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    wfc_free(clone);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testInitInPlace(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    size_t sz = wfc_stateSize(n, 0, dstW, dstH);
+    assert(sz > 0);
+    // The memory doesn't need to be aligned.
+    unsigned char *mem = (unsigned char*)malloc(sz + 1);
+    assert(mem != NULL);
+
+    wfc_State *state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+    wfc_State *inPlace = NULL;
+    wfc_State *clone = NULL;
+
+    wfc_setSeed(state, 42);
+    while (!wfc_step(state));
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstA);
+
+    if (wfc_initInPlace(
+            mem + 1, sz - 1,
+            n, 0, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            NULL, NULL) != NULL) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Memory can be reused once the state placed in it is freed.
+    for (int i = 0; i < 2; ++i) {
+        inPlace = wfc_initInPlace(
+            mem + 1, sz,
+            n, 0, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            NULL, NULL);
+        assert(inPlace != NULL);
+        clone = wfc_clone(inPlace);
+        assert(clone != NULL);
+
+        wfc_setSeed(inPlace, 42);
+        wfc_setSeed(clone, 42);
+        while (!wfc_step(inPlace));
+        while (!wfc_step(clone));
+
+        memset(dstB, 0, sizeof(dstB));
+        wfc_blit(inPlace, (unsigned char*)&src, (unsigned char*)&dstB);
+        if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+
+        memset(dstB, 0, sizeof(dstB));
+        wfc_blit(clone, (unsigned char*)&src, (unsigned char*)&dstB);
+        if (memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+
+        wfc_free(clone);
+        clone = NULL;
+        wfc_free(inPlace);
+        inPlace = NULL;
+    }
+
+cleanup:
+    wfc_free(clone);
+    wfc_free(inPlace);
+    wfc_free(state);
+    free(mem);
+
+    return ret;
+}
+
+static int testHugeDims(void) {
+    enum { n = 3, srcW = 4, srcH = 4 };
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    unsigned char dst[1];
+
+    const int threads = 1;
+
+    // Too many points to index with an int.
+    const int hugeW = 50000, hugeH = 50000;
+
+    wfc_State *state = wfc_initEx(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        hugeW, hugeH, NULL,
+        (void*)&threads, NULL);
+    size_t sz = wfc_stateSize(n, 0, hugeW, hugeH);
+    int tiledCode = wfc_generateTiled(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        hugeW, hugeH, dst,
+        (void*)&threads, 1, hugeW, hugeH, 0);
+
+    if (state != NULL || sz != 0 || tiledCode != wfc_callerError ||
+        wfc_stateSize(n, 0, 1000, 1000) <= (size_t)1000 * 1000) {
+        PRINT_TEST_FAIL();
+        wfc_free(state);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int testAnalyze(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 32, dstH = 32 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+
+    const int threads = 1;
+    const int options = wfc_optFlip | wfc_optRotate;
+
+    wfc_Analysis analysis;
+    int code = wfc_analyze(
+        n, options, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH,
+        (void*)&threads, &analysis);
+
+    wfc_State *state = wfc_initEx(
+        n, options, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        (void*)&threads, NULL);
+    wfc_State *clone = NULL;
+
+    if (code != 0 || state == NULL ||
+        analysis.patternCount != wfc_patternCount(state) ||
+        analysis.stateSize != wfc_stateSize(n, options, dstW, dstH) ||
+        analysis.overlapsSize == 0 || analysis.waveSize == 0 ||
+        analysis.scratchSize == 0 ||
+        analysis.totalSize !=
+            analysis.patternsSize + analysis.overlapsSize +
+            analysis.waveSize + analysis.stateSize) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // Until they are modified, all rows of the wave share memory.
+    size_t usage = wfc_memoryUsage(state);
+    if (usage <= analysis.stateSize ||
+        usage >= analysis.totalSize) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // A clone shares the model and the wave with the state.
+    clone = wfc_clone(state);
+    if (clone == NULL ||
+        wfc_memoryUsage(state) >= usage ||
+        wfc_memoryUsage(state) + wfc_memoryUsage(clone) >
+            usage + analysis.stateSize) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_setSeed(state, 42);
+    while (!wfc_step(state));
+    if (wfc_memoryUsage(state) >= analysis.totalSize) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_analyze(
+            n, options, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH,
+            (void*)&threads, NULL) != wfc_callerError ||
+        wfc_memoryUsage(NULL) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(clone);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testHugePages(void) {
+    enum { n = 3, srcW = 8, srcH = 8, dstW = 64, dstH = 64 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH];
+    for (int i = 0; i < srcW * srcH; ++i) src[i] = (uint32_t)(i * 7 % 5);
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    const int threads = 4;
+
+    // Only memory changes with the option, so results must be the same.
+    wfc_State *state = wfc_initEx(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        (void*)&threads, NULL);
+    wfc_State *huge = wfc_initEx(
+        n, wfc_optHugePages, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        (void*)&threads, NULL);
+    wfc_State *clone = NULL;
+    if (state == NULL || huge == NULL) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_setSeed(state, 42);
+    wfc_setSeed(huge, 42);
+    for (int i = 0; i < 16 && !wfc_step(state); ++i);
+    for (int i = 0; i < 16 && !wfc_step(huge); ++i);
+
+    // Rows the clone shares must outlive the state they were copied by.
+    clone = wfc_clone(huge);
+    wfc_free(huge);
+    huge = NULL;
+    if (clone == NULL) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    while (!wfc_step(state));
+    while (!wfc_step(clone));
+
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(clone, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (wfc_status(state) != wfc_status(clone) ||
+        memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    wfc_free(clone);
+    wfc_free(huge);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testWaveFile(void) {
+    enum { n = 3, srcW = 8, srcH = 8, dstW = 64, dstH = 64 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH];
+    for (int i = 0; i < srcW * srcH; ++i) src[i] = (uint32_t)(i * 7 % 5);
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    wfc_State *state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    wfc_State *mapped = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    wfc_State *clone = NULL;
+    assert(state != NULL && mapped != NULL);
+
+#ifdef WFC_USE_MMAP
+    FILE *fileA = tmpfile();
+    FILE *fileB = tmpfile();
+    assert(fileA != NULL && fileB != NULL);
+
+    wfc_setSeed(state, 42);
+    wfc_setSeed(mapped, 42);
+    if (wfc_setWaveFile(mapped, fileno(fileA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    for (int i = 0; i < 16 && !wfc_step(state); ++i);
+    for (int i = 0; i < 16 && !wfc_step(mapped); ++i);
+
+    // Rows the clone shares stay in the first file after the state moves on.
+    clone = wfc_clone(mapped);
+    assert(clone != NULL);
+    if (wfc_setWaveFile(mapped, fileno(fileB)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    fclose(fileA);
+    fileA = NULL;
+
+    while (!wfc_step(state));
+    while (!wfc_step(mapped));
+    while (!wfc_step(clone));
+
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(mapped, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (wfc_status(state) != wfc_status(mapped) ||
+        memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    wfc_blit(clone, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (wfc_status(state) != wfc_status(clone) ||
+        memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    if (fileA != NULL) fclose(fileA);
+    fclose(fileB);
+#else
+    (void)dstA;
+    (void)dstB;
+
+    if (wfc_setWaveFile(mapped, 0) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+    }
+#endif
+
+    wfc_free(clone);
+    wfc_free(mapped);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testModelFile(void) {
+    enum { n = 3, srcW = 8, srcH = 8, dstW = 32, dstH = 32 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH];
+    for (int i = 0; i < srcW * srcH; ++i) src[i] = (uint32_t)(i * 7 % 5);
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+
+    const int options = wfc_optFlipH;
+
+    // Keys only depend on what patterns depend on.
+    if (wfc_modelKey(n, options, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src) !=
+        wfc_modelKey(n, options | wfc_optHugePages, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src) ||
+        wfc_modelKey(n, options, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src) ==
+        wfc_modelKey(n, wfc_optRotate, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src) ||
+        wfc_modelKey(n, options, sizeof(*src),
+            srcW, srcH, NULL) != 0) {
+        PRINT_TEST_FAIL();
+        return -1;
+    }
+
+    wfc_State *state = wfc_initEx(
+        n, options, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        NULL, NULL);
+    wfc_State *loaded = NULL;
+    assert(state != NULL);
+
+#ifdef WFC_USE_MMAP
+    FILE *file = tmpfile();
+    assert(file != NULL);
+
+    if (wfc_saveModel(state, (unsigned char*)&src, fileno(file)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    // The file only fits the source and arguments it was saved for.
+    if (wfc_initFromModel(
+            n - 1, options, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            NULL, NULL, fileno(file)) != NULL ||
+        wfc_initFromModel(
+            n, wfc_optRotate, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            NULL, NULL, fileno(file)) != NULL) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    src[0] ^= 1;
+    if (wfc_initFromModel(
+            n, options, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            NULL, NULL, fileno(file)) != NULL) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    src[0] ^= 1;
+
+    // Neither a file whose save never got to the header,
+    // nor one with a pattern that can never be observed is accepted.
+    {
+        struct wfc__ModelFile header;
+        struct wfc__Pattern patt;
+        off_t pattOff = 0;
+        if (pread(fileno(file), &header, sizeof(header), 0) !=
+                (ssize_t)sizeof(header) ||
+            (pattOff = (off_t)header.pattsOff) == 0 ||
+            pread(fileno(file), &patt, sizeof(patt), pattOff) !=
+                (ssize_t)sizeof(patt)) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+
+        struct wfc__ModelFile noHeader;
+        memset(&noHeader, 0, sizeof(noHeader));
+        struct wfc__Pattern noFreq = patt;
+        noFreq.freq = 0;
+
+        bool ok = true;
+        for (int i = 0; i < 2; ++i) {
+            ok = ok && (i == 0 ?
+                pwrite(fileno(file), &noHeader, sizeof(noHeader), 0) ==
+                    (ssize_t)sizeof(noHeader) :
+                pwrite(fileno(file), &noFreq, sizeof(noFreq), pattOff) ==
+                    (ssize_t)sizeof(noFreq));
+            ok = ok && wfc_initFromModel(
+                n, options, sizeof(*src),
+                srcW, srcH, (unsigned char*)&src,
+                dstW, dstH, NULL,
+                NULL, NULL, fileno(file)) == NULL;
+            ok = ok && (i == 0 ?
+                pwrite(fileno(file), &header, sizeof(header), 0) ==
+                    (ssize_t)sizeof(header) :
+                pwrite(fileno(file), &patt, sizeof(patt), pattOff) ==
+                    (ssize_t)sizeof(patt));
+        }
+        if (!ok) {
+            PRINT_TEST_FAIL();
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+    loaded = wfc_initFromModel(
+        n, options, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH, NULL,
+        NULL, NULL, fileno(file));
+    fclose(file);
+    if (loaded == NULL ||
+        wfc_patternCount(loaded) != wfc_patternCount(state)) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    wfc_setSeed(state, 42);
+    wfc_setSeed(loaded, 42);
+    while (!wfc_step(state));
+    while (!wfc_step(loaded));
+
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(loaded, (unsigned char*)&src, (unsigned char*)&dstB);
+    if (wfc_status(state) != wfc_status(loaded) ||
+        memcmp(dstA, dstB, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+#else
+    (void)dstA;
+    (void)dstB;
+
+    if (wfc_saveModel(state, (unsigned char*)&src, 0) != wfc_callerError ||
+        wfc_initFromModel(
+            n, options, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            NULL, NULL, 0) != NULL) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+    }
+#endif
+
+    wfc_free(loaded);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testOutOfMemory(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dstA[dstW * dstH];
+    uint32_t dstB[dstW * dstH];
+    uint32_t dstC[dstW * dstH];
+    uint32_t dstD[dstW * dstH];
+
+    const int threads = 1;
+
+    wfc_State *replayed = NULL, *loaded = NULL;
+    unsigned char *buf = NULL;
+
+    // Each allocation made during initialization and cloning fails in turn,
+    // until there are enough of them for it to succeed.
+    // Sanitizers check that nothing leaks along the way.
+    wfc_State *state = NULL;
+    for (int i = 0; state == NULL && i < 100; ++i) {
+        mallocsLeft = i;
+        state = wfc_initEx(
+            n, 0, sizeof(*src),
+            srcW, srcH, (unsigned char*)&src,
+            dstW, dstH, NULL,
+            (void*)&threads, NULL);
+    }
+    wfc_State *clone = NULL;
+    for (int i = 0; state != NULL && clone == NULL && i < 100; ++i) {
+        mallocsLeft = i;
+        clone = wfc_clone(state);
+    }
+
+    mallocsLeft = 0;
+    int specCode = state != NULL ? wfc_setSpeculation(state, 4, 2) : 0;
+    mallocsLeft = -1;
+
+    if (state == NULL || clone == NULL || specCode != wfc_outOfMemory) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    replayed = wfc_clone(clone);
+    loaded = wfc_clone(clone);
+    assert(replayed != NULL && loaded != NULL);
+
+    wfc_setSeed(state, 42);
+    wfc_setSeed(clone, 42);
+    wfc_setObservationLog(state, true);
+    while (!wfc_step(state));
+
+    // The clone shares rows with the state, so its steps need to copy them.
+    // Steps that run out of memory along the way are retried,
+    // and end up the same as if they hadn't.
+    int outOfMemoryCnt = 0;
+    for (int i = 0; i < 10000; ++i) {
+        mallocsLeft = i % 3;
+        int code = wfc_step(clone);
+        mallocsLeft = -1;
+
+        if (code == wfc_outOfMemory) ++outOfMemoryCnt;
+        else if (code != 0) break;
+
+        // A step left unfinished is finished after loading too.
+        if (code == wfc_outOfMemory && buf == NULL) {
+            size_t sz = wfc_saveState(clone, NULL, 0);
+            buf = (unsigned char*)malloc(sz);
+            assert(buf != NULL);
+            wfc_saveState(clone, buf, sz);
+            if (wfc_loadState(loaded, buf, sz) != 0) {
+                PRINT_TEST_FAIL();
+                ret = -1;
+                goto cleanup;
+            }
+            while (!wfc_step(loaded));
+        }
+    }
+
+    // Same for replays, which continue from the first unapplied observation.
+    const int *log;
+    const int logLen = wfc_observationLog(state, &log);
+    wfc_setObservationLog(replayed, true);
+    for (int i = 0; i < 10000; ++i) {
+        const int *applied;
+        const int appliedLen = wfc_observationLog(replayed, &applied);
+
+        mallocsLeft = i % 3;
+        int code = wfc_replay(
+            replayed, log + appliedLen * 2, logLen - appliedLen);
+        mallocsLeft = -1;
+
+        if (code == wfc_outOfMemory) ++outOfMemoryCnt;
+        else break;
+    }
+
+    wfc_blit(state, (unsigned char*)&src, (unsigned char*)&dstA);
+    wfc_blit(clone, (unsigned char*)&src, (unsigned char*)&dstB);
+    wfc_blit(replayed, (unsigned char*)&src, (unsigned char*)&dstC);
+    wfc_blit(loaded, (unsigned char*)&src, (unsigned char*)&dstD);
+    if (wfc_status(state) != wfc_completed ||
+        wfc_status(clone) != wfc_completed ||
+        wfc_status(replayed) != wfc_completed ||
+        wfc_status(loaded) != wfc_completed ||
+        outOfMemoryCnt == 0 || buf == NULL ||
+        wfc_collapsedCount(clone) != wfc_collapsedCount(state) ||
+        wfc_collapsedCount(replayed) != wfc_collapsedCount(state) ||
+        wfc_collapsedCount(loaded) != wfc_collapsedCount(state) ||
+        memcmp(dstA, dstB, sizeof(dstA)) != 0 ||
+        memcmp(dstA, dstC, sizeof(dstA)) != 0 ||
+        memcmp(dstA, dstD, sizeof(dstA)) != 0) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    mallocsLeft = -1;
+    free(buf);
+    wfc_free(loaded);
+    wfc_free(replayed);
+    wfc_free(clone);
+    wfc_free(state);
+
+    return ret;
+}
+
+static int testCallerError(void) {
+    enum { n = 3, srcW = 4, srcH = 4, dstW = 16, dstH = 16 };
+
+    int ret = 0;
+
+    uint32_t src[srcW * srcH] = {
+        5,5,5,5,
+        5,5,6,5,
+        5,6,6,5,
+        5,5,5,5,
+    };
+    uint32_t dst[dstW * dstH];
+
+    wfc_State *state = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(state != NULL);
+
+    wfc_State *stateCompleted = wfc_init(
+        n, 0, sizeof(*src),
+        srcW, srcH, (unsigned char*)&src,
+        dstW, dstH);
+    assert(stateCompleted != NULL);
+    while (!wfc_step(stateCompleted));
+    assert(wfc_status(stateCompleted) == wfc_completed);
+
+    unsigned char *srcBytes = (unsigned char*)&src;
+    unsigned char *dstBytes = (unsigned char*)&dst;
+
+    if (wfc_generate(
+        -1, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, 0,
+        srcW, srcH, srcBytes,
+        dstW, dstH, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, sizeof(*src),
+        0, srcH, srcBytes,
+        dstW, dstH, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, sizeof(*src),
+        srcW, 0, srcBytes,
+        dstW, dstH, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, sizeof(*src),
+        srcW, srcH, NULL,
+        dstW, dstH, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        0, dstH, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, 0, dstBytes) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH, NULL) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generate(
         srcW + 1, 0, sizeof(*src),
         srcW, srcH, srcBytes,
         dstW, dstH, dstBytes) != wfc_callerError) {
@@ -1060,6 +3272,97 @@ static int testCallerError(void) {
         goto cleanup;
     }
 
+    if (wfc_setSpeculation(NULL, 2, 1) != wfc_callerError ||
+        wfc_setSpeculation(state, 0, 1) != wfc_callerError ||
+        wfc_setSpeculation(state, 2, 0) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_runRegions(NULL, 1) != wfc_callerError ||
+        wfc_runRegions(state, 0) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_setLimits(NULL, 0.0, NULL) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_setSeed(NULL, 0) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    unsigned seeds[] = {1};
+    if (wfc_generatePortfolio(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH, dstBytes,
+        NULL, NULL,
+        0, 1, seeds, NULL) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generatePortfolio(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH, dstBytes,
+        NULL, NULL,
+        1, 0, seeds, NULL) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_generateTiled(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH, dstBytes,
+        NULL,
+        0, n, n, 0) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+    if (wfc_generateTiled(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH, dstBytes,
+        NULL,
+        1, n - 1, n, 0) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    unsigned char *dsts[] = {dstBytes, NULL};
+    if (wfc_generateBatch(
+        n, 0, sizeof(*src),
+        srcW, srcH, srcBytes,
+        dstW, dstH,
+        NULL,
+        1, 2, seeds, dsts, NULL) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (wfc_poll(NULL) != wfc_callerError ||
+        wfc_wait(NULL) != wfc_callerError ||
+        wfc_cancel(NULL) != wfc_callerError ||
+        wfc_asyncCollapsedCount(NULL) != wfc_callerError) {
+        PRINT_TEST_FAIL();
+        ret = -1;
+        goto cleanup;
+    }
+
     if (wfc_blit(NULL, srcBytes, dstBytes) != wfc_callerError) {
         PRINT_TEST_FAIL();
         ret = -1;
@@ -1214,12 +3517,48 @@ int main(void) {
         testPatternCountVFlipRotate() != 0 ||
         testPatternCountHVFlipRotate() != 0 ||
         testClone() != 0 ||
+        testCloneDiverge() != 0 ||
+        testSaveState() != 0 ||
+        testReplay() != 0 ||
         testCollapsedCount() != 0 ||
         testKeep() != 0 ||
+        testCancel() != 0 ||
+        testTimeLimit() != 0 ||
+        testAsync() != 0 ||
+        testAsyncCancel() != 0 ||
+        testSeed() != 0 ||
+        testPortfolio() != 0 ||
+        testBatch() != 0 ||
+        testVariations() != 0 ||
+        testParallelPropagation() != 0 ||
+        testParallelModel() != 0 ||
+        testTiled() != 0 ||
+        testStream() != 0 ||
+        testWorld() != 0 ||
+        testCoarseToFine() != 0 ||
+        testRegions() != 0 ||
+        testSpeculation() != 0 ||
+        testCollapsedRows() != 0 ||
+        testSparsePoints() != 0 ||
+        testInitInPlace() != 0 ||
+        testOutOfMemory() != 0 ||
+        testHugeDims() != 0 ||
+        testAnalyze() != 0 ||
+        testHugePages() != 0 ||
+        testWaveFile() != 0 ||
+        testModelFile() != 0 ||
         testCallerError() != 0) {
         printf("Seed was: %u\n", seed);
         return 1;
     }
 
+#ifdef TEST_PARALLEL_FOR
+    // Tests that use multiple threads must have gone through the hook.
+    if (parallelForCalls == 0) {
+        PRINT_TEST_FAIL();
+        return 1;
+    }
+#endif
+
     return 0;
 }
@@ -73,6 +73,10 @@ You can also run WFC step-by-step like this:
 wfc_clone() can be used to deep-copy a state object. You can use it to implement
 your own backtracking behaviour.
 
+If WFC needs to finish within a time limit or be stoppable from another thread,
+use wfc_generateLimited(), or wfc_setLimits() if you are running it
+step-by-step.
+
 WFC works by first gathering unique NxN patterns from the input image. You can
 get the total number of patterns gathered with wfc_patternCount(). Use
 wfc_patternPresentAt() to check if a pattern is still present at a particular
@@ -90,16 +94,96 @@ before including this header:
     #define WFC_FREE(ctx, p) ...
     // should yield a float value between 0 (inclusive) and 1 (exclusive)
     #define WFC_RAND(ctx) ...
+    // should yield the current time in seconds as a double value
+    #define WFC_CLOCK(ctx) ...
+
+By default, WFC_CLOCK() measures elapsed time using a monotonic clock where
+one is available, so that time limits (see wfc_generateLimited() and
+wfc_setLimits()) are not thrown off by threads, by the process being preempted
+or by the system clock being set. That's clock_gettime() with CLOCK_MONOTONIC
+on POSIX systems, which needs defining _DEFAULT_SOURCE (or _POSIX_C_SOURCE)
+before including any headers if you're compiling with -std=c99, or
+timespec_get() with TIME_MONOTONIC in C23. Otherwise, it falls back to the
+system's wall clock using timespec_get() with TIME_UTC in C11, which jumps if
+the system clock is set, and then to processor time using clock(), which runs
+faster while multiple threads are busy. Define it to use your platform's
+monotonic clock in those cases.
 
 All macros accept a user context pointer as the first argument. If you want it
 to have a value other than null, you will need to supply that value by using
 wfc_generateEx() or wfc_initEx().
+
+WFC_MALLOC() may return null while a state is being initialized or cloned, in
+which case null is returned instead of the state. To place a state in memory of
+your own, get the size it needs from wfc_stateSize() and initialize it with
+wfc_initInPlace(). The state then only allocates the patterns it gathers and
+its wave. To find out how much memory a state would need before initializing
+it, use wfc_analyze(). wfc_memoryUsage() returns how much an existing state
+uses.
+
+WFC can also be run asynchronously, off the calling thread:
+
+    wfc_Async *async = wfc_startAsync(
+        n, wfc_optFlipH | wfc_optFlipV | wfc_optRotate, 4,
+        srcW, srcH, (unsigned char*)src,
+        dstW, dstH, (unsigned char*)dst,
+        NULL, NULL);
+    assert(async != NULL);
+
+    // Do other work, check on it with wfc_poll(), or cancel it with
+    // wfc_cancel().
+
+    int status = wfc_wait(async);
+    wfc_freeAsync(async);
+
+Threads are only used if you define WFC_USE_PTHREADS before including the
+implementation, in which case you will need to link with pthreads. Otherwise,
+functions that would run work on other threads run it on the calling thread.
+WFC_RAND() must be thread-safe if you are using threads (the default one is on
+most platforms). The number of threads backing asynchronous runs can be set
+by defining WFC_ASYNC_THREADS.
+
+Some of the work WFC does internally, like gathering patterns from the source
+image or propagating constraints across large parts of the output, is split
+across threads when they are enabled. Results do not depend on the number of
+threads. The number of threads used defaults to the number of available
+processors. You can change it by defining this macro:
+
+    #define WFC_THREADS(ctx) ...
+
+If your program already has a job system, you can have WFC run all of its
+parallel work on it, instead of on threads it starts itself, by defining:
+
+    // should call fn(data, i) for each i in [0, cnt), possibly in parallel,
+    // and return once all of those calls have returned
+    #define WFC_PARALLEL_FOR(ctx, cnt, fn, data) ...
+
+WFC_USE_PTHREADS is then not needed, except for asynchronous runs. Define
+WFC_THREADS() as well, to the number of jobs that can run at once, since WFC
+only splits work up when it's greater than one. Thread counts passed to
+functions like wfc_generateBatch() then serve the same purpose.
+
+On Linux, the wave and the table of overlaps between patterns can be backed by
+transparent huge pages, which helps when generating large images. Define
+WFC_USE_HUGE_PAGES before including the implementation and pass the
+wfc_optHugePages option. The memory is mapped in with mmap() instead of being
+allocated with WFC_MALLOC(), so you may need to define _DEFAULT_SOURCE before
+including any headers if you're compiling with -std=c99. When propagation is
+spread across threads, rows of the wave are copied on those threads, so that on
+NUMA systems their memory ends up on nodes close to the threads using them.
+
+Gathering patterns can take seconds for large sources. With WFC_USE_MMAP
+defined on POSIX systems, the gathered patterns can be saved to a file with
+wfc_saveModel(), and later states can map them back in with
+wfc_initFromModel() instead of gathering them again. wfc_modelKey() gives a
+hash to name such files by.
 */
 
 #ifndef INCLUDE_WFC_H
 #define INCLUDE_WFC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // @TODO Allow different values of N for different dimensions.
 // @TODO Implement 3D WFC, with GUI support.
@@ -115,7 +199,15 @@ enum {
     // contradiction.
     wfc_failed = -1,
     // Status code that signifies that there was an error in provided arguments.
-    wfc_callerError = -2
+    wfc_callerError = -2,
+    // Status code that signifies that WFC was stopped because its cancellation
+    // flag was raised.
+    wfc_cancelled = -3,
+    // Status code that signifies that WFC was stopped because it ran past its
+    // time limit.
+    wfc_timedOut = -4,
+    // Status code that signifies that there was not enough memory.
+    wfc_outOfMemory = -5
 };
 
 enum {
@@ -140,13 +232,27 @@ enum {
     // patterns may not wrap around them.
     wfc_optEdgeFixV = 1 << 3,
     // This is a combination of wfc_optEdgeFixH and wfc_optEdgeFixV.
-    wfc_optEdgeFix = wfc_optEdgeFixH | wfc_optEdgeFixV
+    wfc_optEdgeFix = wfc_optEdgeFixH | wfc_optEdgeFixV,
+
+    // Enable this option to back the largest arrays, the wave and the table of
+    // which patterns may be placed next to each other, with transparent huge
+    // pages. This cuts down on TLB misses when generating large images. Has no
+    // effect unless WFC_USE_HUGE_PAGES is defined on Linux.
+    wfc_optHugePages = 1 << 5
 };
 
 // An opaque struct containing the WFC state. You should only interact with it
 // through a pointer.
 typedef struct wfc_State wfc_State;
 
+// An opaque struct representing an asynchronous run of WFC. You should only
+// interact with it through a pointer.
+typedef struct wfc_Async wfc_Async;
+
+// An opaque struct representing an unbounded world generated one chunk at a
+// time. You should only interact with it through a pointer.
+typedef struct wfc_World wfc_World;
+
 /**
  * Runs WFC on the provided source image and blits to the destination.
  *
@@ -178,7 +284,8 @@ typedef struct wfc_State wfc_State;
  *
  * \li wfc_completed (positive) in case of success;
  * \li wfc_failed (negative) in case of contradiction;
- * \li wfc_callerError (negative) in case of argument error.
+ * \li wfc_callerError (negative) in case of argument error;
+ * \li wfc_outOfMemory (negative) in case there was not enough memory.
  *
  * On success, the generated image will be written to dst.
  */
@@ -217,7 +324,7 @@ int wfc_generate(
  * not be null.
  *
  * \param ctx User context that will be passed to WFC_ASSERT(), WFC_MALLOC(),
- * WFC_FREE(), and WFC_RAND().
+ * WFC_FREE(), WFC_RAND(), and WFC_CLOCK().
  *
  * \param keep If non-null, signifies that some values in dst are pre-determined
  * and that WFC should not modify them. WFC will attempt to generate the rest of
@@ -229,7 +336,8 @@ int wfc_generate(
  *
  * \li wfc_completed (positive) in case of success;
  * \li wfc_failed (negative) in case of contradiction;
- * \li wfc_callerError (negative) in case of argument error.
+ * \li wfc_callerError (negative) in case of argument error;
+ * \li wfc_outOfMemory (negative) in case there was not enough memory.
  *
  * On success, the generated image will be written to dst.
  */
@@ -240,6 +348,358 @@ int wfc_generateEx(
     void *ctx,
     bool *keep);
 
+/**
+ * Runs WFC on the provided source image and blits to the destination. Same as
+ * wfc_generateEx() except that the run can be stopped early, either by a time
+ * limit or by raising a cancellation flag from another thread.
+ *
+ * \param n Pattern size will be n by n pixels. Must be positive and not greater
+ * than any dimension of source and destination images.
+ *
+ * \param options Bitmask determining how WFC will run. This should be a
+ * bitwise-or of wfc_opt* values or zero.
+ *
+ * \param bytesPerPixel Determines the size in bytes of a single value in source
+ * and destination images. These values will be compared with a simple memcmp,
+ * so make sure that all unused bits are set to zero. Must be positive.
+ *
+ * \param srcW Width in pixels of the source image. Must be positive.
+ *
+ * \param srcH Height in pixels of the source image. Must be positive.
+ *
+ * \param src Pointer to a row-major array of pixels comprising the source
+ * image. Must not be null.
+ *
+ * \param dstW Width in pixels of the destination image. Must be positive.
+ *
+ * \param dstH Height in pixels of the destination image. Must be positive.
+ *
+ * \param dst Pointer to a row-major array of pixels comprising the destination
+ * image. WFC output will be blitted here. If keep is non-null then this must
+ * not be null.
+ *
+ * \param ctx User context that will be passed to WFC_ASSERT(), WFC_MALLOC(),
+ * WFC_FREE(), WFC_RAND(), and WFC_CLOCK().
+ *
+ * \param keep If non-null, signifies that some values in dst are pre-determined
+ * and that WFC should not modify them. See wfc_generateEx() for details.
+ *
+ * \param timeLimit Number of seconds, as measured by WFC_CLOCK(), that WFC may
+ * run for after initialization. If not positive, there is no time limit.
+ *
+ * \param cancel If non-null, WFC will stop shortly after the pointed to value
+ * becomes non-zero. This value may be written to from another thread.
+ *
+ * \return Returns the status code of WFC, which is one of:
+ *
+ * \li wfc_completed (positive) in case of success;
+ * \li wfc_failed (negative) in case of contradiction;
+ * \li wfc_callerError (negative) in case of argument error;
+ * \li wfc_cancelled (negative) in case the cancellation flag was raised;
+ * \li wfc_timedOut (negative) in case the time limit was exceeded;
+ * \li wfc_outOfMemory (negative) in case there was not enough memory.
+ *
+ * On success, the generated image will be written to dst.
+ */
+int wfc_generateLimited(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    bool *keep,
+    double timeLimit, const volatile int *cancel);
+
+/**
+ * Runs WFC with multiple seeds at once and blits the first successful result to
+ * the destination. Patterns are only gathered once and are shared between the
+ * runs. Once one run completes, the others are cancelled. Runs that fail due to
+ * a contradiction are replaced by runs with seeds that haven't been tried yet.
+ *
+ * The result can be reproduced by initializing a state with the same arguments,
+ * calling wfc_setSeed() with the winning seed, and then stepping through it.
+ *
+ * Parameters from n to keep are the same as in wfc_generateEx().
+ *
+ * \param threads Maximum number of runs to do at the same time, each on its
+ * own thread. Must be positive. Runs are done one after another on the calling
+ * thread if threads are not enabled (see WFC_USE_PTHREADS).
+ *
+ * \param seedCnt Number of seeds. Must be positive.
+ *
+ * \param seeds Seeds to try, in order. Must not be null.
+ *
+ * \param winningSeed If non-null, the seed of the successful run is written
+ * here on success.
+ *
+ * \return Returns the same status codes as wfc_generateEx(). wfc_failed is
+ * only returned if runs with all seeds have failed.
+ *
+ * On success, the generated image will be written to dst.
+ */
+int wfc_generatePortfolio(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    bool *keep,
+    int threads, int seedCnt, const unsigned *seeds, unsigned *winningSeed);
+
+/**
+ * Runs WFC to generate multiple output images from the same source image.
+ * Patterns are only gathered once and are shared between all outputs. Outputs
+ * are generated in parallel, with idle threads taking over outputs from busy
+ * ones.
+ *
+ * Parameters from n to dstH are the same as in wfc_generate(). All outputs
+ * share the same dimensions.
+ *
+ * \param ctx User context, see wfc_generateEx().
+ *
+ * \param threads Number of threads to generate outputs on. Must be positive.
+ * Outputs are generated one after another on the calling thread if threads are
+ * not enabled (see WFC_USE_PTHREADS).
+ *
+ * \param cnt Number of outputs to generate. Must be positive.
+ *
+ * \param seeds Seeds to use for each output, see wfc_setSeed(). Must not be
+ * null and must contain cnt elements.
+ *
+ * \param dsts Pointers to each of the output images. Must not be null and must
+ * contain cnt non-null elements.
+ *
+ * \param statuses If non-null, the status code of each output is written
+ * here. It is wfc_completed on success, or a negative status code otherwise.
+ * Must contain cnt elements.
+ *
+ * \return Returns zero if all outputs were generated, wfc_failed if some of
+ * them failed, wfc_callerError in case of argument error, or wfc_outOfMemory
+ * if there was not enough memory to start.
+ */
+int wfc_generateBatch(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    void *ctx,
+    int threads, int cnt, const unsigned *seeds,
+    unsigned char * const *dsts, int *statuses);
+
+/**
+ * Generates a large image tile by tile, so that memory use depends on the size
+ * of a tile rather than that of the whole image. Each tile is generated to fit
+ * the already generated tiles above it and to its left, whose pixels are kept
+ * where patterns overlap them. To leave room for the tiles after it, each tile
+ * is generated together with the tiles below it and to its right, whose pixels
+ * are then discarded. Tiles that don't touch each other are generated in
+ * parallel, along a diagonal front moving from the top-left corner.
+ * Patterns are only gathered once and are shared between all tiles.
+ *
+ * Unlike the image generated by wfc_generate(), this one does not wrap around
+ * its edges. Patterns along its edges are only restricted if edge fixing
+ * options are used.
+ *
+ * Parameters from n to ctx are the same as in wfc_generateEx().
+ *
+ * \param threads Number of threads to generate tiles on. Must be positive.
+ * Tiles are generated one after another on the calling thread if threads are
+ * not enabled (see WFC_USE_PTHREADS).
+ *
+ * \param tileW Width of tiles in pixels. Must not be less than n. Tiles in the
+ * last column also take the remaining width.
+ *
+ * \param tileH Height of tiles in pixels. Must not be less than n. Tiles in
+ * the last row also take the remaining height.
+ *
+ * Only tiles need to be small enough for the limits described in wfc_initEx(),
+ * so the whole image may have more pixels than fit in an int.
+ *
+ * \param seed Seed from which the seeds of individual tiles are derived. The
+ * same seed produces the same image regardless of the number of threads.
+ *
+ * \return Returns zero on success, wfc_failed if some tile could not be
+ * generated after multiple tries, wfc_callerError in case of argument error,
+ * or wfc_outOfMemory if there was not enough memory.
+ *
+ * On success, the generated image will be written to dst.
+ */
+int wfc_generateTiled(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    int threads, int tileW, int tileH, unsigned seed);
+
+/**
+ * Generates an image band by band, from top to bottom, handing each row to a
+ * callback as soon as its band has been generated. Only the band being
+ * generated is kept in memory, so memory use depends on the width of the image
+ * and the height of a band, but not on the height of the image. Each band is
+ * generated to fit the n - 1 rows above it, which are kept. To leave room for
+ * the bands after it, each band is generated together with the band below it,
+ * whose pixels are then discarded. Patterns are only gathered once and are
+ * shared between all bands.
+ *
+ * Unlike the image generated by wfc_generate(), this one does not wrap around
+ * its top and bottom edges. It still wraps around its left and right edges,
+ * unless wfc_optEdgeFixH is used.
+ *
+ * Parameters from n to src are the same as in wfc_generate().
+ *
+ * \param dstW Width in pixels of the generated image. Must be positive.
+ *
+ * \param dstH Height in pixels of the generated image. Must not be negative.
+ * If zero, bands keep being generated until the callback stops them.
+ *
+ * \param ctx Same as in wfc_generateEx().
+ *
+ * \param bandH Height of bands in pixels. Must not be less than n. The last
+ * band also takes the remaining height.
+ *
+ * \param seed Seed from which the seeds of individual bands are derived.
+ *
+ * \param emitRow Called with the index of each generated row, in order from
+ * the top, and a pointer to its pixels, which is only valid during the call.
+ * Should return zero to continue generating, or non-zero to stop. Must not be
+ * null.
+ *
+ * \param user Passed on to emitRow.
+ *
+ * \return Returns zero once all rows have been emitted, wfc_cancelled if
+ * emitRow stopped generation, wfc_failed if some band could not be generated
+ * after multiple tries, wfc_callerError in case of argument error, or
+ * wfc_outOfMemory if there was not enough memory. Rows emitted before an
+ * error remain part of the image.
+ */
+int wfc_generateStream(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    void *ctx,
+    int bandH, unsigned seed,
+    int (*emitRow)(void *user, int y, const unsigned char *row),
+    void *user);
+
+/**
+ * Creates an unbounded world whose chunks can be generated in any order (see
+ * wfc_generateChunk()), always coming out the same. Patterns are gathered once
+ * and are shared between all chunks.
+ *
+ * The world keeps the n - 1 pixels wide border of each generated chunk, so
+ * that the chunks around it can be generated to fit it. Chunks themselves are
+ * not kept. The world should only be used from one thread at a time.
+ *
+ * Parameters from n to src are the same as in wfc_generate().
+ *
+ * \param chunkW Width in pixels of each chunk. Must not be less than n.
+ *
+ * \param chunkH Height in pixels of each chunk. Must not be less than n.
+ *
+ * \param ctx Same as in wfc_generateEx(). Must remain valid until the world is
+ * deallocated.
+ *
+ * \param seed Seed from which the seeds of individual chunks are derived.
+ *
+ * \return Returns the world. It should be deallocated using wfc_freeWorld().
+ * Returns null in case of argument error or if there was not enough memory.
+ */
+wfc_World* wfc_initWorld(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int chunkW, int chunkH,
+    void *ctx,
+    unsigned seed);
+
+/**
+ * Generates the chunk at the given chunk coordinates, so that it fits the
+ * eight chunks around it.
+ *
+ * Chunks are split into four phases by whether their coordinates are odd, in
+ * a lattice of two by two chunks. Each chunk is only generated to fit its
+ * neighbours of lower phases, and leaves room for the rest of them. Those of
+ * its lower-phase neighbours which haven't been generated yet are generated
+ * first, along with their own lower-phase neighbours. That way, a chunk's
+ * pixels only depend on the world's seed and the chunk's coordinates, no
+ * matter in which order chunks get generated. Generating a chunk takes time
+ * proportional to the size of a chunk, regardless of how many chunks have been
+ * generated. Chunks may be generated again, with the same result.
+ *
+ * Chunks of phase zero are generated on their own, without seeing each other.
+ * If the source image has structure spanning more than a chunk, like a horizon
+ * or a grid with a fixed period, the chunks between them may have no way to
+ * join them up, and then always fail to generate.
+ *
+ * \param world The world. Must not be null.
+ *
+ * \param cx Column of the chunk. The chunk's left edge is at cx * chunkW.
+ *
+ * \param cy Row of the chunk. The chunk's top edge is at cy * chunkH.
+ *
+ * \param dst Pointer to where the chunk's pixels will be written, in the same
+ * format as the source image. Must not be null.
+ *
+ * \return Returns zero on success, wfc_failed if the chunk or one of the
+ * chunks it depends on could not be generated to fit its neighbours after
+ * multiple tries, wfc_callerError in case of argument error, or
+ * wfc_outOfMemory if there was not enough memory. Chunks generated before an
+ * error remain part of the world.
+ */
+int wfc_generateChunk(wfc_World *world, int cx, int cy, unsigned char *dst);
+
+/**
+ * Returns whether a chunk has already been generated, either on its own or
+ * because a chunk next to it depends on it.
+ *
+ * \param world The world. Must not be null.
+ *
+ * \return Returns 1 if the chunk has been generated, 0 if it hasn't, or
+ * wfc_callerError if world is null.
+ */
+int wfc_chunkGenerated(const wfc_World *world, int cx, int cy);
+
+/**
+ * Deallocates a world, including the borders of its chunks.
+ *
+ * \param world The world to deallocate.
+ */
+void wfc_freeWorld(wfc_World *world);
+
+/**
+ * Runs WFC at two resolutions and blits to the destination. First, a smaller
+ * image is generated from a downsampled source image. Then, the image at full
+ * resolution is generated so that, in the middle of each block of factor by
+ * factor pixels, it has a pixel from a part of the source image which was
+ * downsampled to the same value as the corresponding pixel of the smaller
+ * image. This restricts patterns before WFC starts, which leaves fewer steps
+ * to run and fewer chances for contradictions on large outputs.
+ *
+ * If the smaller image can't be generated, or if the full image can't be
+ * generated to match it, the full image is generated as if by
+ * wfc_generateEx() instead.
+ *
+ * Parameters from n to ctx are the same as in wfc_generateEx().
+ *
+ * \param factor How many times smaller the source and the destination images
+ * are made in each dimension. Must be positive. If one, or if either image
+ * would become smaller than n pixels in some dimension, no smaller image is
+ * generated.
+ *
+ * \param seed Seed from which the seeds of both runs are derived.
+ *
+ * \return Returns the status code of WFC, which is one of:
+ *
+ * \li wfc_completed (positive) in case of success;
+ * \li wfc_failed (negative) in case of contradiction;
+ * \li wfc_callerError (negative) in case of argument error;
+ * \li wfc_outOfMemory (negative) in case there was not enough memory.
+ *
+ * On success, the generated image will be written to dst.
+ */
+int wfc_generateCoarseToFine(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    int factor, unsigned seed);
+
 /**
  * Allocates and initializes a state object for WFC. This is a first step
  * towards running WFC, you will likely be using wfc_step() after.
@@ -306,6 +766,9 @@ wfc_State* wfc_init(
  * \param dstW Width in pixels of the destination image. Must be positive.
  *
  * \param dstH Height in pixels of the destination image. Must be positive.
+ * Byte sizes are computed in size_t, so the destination image may be larger
+ * than INT_MAX bytes. However, the number of its pixels, as well as the number
+ * of source pixels times 64, must fit in an int.
  *
  * \param dst Pointer to a row-major array of pixels comprising the destination
  * image. During initialization, destination image is only used for the sake of
@@ -313,7 +776,7 @@ wfc_State* wfc_init(
  * must not be null.
  *
  * \param ctx User context that will be passed to WFC_ASSERT(), WFC_MALLOC(),
- * WFC_FREE(), and WFC_RAND().
+ * WFC_FREE(), WFC_RAND(), and WFC_CLOCK().
  *
  * \param keep If non-null, signifies that some values in dst are pre-determined
  * and that WFC should not modify them. WFC will attempt to generate the rest of
@@ -324,7 +787,7 @@ wfc_State* wfc_init(
  * \return Returns an allocated state object to be passed to further WFC
  * functions. This object should be deallocated using wfc_free().
  *
- * In case of error, returns null.
+ * In case of error, including there not being enough memory, returns null.
  */
 wfc_State* wfc_initEx(
     int n, int options, int bytesPerPixel,
@@ -334,109 +797,571 @@ wfc_State* wfc_initEx(
     bool *keep);
 
 /**
- * Returns the current status code for this WFC state.
- *
- * \param state State object pointer for which to query status. Must not be
- * null.
+ * Returns the number of bytes of memory that wfc_initInPlace() needs to be
+ * given for the provided arguments. This covers the state object and all of its
+ * arrays whose sizes depend only on output dimensions. Patterns gathered from
+ * the source image and the wave itself are allocated separately, since the
+ * number of patterns is not known before gathering them.
  *
- * \return Returns the current status code, which is one of:
+ * Parameters are the same as those of wfc_initEx().
  *
- * \li 0 (zero) in case that WFC has not completed yet (you can keep calling
- * wfc_step());
- * \li wfc_completed (positive) in case that WFC has completed successfully;
- * \li wfc_failed (negative) in case that WFC has reached a contradiction and
- * failed to complete;
- * \li wfc_callerError (negative) in case state was null.
-*/
-int wfc_status(const wfc_State *state);
+ * \return Returns the number of bytes needed, or zero in case of argument
+ * error, including output dimensions that are too large.
+ */
+size_t wfc_stateSize(int n, int options, int dstW, int dstH);
 
 /**
- * Performs one iteration of the WFC algorithm, observing one wave point and
- * propagating constraints. After WFC completes, you will likely be calling
- * wfc_blit() next.
- *
- * \param state State object pointer on which to perform the iteration. Must not
- * be null.
+ * Same as wfc_initEx() except that the state object is placed in the provided
+ * memory instead of in newly allocated memory. This lets the caller keep states
+ * in memory of their own, for example to reuse it between runs. Arrays are
+ * placed so that each starts on its own cache line, and the memory itself does
+ * not need to be aligned.
  *
- * \return Returns the status code after calling wfc_step(), which is one of:
+ * Such a state still needs to be deallocated using wfc_free(), which frees
+ * everything allocated for it, but not the provided memory. After that, the
+ * memory can be reused. Clones made with wfc_clone() are allocated as usual.
  *
- * \li 0 (zero) in case that WFC has not completed yet (you can keep calling
- * wfc_step());
- * \li wfc_completed (positive) in case that WFC has completed successfully;
- * \li wfc_failed (negative) in case that WFC has reached a contradiction and
- * failed to complete;
- * \li wfc_callerError (negative) in case state was null.
-*/
-int wfc_step(wfc_State *state);
-
-/**
- * Blits (aka. renders) the generated image to dst by copying in the pixel
- * values. Should be called after WFC completes successfully (after wfc_step()
- * has returned wfc_completed).
+ * \param mem Memory to place the state object in. Must not be null.
  *
- * \param state State object pointer. Must not be null. Must be in the completed
- * state.
+ * \param memSz Size of the provided memory in bytes. Must not be less than
+ * what wfc_stateSize() returns for the same arguments.
  *
- * \param src Pointer to pixels comprising the source image. Must not be null.
- * Must be of the same dimensions as the image that was passed to wfc_init().
+ * Other parameters are the same as those of wfc_initEx().
  *
- * \param dst Pointer to pixels comprising the destination image. Must not be
- * null. Must be of the dimensions that were specified in wfc_init().
+ * \return Returns a pointer to the state object, which points into the
+ * provided memory, but not necessarily to its start.
  *
- * \return Returns zero on success or wfc_callerError if there was an error in
- * the arguments.
-*/
-int wfc_blit(
-    const wfc_State *state,
-    const unsigned char *src, unsigned char *dst);
+ * In case of error, including there not being enough memory, returns null.
+ */
+wfc_State* wfc_initInPlace(
+    void *mem, size_t memSz,
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    void *ctx,
+    bool *keep);
 
 /**
- * Allocates a new state object as a deep-copy of the provided one. The new
- * object is completely independent of the old one - you can call wfc_step() on
- * it and both objects need to be deallocated with wfc_free().
- *
- * \param state Pointer to the state object to be cloned.
+ * Returns a hash of everything the gathered patterns depend on: source pixels,
+ * n, options and bytesPerPixel. Can be used to name files that models are
+ * saved to (see wfc_saveModel()).
  *
- * \return Returns a new state object that is a copy of the provided one. If
- * state is null, null is returned instead.
-*/
-wfc_State* wfc_clone(const wfc_State *state);
+ * Parameters are the same as those of wfc_initEx(). Returns zero if src is
+ * null or any of the other parameters is not positive.
+ */
+unsigned long long wfc_modelKey(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src);
 
 /**
- * Deallocates the state object and all data owned by it. The state pointer
- * should not be used after this function is called.
+ * Saves the patterns gathered by a state, and which of them may be placed
+ * next to each other, to a file. A later wfc_initFromModel() with the same
+ * source image, n, options and bytesPerPixel can then skip gathering them.
  *
- * \param state Pointer to the state object to deallocate.
-*/
-void wfc_free(wfc_State *state);
-
-/**
- * Returns the number of wave points collapsed to a single pattern.
+ * The file is only meant to be read on the same kind of system it was saved
+ * on, by the same version of this library. Its format may change between
+ * versions, in which case older files are rejected.
  *
- * If a wave point has been reduced to a single pattern at some step, but at a
- * later step reduced to zero patterns (meaning WFC has failed), it will still
- * register towards this count.
+ * Requires defining WFC_USE_MMAP, same as wfc_setWaveFile().
  *
- * \param state State object pointer for which to query the number of collapsed
- * wave points. Must not be null.
+ * \param state State object pointer. Must not be null.
  *
- * \return Returns the number of collapsed wave points. Returns wfc_callerError
- * (a negative value) if state is null.
-*/
-int wfc_collapsedCount(const wfc_State *state);
+ * \param src The source image the state was initialized with. Must not be
+ * null.
+ *
+ * \param fd Descriptor of a file opened for both reading and writing. Its
+ * contents are replaced by the model. The header is written last, once the
+ * rest has been written out, so a file left behind by an interrupted save is
+ * rejected by wfc_initFromModel(). Other processes may have a file mapped from
+ * wfc_initFromModel(), which must not be resized under them, so save to a new
+ * file and rename it over the old one instead of saving over it.
+ *
+ * \return Returns zero on success or wfc_callerError in case of argument error,
+ * including WFC_USE_MMAP not being defined. Returns wfc_outOfMemory if the
+ * file could not be resized, mapped or written out.
+ */
+int wfc_saveModel(const wfc_State *state, const unsigned char *src, int fd);
 
 /**
- * Returns the number of unique patterns gathered from the input image when the
- * provided state object was being initialized.
+ * Same as wfc_initEx() except that, instead of being gathered from the source
+ * image, patterns are mapped in from a file saved with wfc_saveModel(). Pages
+ * of the file are shared with other processes mapping the same file, and are
+ * only read in once they're needed.
  *
- * \param state State object pointer for which to query the number of unique
- * patterns. Must not be null.
+ * Requires defining WFC_USE_MMAP, same as wfc_setWaveFile().
  *
- * \return Returns the number of unique patterns gathered from the input image.
- * Returns wfc_callerError (a negative value) if state is null.
+ * \param fd Descriptor of a file opened for reading. May be closed once this
+ * function returns.
+ *
+ * Other parameters are the same as those of wfc_initEx().
+ *
+ * \return Returns an allocated state object, which should be deallocated
+ * using wfc_free().
+ *
+ * Returns null in case of argument error, if the file does not hold a model
+ * saved for the same source image, n, options and bytesPerPixel by this version
+ * of the library, or if there was not enough memory. In that case, the state
+ * can still be initialized with wfc_initEx().
+ */
+wfc_State* wfc_initFromModel(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    void *ctx,
+    bool *keep,
+    int fd);
+
+// Memory WFC would need for a particular source image and output, as projected
+// by wfc_analyze(). All sizes are in bytes.
+typedef struct wfc_Analysis {
+    // Number of unique patterns that would be gathered from the source image.
+    int patternCount;
+    // Size of the gathered patterns.
+    size_t patternsSize;
+    // Size of the table of which patterns may be placed next to each other.
+    // It grows with the square of the number of patterns.
+    size_t overlapsSize;
+    // Size of the wave once all of its rows have been modified. Until then,
+    // rows that have not been modified share memory, so this is an upper bound.
+    size_t waveSize;
+    // Size of the state object and the other arrays it keeps for each point of
+    // the output. This is what wfc_stateSize() returns.
+    size_t stateSize;
+    // Size of the memory used only while gathering patterns, which is freed
+    // before the memory for overlaps is allocated.
+    size_t scratchSize;
+    // Sum of all sizes above, except for scratchSize.
+    size_t totalSize;
+} wfc_Analysis;
+
+/**
+ * Projects how much memory wfc_initEx() would allocate for the provided
+ * arguments, without initializing a state. This lets the caller decide whether
+ * to go through with it. Patterns still need to be gathered to know their
+ * number, so this takes part of the time initialization would. They are then
+ * freed, and neither their overlaps nor the wave are allocated.
+ *
+ * Memory that speculation (see wfc_setSpeculation()) and clones add is not
+ * included.
+ *
+ * Parameters from n to ctx are the same as those of wfc_initEx(), except that
+ * there is no destination image.
+ *
+ * \param analysis Where to write the results. Must not be null.
+ *
+ * \return Returns zero on success, wfc_callerError in case of argument error,
+ * or wfc_outOfMemory if there was not enough memory to gather patterns.
+ */
+int wfc_analyze(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    void *ctx,
+    wfc_Analysis *analysis);
+
+/**
+ * Sets the conditions under which further calls to wfc_step() will stop WFC
+ * early. These are checked at the start of each step and periodically during
+ * constraint propagation. Once WFC has been stopped, its status becomes
+ * wfc_cancelled or wfc_timedOut and the state can no longer be stepped.
+ *
+ * \param state State object pointer for which to set the limits. Must not be
+ * null.
+ *
+ * \param timeLimit Number of seconds from now, as measured by WFC_CLOCK(), that
+ * WFC may run for. If not positive, there is no time limit.
+ *
+ * \param cancel If non-null, WFC will stop shortly after the pointed to value
+ * becomes non-zero. This value may be written to from another thread. It must
+ * remain valid for as long as wfc_step() is being called on this state.
+ *
+ * \return Returns zero on success or wfc_callerError if state was null.
+*/
+int wfc_setLimits(
+    wfc_State *state, double timeLimit, const volatile int *cancel);
+
+/**
+ * Makes further calls to wfc_step() observe multiple wave points at once. Each
+ * step picks up to obsCnt points of the lowest entropy that are far enough
+ * apart from one another, observes them together and propagates constraints
+ * from them in parallel. Early on, this takes many times fewer steps than
+ * observing one point per step.
+ *
+ * Propagation from each point is first confined to the area around it. Once
+ * it reaches the edge of that area, it continues on one thread. Points observed
+ * together may turn out to be incompatible. If that leads to a contradiction,
+ * the step is undone and only the first of them is observed instead. Extra
+ * memory about the size of the wave is needed for that.
+ *
+ * The result does not depend on the number of threads used (see
+ * WFC_THREADS()). It does differ from the result of observing one point per
+ * step. Clones made with wfc_clone() keep these settings.
+ *
+ * \param state State object pointer. Must not be null.
+ *
+ * \param obsCnt Most points to observe in one step. Must be positive. If one,
+ * speculative observation is turned off and its memory is freed.
+ *
+ * \param minDist Smallest distance between points observed in the same step,
+ * counted in pixels along either axis. Must be positive. Larger distances make
+ * contradictions less likely, but fewer points can fit into the output.
+ *
+ * \return Returns zero on success or wfc_callerError in case of argument
+ * error. Returns wfc_outOfMemory if its memory could not be allocated, in which
+ * case speculative observation is turned off.
+*/
+int wfc_setSpeculation(wfc_State *state, int obsCnt, int minDist);
+
+/**
+ * Moves the wave of the state into a memory-mapped file, so that the operating
+ * system can page parts of it out when the wave doesn't fit into memory. Since
+ * propagation mostly stays within small areas, only the parts of the file being
+ * worked on need to be paged in. The wave is stored row by row, with each row
+ * of the wave starting on its own page.
+ *
+ * Only rows that still have multiple patterns at some points are placed in the
+ * file. Collapsed rows and the other arrays of the state take a few bytes per
+ * point and stay in memory. Rows that are shared with clones of the state are
+ * placed in the file once they're copied. Clones do not place their rows in
+ * the file. All rows of a freshly initialized state share a single row with
+ * all patterns present, which stays in memory, so the wave only moves into the
+ * file row by row as rows get modified.
+ *
+ * Requires defining WFC_USE_MMAP before including the implementation, which
+ * only works on POSIX systems. You may also need to define _DEFAULT_SOURCE
+ * before including any headers if you're compiling with -std=c99.
+ *
+ * \param state State object pointer. Must not be null.
+ *
+ * \param fd Descriptor of a file opened for both reading and writing. Its
+ * contents are discarded, and it is resized to fit the wave. The descriptor
+ * may be closed once this function returns. Rows in the file are not removed
+ * from it once the state is freed.
+ *
+ * \return Returns zero on success or wfc_callerError in case of argument error,
+ * including WFC_USE_MMAP not being defined. Returns wfc_outOfMemory if the
+ * file could not be resized or mapped, in which case the wave stays where it
+ * was.
+*/
+int wfc_setWaveFile(wfc_State *state, int fd);
+
+/**
+ * Seeds the random number generator of a state. From then on, the state uses
+ * its own generator instead of WFC_RAND(), so two states initialized with the
+ * same arguments and seed will go through the same steps. Clones made with
+ * wfc_clone() continue with the generator of the original state.
+ *
+ * \param state State object pointer to seed. Must not be null.
+ *
+ * \param seed Seed value for the random number generator.
+ *
+ * \return Returns zero on success or wfc_callerError if state was null.
+*/
+int wfc_setSeed(wfc_State *state, unsigned seed);
+
+/**
+ * Turns recording of observations made by wfc_step() on or off. A generation
+ * is fully determined by which pattern each observed wave point was collapsed
+ * to, in order. Recorded observations can be applied to another state with
+ * wfc_replay(), which is faster than stepping since it doesn't need to pick
+ * points or patterns. Clones made with wfc_clone() do not record.
+ *
+ * \param state State object pointer. Must not be null.
+ *
+ * \param on Whether to record. Turning recording on discards observations
+ * recorded so far. Turning it off also frees their memory.
+ *
+ * \return Returns zero on success or wfc_callerError if state was null.
+*/
+int wfc_setObservationLog(wfc_State *state, bool on);
+
+/**
+ * Gives access to observations recorded since wfc_setObservationLog() turned
+ * recording on. Each takes up two ints: the index of the wave point and the
+ * index of the pattern it was collapsed to. Observations are only meaningful to
+ * states initialized with the same arguments.
+ *
+ * \param state State object pointer. Must not be null.
+ *
+ * \param log Set to point to the observations, or to null if there are none.
+ * It's only valid until the state is stepped, has recording turned off or is
+ * freed. Must not be null.
+ *
+ * \return Returns the number of recorded observations or wfc_callerError in
+ * case of argument error.
+*/
+int wfc_observationLog(const wfc_State *state, const int **log);
+
+/**
+ * Returns the current status code for this WFC state.
+ *
+ * \param state State object pointer for which to query status. Must not be
+ * null.
+ *
+ * \return Returns the current status code, which is one of:
+ *
+ * \li 0 (zero) in case that WFC has not completed yet (you can keep calling
+ * wfc_step());
+ * \li wfc_completed (positive) in case that WFC has completed successfully;
+ * \li wfc_failed (negative) in case that WFC has reached a contradiction and
+ * failed to complete;
+ * \li wfc_callerError (negative) in case state was null;
+ * \li wfc_cancelled or wfc_timedOut (negative) in case that WFC was stopped
+ * early (see wfc_setLimits()).
+*/
+int wfc_status(const wfc_State *state);
+
+/**
+ * Performs one iteration of the WFC algorithm, observing one wave point and
+ * propagating constraints. After WFC completes, you will likely be calling
+ * wfc_blit() next.
+ *
+ * \param state State object pointer on which to perform the iteration. Must not
+ * be null.
+ *
+ * \return Returns the status code after calling wfc_step(), which is one of:
+ *
+ * \li 0 (zero) in case that WFC has not completed yet (you can keep calling
+ * wfc_step());
+ * \li wfc_completed (positive) in case that WFC has completed successfully;
+ * \li wfc_failed (negative) in case that WFC has reached a contradiction and
+ * failed to complete;
+ * \li wfc_callerError (negative) in case state was null;
+ * \li wfc_cancelled or wfc_timedOut (negative) in case that WFC was stopped
+ * early (see wfc_setLimits());
+ * \li wfc_outOfMemory (negative) in case there was not enough memory to copy
+ * the rows of the wave being modified, or to record more observations (see
+ * wfc_setObservationLog()). The state's status does not change, so wfc_step()
+ * can be called again once memory is freed up. If this happened while
+ * constraints were being propagated, the wave is left with some of them
+ * propagated, and the next step propagates the rest before observing anything.
+*/
+int wfc_step(wfc_State *state);
+
+/**
+ * Applies observations recorded with wfc_setObservationLog() to a state
+ * initialized with the same arguments, propagating constraints from each. This
+ * reproduces the wave that the recording state had after making them, without
+ * calculating entropies or using random numbers, so the state's generator is
+ * left where it was. Use it to reproduce outputs, fast-forward to a particular
+ * step or blit the same result again.
+ *
+ * If the state records observations too, the applied ones are recorded.
+ * Observations made together with speculation on (see wfc_setSpeculation())
+ * are applied one at a time, with the same result.
+ *
+ * \param state State object pointer. Must not be null.
+ *
+ * \param log Observations, as given by wfc_observationLog(). May be null if
+ * steps is zero.
+ *
+ * \param steps Number of observations to apply. Must not be negative.
+ *
+ * \return Returns the status code after the last applied observation, same as
+ * wfc_step(). Returns wfc_callerError in case of argument error, including an
+ * observation of a pattern that is not present at its wave point. Observations
+ * before it remain applied.
+*/
+int wfc_replay(wfc_State *state, const int *log, int steps);
+
+/**
+ * Runs WFC until it completes or is stopped, same as calling wfc_step() until
+ * it returns a non-zero value. Once collapsed wave points split the rest of
+ * the wave into regions that don't touch each other, those regions can no
+ * longer constrain each other, so they are completed independently and in
+ * parallel. That happens right away when kept pixels (see wfc_initEx()) leave
+ * several separate holes to fill in.
+ *
+ * Each region gets its own random number generator seeded from the state's
+ * generator (see wfc_setSeed()), so the result does not depend on the number
+ * of threads. It does differ from the result of calling wfc_step() in a loop.
+ *
+ * \param state State object pointer on which to run WFC. Must not be null.
+ *
+ * \param threads Number of threads to complete regions on. Must be positive.
+ * Regions are completed one after another on the calling thread if threads are
+ * not enabled (see WFC_USE_PTHREADS).
+ *
+ * \return Returns the status code after WFC has stopped, same as wfc_step().
+ * Also returns wfc_callerError if threads is not positive. Returns
+ * wfc_outOfMemory if there was not enough memory, in which case WFC can be
+ * continued by calling this function or wfc_step() again.
+*/
+int wfc_runRegions(wfc_State *state, int threads);
+
+/**
+ * Blits (aka. renders) the generated image to dst by copying in the pixel
+ * values. Should be called after WFC completes successfully (after wfc_step()
+ * has returned wfc_completed).
+ *
+ * \param state State object pointer. Must not be null. Must be in the completed
+ * state.
+ *
+ * \param src Pointer to pixels comprising the source image. Must not be null.
+ * Must be of the same dimensions as the image that was passed to wfc_init().
+ *
+ * \param dst Pointer to pixels comprising the destination image. Must not be
+ * null. Must be of the dimensions that were specified in wfc_init().
+ *
+ * \return Returns zero on success or wfc_callerError if there was an error in
+ * the arguments.
+*/
+int wfc_blit(
+    const wfc_State *state,
+    const unsigned char *src, unsigned char *dst);
+
+/**
+ * Allocates a new state object as a deep-copy of the provided one. The new
+ * object is completely independent of the old one - you can call wfc_step() on
+ * it and both objects need to be deallocated with wfc_free(). Patterns gathered
+ * from the source image never change after initialization, so they are shared
+ * between the two instead of being copied. It is safe to use and free clones
+ * from different threads.
+ *
+ * \param state Pointer to the state object to be cloned.
+ *
+ * \return Returns a new state object that is a copy of the provided one. If
+ * state is null or there is not enough memory, null is returned instead.
+*/
+wfc_State* wfc_clone(const wfc_State *state);
+
+/**
+ * Generates multiple outputs that share the same early layout. The state is
+ * run until the given fraction of its wave points is collapsed, then each
+ * output is finished from a clone of it (see wfc_clone()) with its own seed.
+ * The clones only copy the wave rows they modify, and share patterns and their
+ * overlaps with the state, so the shared part of the work is done only once.
+ * Outputs are finished in parallel, same as in wfc_generateBatch().
+ *
+ * To get the same shared layout each time, seed the state first (see
+ * wfc_setSeed()). The state is left where the outputs branched off, so it can
+ * be used to generate more of them later.
+ *
+ * \param state State object pointer to branch off from. Must not be null.
+ *
+ * \param src Pointer to pixels comprising the source image, see wfc_blit().
+ * Must not be null.
+ *
+ * \param prefix Fraction of wave points to collapse before branching off, from
+ * zero to one.
+ *
+ * \param threads Number of threads to finish outputs on. Must be positive.
+ *
+ * \param cnt Number of outputs to generate. Must be positive.
+ *
+ * \param seeds Seeds to finish each output with. Must not be null and must
+ * contain cnt elements.
+ *
+ * \param dsts Pointers to each of the output images. Must not be null and must
+ * contain cnt non-null elements.
+ *
+ * \param statuses If non-null, the status code of each output is written
+ * here, same as in wfc_generateBatch(). Must contain cnt elements.
+ *
+ * \return Returns zero if all outputs were generated, wfc_failed if some of
+ * them failed, wfc_callerError in case of argument error, or wfc_outOfMemory
+ * if there was not enough memory to start. If the state fails, is stopped or
+ * runs out of memory before branching off, that code is returned and written
+ * to all statuses.
+*/
+int wfc_generateVariations(
+    wfc_State *state, const unsigned char *src, double prefix,
+    int threads, int cnt, const unsigned *seeds,
+    unsigned char * const *dsts, int *statuses);
+
+/**
+ * Saves the parts of a state that change as WFC runs, so that the run can be
+ * continued later with wfc_loadState(), for example in another process. This
+ * covers which patterns are still present at each point, the status, the number
+ * of collapsed points and the position of the state's random number generator.
+ * Patterns gathered from the source image are not saved. Collapsed points take
+ * up one int each, and runs of them are stored without any gaps, so a state
+ * takes up less space the further along it is.
+ *
+ * The saved state is only meant to be loaded on the same kind of system, by the
+ * same version of this library.
+ *
+ * \param state State object pointer. Must not be null.
+ *
+ * \param buf Memory to save the state to. May be null to only find out how
+ * much memory is needed.
+ *
+ * \param bufSz Size of buf in bytes.
+ *
+ * \return Returns the number of bytes the saved state takes up. The state is
+ * only saved if bufSz is not less than that. Returns zero if state is null.
+ */
+size_t wfc_saveState(const wfc_State *state, void *buf, size_t bufSz);
+
+/**
+ * Loads a state saved with wfc_saveState() into a state, which must have been
+ * initialized with the same arguments as the saved one. Stepping the state then
+ * continues where the saved one left off. If the saved state was seeded (see
+ * wfc_setSeed()), it goes through the same steps it would have gone through.
+ * Limits, speculation and the wave file stay as they were set on the state.
+ *
+ * \param state State object pointer to load into. Must not be null.
+ *
+ * \param buf The saved state. Must not be null.
+ *
+ * \param bufSz Size of the saved state in bytes.
+ *
+ * \return Returns zero on success. Returns wfc_callerError in case of argument
+ * error, including buf not holding a state saved from one initialized with the
+ * same arguments. Returns wfc_outOfMemory if there was not enough memory. On
+ * error, the state is left unchanged.
+ */
+int wfc_loadState(wfc_State *state, const void *buf, size_t bufSz);
+
+/**
+ * Deallocates the state object and all data owned by it. The state pointer
+ * should not be used after this function is called.
+ *
+ * \param state Pointer to the state object to deallocate.
+*/
+void wfc_free(wfc_State *state);
+
+/**
+ * Returns the number of wave points collapsed to a single pattern.
+ *
+ * If a wave point has been reduced to a single pattern at some step, but at a
+ * later step reduced to zero patterns (meaning WFC has failed), it will still
+ * register towards this count.
+ *
+ * \param state State object pointer for which to query the number of collapsed
+ * wave points. Must not be null.
+ *
+ * \return Returns the number of collapsed wave points. Returns wfc_callerError
+ * (a negative value) if state is null.
+*/
+int wfc_collapsedCount(const wfc_State *state);
+
+/**
+ * Returns the number of unique patterns gathered from the input image when the
+ * provided state object was being initialized.
+ *
+ * \param state State object pointer for which to query the number of unique
+ * patterns. Must not be null.
+ *
+ * \return Returns the number of unique patterns gathered from the input image.
+ * Returns wfc_callerError (a negative value) if state is null.
 */
 int wfc_patternCount(const wfc_State *state);
 
+/**
+ * Returns the number of bytes of memory the provided state object currently
+ * uses. Rows of the wave that have not been modified share memory, as do
+ * states cloned from one another until either modifies it. Memory shared
+ * between states is split evenly between them, so that usages of all states
+ * add up to the memory they use together. This includes memory provided to
+ * wfc_initInPlace().
+ *
+ * \param state State object pointer for which to query memory usage.
+ *
+ * \return Returns the number of bytes used, or zero if state is null.
+*/
+size_t wfc_memoryUsage(const wfc_State *state);
+
 /**
  * Returns whether a particular pattern is still present at the wave point with
  * the given coordinates. As WFC iterates, patterns from wave points get removed
@@ -533,6 +1458,84 @@ const unsigned char* wfc_pixelToBlitAt(
     const wfc_State *state, const unsigned char *src,
     int patt, int x, int y);
 
+/**
+ * Starts running WFC asynchronously. Pattern gathering, observation and
+ * propagation all happen on a worker thread, after which the result is blitted
+ * to dst. Arguments are the same as those of wfc_generateEx().
+ *
+ * All pointers passed in must remain valid until the run is done (see
+ * wfc_poll() and wfc_wait()). dst should not be read from before then. If
+ * threads are not enabled or none could be started, the run is done on the
+ * calling thread before this function returns.
+ *
+ * \return Returns a handle to the asynchronous run. It should be deallocated
+ * using wfc_freeAsync(). Returns null if the handle could not be allocated.
+ * Errors in other arguments are reported through the status of the run.
+ */
+wfc_Async* wfc_startAsync(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    bool *keep);
+
+/**
+ * Returns the status of an asynchronous run without blocking.
+ *
+ * \param async Handle to the asynchronous run. Must not be null.
+ *
+ * \return Returns:
+ *
+ * \li 0 (zero) in case that the run is not done yet;
+ * \li wfc_completed (positive) in case that WFC has completed successfully and
+ * the result has been written to dst;
+ * \li a negative status code in case of failure, with the same meaning as
+ * the return value of wfc_generateLimited();
+ * \li wfc_callerError (negative) in case async was null.
+ */
+int wfc_poll(const wfc_Async *async);
+
+/**
+ * Blocks until an asynchronous run is done.
+ *
+ * \param async Handle to the asynchronous run. Must not be null.
+ *
+ * \return Returns the final status of the run, which is wfc_completed in case
+ * of success or a negative status code otherwise (see wfc_poll()).
+ */
+int wfc_wait(wfc_Async *async);
+
+/**
+ * Requests that an asynchronous run be stopped. This does not block, the run
+ * will end with wfc_cancelled status shortly after. Has no effect if the run is
+ * already done.
+ *
+ * \param async Handle to the asynchronous run. Must not be null.
+ *
+ * \return Returns zero on success or wfc_callerError if async was null.
+ */
+int wfc_cancel(wfc_Async *async);
+
+/**
+ * Returns the number of wave points collapsed so far in an asynchronous run.
+ * Can be used to report progress. See wfc_collapsedCount().
+ *
+ * \param async Handle to the asynchronous run. Must not be null.
+ *
+ * \return Returns the number of collapsed wave points. Returns zero if the
+ * run hasn't finished initializing yet. Returns wfc_callerError (a negative
+ * value) if async is null.
+ */
+int wfc_asyncCollapsedCount(const wfc_Async *async);
+
+/**
+ * Deallocates the handle to an asynchronous run. If the run is not done yet,
+ * it is cancelled and waited for first.
+ *
+ * \param async Handle to deallocate.
+ */
+void wfc_freeAsync(wfc_Async *async);
+
 #ifdef __cplusplus
 }
 #endif
@@ -544,10 +1547,32 @@ const unsigned char* wfc_pixelToBlitAt(
 #ifdef WFC_IMPLEMENTATION
 
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef WFC_USE_PTHREADS
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(WFC_USE_HUGE_PAGES) && defined(__linux__)
+#define WFC__HUGE_PAGES
+#endif
+
+#if defined(WFC__HUGE_PAGES) || defined(WFC_USE_MMAP)
+#include <sys/mman.h>
+#endif
+
+#ifdef WFC_USE_MMAP
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
 
 #ifndef WFC_ASSERT
 #include <assert.h>
@@ -567,16 +1592,40 @@ const unsigned char* wfc_pixelToBlitAt(
 #define WFC_RAND(ctx) wfc__rand()
 #endif
 
-// basic utility
+// This macro should return the current time in seconds.
+#ifndef WFC_CLOCK
+#define WFC_CLOCK(ctx) wfc__clock()
+#endif
 
-int wfc__min_i(int a, int b) {
-    return a < b ? a : b;
+// This macro should return the number of threads
+// to use for work that is parallelized internally.
+#ifndef WFC_THREADS
+#define WFC_THREADS(ctx) wfc__threadCnt()
+#endif
+
+// If defined, WFC_PARALLEL_FOR(ctx, cnt, fn, data) should call fn(data, i)
+// for each i in [0, cnt) and return once all of those calls have returned.
+// Otherwise, WFC starts its own threads (see wfc__parallelFor()).
+
+// Number of worker threads backing asynchronous runs.
+#ifndef WFC_ASYNC_THREADS
+#define WFC_ASYNC_THREADS 2
+#endif
+
+// basic utility
+
+int wfc__min_i(int a, int b) {
+    return a < b ? a : b;
 }
 
 int wfc__max_i(int a, int b) {
     return a < b ? b : a;
 }
 
+long long wfc__min_ll(long long a, long long b) {
+    return a < b ? a : b;
+}
+
 float wfc__min_f(float a, float b) {
     return a < b ? a : b;
 }
@@ -593,6 +1642,22 @@ int wfc__roundUpToDivBy(int n, int div) {
     return ((n + div - 1) / div) * div;
 }
 
+// Sizes are combined with these, which give SIZE_MAX instead of overflowing.
+// No allocation of that size can succeed,
+// so a size that doesn't fit ends up handled as running out of memory.
+
+size_t wfc__addSz(size_t a, size_t b) {
+    return a > SIZE_MAX - b ? SIZE_MAX : a + b;
+}
+
+size_t wfc__mulSz(size_t a, size_t b) {
+    return b != 0 && a > SIZE_MAX / b ? SIZE_MAX : a * b;
+}
+
+size_t wfc__alignUp(size_t sz, size_t align) {
+    return wfc__addSz(sz, align - 1) / align * align;
+}
+
 // a and b must be non-negative.
 // Assumes IEEE 754 representation of float on the system.
 bool wfc__approxEqNonNeg_f(float a, float b) {
@@ -649,10 +1714,58 @@ float wfc__rand(void) {
     return (float)rand() / ((float)RAND_MAX + 1.0f);
 }
 
-// [0, n)
-int wfc__rand_i(void *ctx, int n) {
+// Random number generator that can be seeded per state.
+// Until it is seeded, WFC_RAND() is used instead.
+// Seeded generator uses the SplitMix64 algorithm.
+struct wfc__Rng {
+    bool seeded;
+    uint64_t state;
+};
+
+void wfc__rngSeed(struct wfc__Rng *rng, uint64_t seed) {
+    rng->seeded = true;
+    rng->state = seed;
+}
+
+// Advances SplitMix64 state and returns the next 64 random bits.
+uint64_t wfc__splitMix64(uint64_t *state) {
+    *state += 0x9E3779B97F4A7C15ull;
+
+    uint64_t z = *state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// [0, 1)
+float wfc__rngNext(void *ctx, struct wfc__Rng *rng) {
+    (void)ctx;
+
+    if (!rng->seeded) return WFC_RAND(ctx);
+
+    uint64_t z = wfc__splitMix64(&rng->state);
+
+    // Top 24 bits fit exactly into the mantissa of a float.
+    return (float)(z >> 40) / 16777216.0f;
+}
+
+// Returns 64 random bits, used for seeding other generators.
+uint64_t wfc__rngNext64(void *ctx, struct wfc__Rng *rng) {
     (void)ctx;
-    return (int)(WFC_RAND(ctx) * (float)n);
+
+    if (rng->seeded) return wfc__splitMix64(&rng->state);
+
+    // Each value from WFC_RAND() carries at most 24 random bits.
+    uint64_t bits = 0;
+    for (int i = 0; i < 3; ++i) {
+        bits = (bits << 24) ^ (uint64_t)(WFC_RAND(ctx) * 16777216.0f);
+    }
+    return bits;
+}
+
+// [0, n)
+int wfc__rand_i(void *ctx, struct wfc__Rng *rng, int n) {
+    return (int)(wfc__rngNext(ctx, rng) * (float)n);
 }
 
 // Wraps ind into range [0, sz).
@@ -661,8 +1774,488 @@ int wfc__indWrap(int ind, int sz) {
     return sz + ind % sz;
 }
 
+// time utility
+
+// Time in seconds, from a clock that never goes back if there is one.
+// Falls back to wall-clock time, and then to processor time.
+double wfc__clock(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    }
+#elif defined(TIME_MONOTONIC)
+    struct timespec ts;
+    if (timespec_get(&ts, TIME_MONOTONIC) == TIME_MONOTONIC) {
+        return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    }
+#elif defined(TIME_UTC)
+    struct timespec ts;
+    if (timespec_get(&ts, TIME_UTC) == TIME_UTC) {
+        return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    }
+#endif
+
+    return (double)clock() / (double)CLOCKS_PER_SEC;
+}
+
+// thread utility
+
+// Reads a value that may be concurrently written to from another thread.
+int wfc__loadShared_i(const volatile int *p) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+    return *p;
+#endif
+}
+
+// Atomically adds to a value shared between threads.
+// Returns the new value.
+int wfc__addShared_i(volatile int *p, int val) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_add_fetch(p, val, __ATOMIC_ACQ_REL);
+#else
+    *p += val;
+    return *p;
+#endif
+}
+
+// Writes a value that may be concurrently read from another thread.
+void wfc__storeShared_i(volatile int *p, int val) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+#else
+    *p = val;
+#endif
+}
+
+// The functions below are sequentially consistent,
+// which lock-free code relying on the order of several shared values needs.
+
+unsigned wfc__loadShared_u(const volatile unsigned *p) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#else
+    return *p;
+#endif
+}
+
+// Atomically clears the bits not set in mask.
+// Returns the value from before.
+unsigned wfc__andShared_u(volatile unsigned *p, unsigned mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_fetch_and(p, mask, __ATOMIC_SEQ_CST);
+#else
+    unsigned old = *p;
+    *p &= mask;
+    return old;
+#endif
+}
+
+void wfc__storeShared_u8(volatile uint8_t *p, uint8_t val) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(p, val, __ATOMIC_SEQ_CST);
+#else
+    *p = val;
+#endif
+}
+
+// Atomically replaces the value.
+// Returns the value from before.
+uint8_t wfc__exchangeShared_u8(volatile uint8_t *p, uint8_t val) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST);
+#else
+    uint8_t old = *p;
+    *p = val;
+    return old;
+#endif
+}
+
+long long wfc__loadShared_ll(const volatile long long *p) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#else
+    return *p;
+#endif
+}
+
+void wfc__storeShared_ll(volatile long long *p, long long val) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(p, val, __ATOMIC_SEQ_CST);
+#else
+    *p = val;
+#endif
+}
+
+// Atomically replaces the value if it equals expected.
+// Returns whether it was replaced.
+bool wfc__casShared_ll(
+    volatile long long *p, long long expected, long long val) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_compare_exchange_n(
+        p, &expected, val, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+    if (*p != expected) return false;
+    *p = val;
+    return true;
+#endif
+}
+
+// Number of processors available, or 1 if threads are not enabled.
+int wfc__threadCnt(void) {
+#ifdef WFC_USE_PTHREADS
+    long cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cnt >= 1) return (int)cnt;
+#endif
+    return 1;
+}
+
+// Without WFC_USE_PTHREADS, these wrappers do nothing
+// and starting a thread runs its function to completion on the calling thread.
+// Code using them must not wait on a condition
+// that can only be fulfilled by another thread.
+#ifdef WFC_USE_PTHREADS
+typedef pthread_mutex_t wfc__Mutex;
+typedef pthread_cond_t wfc__Cond;
+#else
+typedef int wfc__Mutex;
+typedef int wfc__Cond;
+#endif
+
+struct wfc__Thread {
+#ifdef WFC_USE_PTHREADS
+    pthread_t thread;
+#endif
+    // False if the function was run to completion on the calling thread.
+    bool started;
+};
+
+void wfc__mutexInit(wfc__Mutex *mutex) {
+#ifdef WFC_USE_PTHREADS
+    pthread_mutex_init(mutex, NULL);
+#else
+    *mutex = 0;
+#endif
+}
+
+void wfc__mutexDestroy(wfc__Mutex *mutex) {
+#ifdef WFC_USE_PTHREADS
+    pthread_mutex_destroy(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+void wfc__mutexLock(wfc__Mutex *mutex) {
+#ifdef WFC_USE_PTHREADS
+    pthread_mutex_lock(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+void wfc__mutexUnlock(wfc__Mutex *mutex) {
+#ifdef WFC_USE_PTHREADS
+    pthread_mutex_unlock(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+void wfc__condInit(wfc__Cond *cond) {
+#ifdef WFC_USE_PTHREADS
+    pthread_cond_init(cond, NULL);
+#else
+    *cond = 0;
+#endif
+}
+
+void wfc__condDestroy(wfc__Cond *cond) {
+#ifdef WFC_USE_PTHREADS
+    pthread_cond_destroy(cond);
+#else
+    (void)cond;
+#endif
+}
+
+void wfc__condWait(wfc__Cond *cond, wfc__Mutex *mutex) {
+#ifdef WFC_USE_PTHREADS
+    pthread_cond_wait(cond, mutex);
+#else
+    (void)cond;
+    (void)mutex;
+#endif
+}
+
+void wfc__condBroadcast(wfc__Cond *cond) {
+#ifdef WFC_USE_PTHREADS
+    pthread_cond_broadcast(cond);
+#else
+    (void)cond;
+#endif
+}
+
+// Returns whether a new thread was started.
+bool wfc__threadTryStart(
+    struct wfc__Thread *thread, void* (*fn)(void*), void *arg) {
+    thread->started = false;
+#ifdef WFC_USE_PTHREADS
+    thread->started = pthread_create(&thread->thread, NULL, fn, arg) == 0;
+#else
+    (void)fn;
+    (void)arg;
+#endif
+
+    return thread->started;
+}
+
+// If a new thread can't be started,
+// the function is run on the calling thread instead.
+void wfc__threadStart(
+    struct wfc__Thread *thread, void* (*fn)(void*), void *arg) {
+    if (!wfc__threadTryStart(thread, fn, arg)) fn(arg);
+}
+
+void wfc__threadJoin(struct wfc__Thread *thread) {
+#ifdef WFC_USE_PTHREADS
+    if (thread->started) pthread_join(thread->thread, NULL);
+#else
+    (void)thread;
+#endif
+}
+
+// Lets other threads run while this one waits on them.
+void wfc__threadYield(void) {
+#ifdef WFC_USE_PTHREADS
+    sched_yield();
+#endif
+}
+
+// parallel loop utility
+
+// Range of loop indexes belonging to one worker.
+// The owner takes indexes from the front, others steal from the back.
+struct wfc__Deque {
+    wfc__Mutex mutex;
+    int lo, hi;
+};
+
+struct wfc__ParallelFor {
+    void (*fn)(void *data, int ind);
+    void *data;
+    int workerCnt;
+    struct wfc__Deque *deques;
+};
+
+struct wfc__ParallelForWorker {
+    struct wfc__ParallelFor *loop;
+    int ind;
+    struct wfc__Thread thread;
+};
+
+// Returns the next index to process or -1 if all are taken.
+int wfc__takeLoopInd(struct wfc__ParallelFor *loop, int workerInd) {
+    int ind = -1;
+
+    struct wfc__Deque *own = &loop->deques[workerInd];
+    wfc__mutexLock(&own->mutex);
+    if (own->lo < own->hi) ind = own->lo++;
+    wfc__mutexUnlock(&own->mutex);
+
+    for (int i = 1; ind < 0 && i < loop->workerCnt; ++i) {
+        struct wfc__Deque *victim =
+            &loop->deques[(workerInd + i) % loop->workerCnt];
+
+        wfc__mutexLock(&victim->mutex);
+        if (victim->lo < victim->hi) ind = --victim->hi;
+        wfc__mutexUnlock(&victim->mutex);
+    }
+
+    return ind;
+}
+
+void* wfc__parallelForWorker(void *arg) {
+    struct wfc__ParallelForWorker *worker = (struct wfc__ParallelForWorker*)arg;
+
+    int ind;
+    while ((ind = wfc__takeLoopInd(worker->loop, worker->ind)) >= 0) {
+        worker->loop->fn(worker->loop->data, ind);
+    }
+
+    return NULL;
+}
+
+// Calls fn for each index in [0, cnt), spread across threads.
+// All parallel work goes through here,
+// so that it can be handed off to WFC_PARALLEL_FOR() if defined.
+// Otherwise, each thread starts with an equal share of indexes
+// and steals from others once it runs out.
+void wfc__parallelFor(
+    void *ctx, int threads, int cnt,
+    void (*fn)(void *data, int ind), void *data) {
+    (void)ctx;
+
+    int workerCnt = wfc__min_i(threads, cnt);
+    if (workerCnt <= 1) {
+        for (int i = 0; i < cnt; ++i) fn(data, i);
+        return;
+    }
+
+#ifdef WFC_PARALLEL_FOR
+    WFC_PARALLEL_FOR(ctx, cnt, fn, data);
+#else
+
+    struct wfc__ParallelFor loop;
+    loop.fn = fn;
+    loop.data = data;
+    loop.workerCnt = workerCnt;
+    loop.deques = (struct wfc__Deque*)WFC_MALLOC(
+        ctx, (size_t)workerCnt * sizeof(*loop.deques));
+
+    struct wfc__ParallelForWorker *workers =
+        (struct wfc__ParallelForWorker*)WFC_MALLOC(
+            ctx, (size_t)workerCnt * sizeof(*workers));
+
+    // Without memory for bookkeeping, the loop can still run on this thread.
+    if (loop.deques == NULL || workers == NULL) {
+        if (workers != NULL) WFC_FREE(ctx, workers);
+        if (loop.deques != NULL) WFC_FREE(ctx, loop.deques);
+
+        for (int i = 0; i < cnt; ++i) fn(data, i);
+        return;
+    }
+
+    for (int i = 0; i < workerCnt; ++i) {
+        wfc__mutexInit(&loop.deques[i].mutex);
+        loop.deques[i].lo = (int)((long long)cnt * i / workerCnt);
+        loop.deques[i].hi = (int)((long long)cnt * (i + 1) / workerCnt);
+
+        workers[i].loop = &loop;
+        workers[i].ind = i;
+    }
+
+    // The calling thread is one of the workers.
+    for (int i = 1; i < workerCnt; ++i) {
+        wfc__threadStart(
+            &workers[i].thread, wfc__parallelForWorker, &workers[i]);
+    }
+    wfc__parallelForWorker(&workers[0]);
+    for (int i = 1; i < workerCnt; ++i) {
+        wfc__threadJoin(&workers[i].thread);
+    }
+
+    for (int i = 0; i < workerCnt; ++i) {
+        wfc__mutexDestroy(&loop.deques[i].mutex);
+    }
+    WFC_FREE(ctx, workers);
+    WFC_FREE(ctx, loop.deques);
+#endif
+}
+
+// large allocation utility
+
+enum {
+    // Arrays in a state's memory, as well as rows in a row arena,
+    // each start on their own cache line.
+    wfc__cacheLineSz = 64,
+    // Memory backed by transparent huge pages is aligned to this.
+    wfc__hugePageSz = 2 * 1024 * 1024,
+    // Rows mapped from a file each start on a page of their own.
+    wfc__filePageSz = 4096
+};
+
+// Whether the wave and overlaps should be backed by huge pages.
+bool wfc__hugePagesOn(int options) {
+#ifdef WFC__HUGE_PAGES
+    return (options & wfc_optHugePages) != 0;
+#else
+    (void)options;
+    return false;
+#endif
+}
+
+// Maps in zeroed memory and advises the kernel to back it by huge pages.
+// Pages are only allocated once touched,
+// so they end up on the NUMA node of the thread that first writes to them.
+// Returns null if the memory could not be mapped,
+// in which case the caller should fall back to WFC_MALLOC().
+void* wfc__mapHuge(size_t sz) {
+#ifdef WFC__HUGE_PAGES
+    const size_t mapSz = wfc__alignUp(sz, wfc__hugePageSz);
+    // Extra memory is mapped so that the start can be aligned,
+    // and then the parts before and after are unmapped.
+    const size_t padSz = wfc__addSz(mapSz, wfc__hugePageSz);
+    if (padSz == SIZE_MAX) return NULL;
+
+    unsigned char *p = (unsigned char*)mmap(
+        NULL, padSz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    const size_t head =
+        (wfc__hugePageSz - (uintptr_t)p % wfc__hugePageSz) % wfc__hugePageSz;
+    if (head > 0) munmap(p, head);
+    munmap(p + head + mapSz, padSz - head - mapSz);
+    p += head;
+
+    // This is only advice, memory works the same if it's not taken.
+    madvise(p, mapSz, MADV_HUGEPAGE);
+
+    return p;
+#else
+    (void)sz;
+    return NULL;
+#endif
+}
+
+// sz must be the same as was passed to wfc__mapHuge().
+void wfc__unmapHuge(void *p, size_t sz) {
+#ifdef WFC__HUGE_PAGES
+    munmap(p, wfc__alignUp(sz, wfc__hugePageSz));
+#else
+    (void)p;
+    (void)sz;
+#endif
+}
+
+// Maps in a file, resized to the given size and zeroed.
+// Changes to the memory are written back to the file,
+// so the operating system is free to page it out.
+// Returns null if the file could not be resized or mapped.
+void* wfc__mapFile(int fd, size_t sz) {
+#ifdef WFC_USE_MMAP
+    if ((off_t)sz < 0 || (size_t)(off_t)sz != sz) return NULL;
+
+    // Truncating first discards what was in the file.
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)sz) != 0) return NULL;
+
+    void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return p != MAP_FAILED ? p : NULL;
+#else
+    (void)fd;
+    (void)sz;
+    return NULL;
+#endif
+}
+
+void wfc__unmapFile(void *p, size_t sz) {
+#ifdef WFC_USE_MMAP
+    munmap(p, sz);
+#else
+    (void)p;
+    (void)sz;
+#endif
+}
+
 // multi-dimensional array utility
 
+// Indexes are calculated in ptrdiff_t and sizes with wfc__mulSz(),
+// so that arrays can hold more elements than an int can count.
+// Lengths are still ints, and are only taken of arrays
+// whose dimensions were checked to allow that (see wfc__countsFit()).
+
 #define WFC__A2D_DEF(type, abbrv) \
     struct wfc__A2d_##abbrv { \
         int d02, d12; \
@@ -671,16 +2264,19 @@ int wfc__indWrap(int ind, int sz) {
 
 #define WFC__A2D_LEN(arr) ((arr).d02 * (arr).d12)
 
-#define WFC__A2D_SIZE(arr) ((size_t)WFC__A2D_LEN(arr) * sizeof(*(arr).a))
+#define WFC__A2D_SIZE(arr) \
+    wfc__mulSz( \
+        wfc__mulSz((size_t)(arr).d02, (size_t)(arr).d12), \
+        sizeof(*(arr).a))
 
 #define WFC__A2D_GET(arr, c0, c1) \
     ((arr).a[ \
-        (c0) * (arr).d12 + \
+        (ptrdiff_t)(c0) * (arr).d12 + \
         (c1)])
 
 #define WFC__A2D_GET_WRAP(arr, c0, c1) \
     ((arr).a[ \
-        wfc__indWrap(c0, (arr).d02) * (arr).d12 + \
+        (ptrdiff_t)wfc__indWrap(c0, (arr).d02) * (arr).d12 + \
         wfc__indWrap(c1, (arr).d12)])
 
 #define WFC__A3D_DEF(type, abbrv) \
@@ -691,18 +2287,23 @@ int wfc__indWrap(int ind, int sz) {
 
 #define WFC__A3D_LEN(arr) ((arr).d03 * (arr).d13 * (arr).d23)
 
-#define WFC__A3D_SIZE(arr) ((size_t)WFC__A3D_LEN(arr) * sizeof(*(arr).a))
+#define WFC__A3D_SIZE(arr) \
+    wfc__mulSz( \
+        wfc__mulSz( \
+            wfc__mulSz((size_t)(arr).d03, (size_t)(arr).d13), \
+            (size_t)(arr).d23), \
+        sizeof(*(arr).a))
 
 #define WFC__A3D_GET(arr, c0, c1, c2) \
     ((arr).a[ \
-        (c0) * (arr).d13 * (arr).d23 + \
-        (c1) * (arr).d23 + \
+        (ptrdiff_t)(c0) * (arr).d13 * (arr).d23 + \
+        (ptrdiff_t)(c1) * (arr).d23 + \
         (c2)])
 
 #define WFC__A3D_GET_WRAP(arr, c0, c1, c2) \
     ((arr).a[ \
-        wfc__indWrap(c0, (arr).d03) * (arr).d13 * (arr).d23 + \
-        wfc__indWrap(c1, (arr).d13) * (arr).d23 + \
+        (ptrdiff_t)wfc__indWrap(c0, (arr).d03) * (arr).d13 * (arr).d23 + \
+        (ptrdiff_t)wfc__indWrap(c1, (arr).d13) * (arr).d23 + \
         wfc__indWrap(c2, (arr).d23)])
 
 #define WFC__A4D_DEF(type, abbrv) \
@@ -713,20 +2314,28 @@ int wfc__indWrap(int ind, int sz) {
 
 #define WFC__A4D_LEN(arr) ((arr).d04 * (arr).d14 * (arr).d24 * (arr).d34)
 
-#define WFC__A4D_SIZE(arr) ((size_t)WFC__A4D_LEN(arr) * sizeof(*(arr).a))
+#define WFC__A4D_SIZE(arr) \
+    wfc__mulSz( \
+        wfc__mulSz( \
+            wfc__mulSz( \
+                wfc__mulSz((size_t)(arr).d04, (size_t)(arr).d14), \
+                (size_t)(arr).d24), \
+            (size_t)(arr).d34), \
+        sizeof(*(arr).a))
 
 #define WFC__A4D_GET(arr, c0, c1, c2, c3) \
     ((arr).a[ \
-        (c0) * (arr).d14 * (arr).d24 * (arr).d34 + \
-        (c1) * (arr).d24 * (arr).d34 + \
-        (c2) * (arr).d34 + \
+        (ptrdiff_t)(c0) * (arr).d14 * (arr).d24 * (arr).d34 + \
+        (ptrdiff_t)(c1) * (arr).d24 * (arr).d34 + \
+        (ptrdiff_t)(c2) * (arr).d34 + \
         (c3)])
 
 #define WFC__A4D_GET_WRAP(arr, c0, c1, c2, c3) \
     ((arr).a[ \
-        wfc__indWrap(c0, (arr).d04) * (arr).d14 * (arr).d24 * (arr).d34 + \
-        wfc__indWrap(c1, (arr).d14) * (arr).d24 * (arr).d34 + \
-        wfc__indWrap(c2, (arr).d24) * (arr).d34 + \
+        (ptrdiff_t)wfc__indWrap(c0, (arr).d04) * \
+            (arr).d14 * (arr).d24 * (arr).d34 + \
+        (ptrdiff_t)wfc__indWrap(c1, (arr).d14) * (arr).d24 * (arr).d34 + \
+        (ptrdiff_t)wfc__indWrap(c2, (arr).d24) * (arr).d34 + \
         wfc__indWrap(c3, (arr).d34)])
 
 void wfc__indToCoords2d(int d1, int ind, int *c0, int *c1) {
@@ -749,7 +2358,10 @@ enum {
     // that each calculate their part of the result,
     // which is then aggregated into the final result.
     // This improves CPU instruction-level parallelism.
-    wfc__loopChannels = 4
+    wfc__loopChannels = 4,
+    // Loops with cheap iterations are run in parallel in blocks of this size,
+    // so that threads don't need to synchronize for every iteration.
+    wfc__parallelBlockLen = 64
 };
 
 // H and V are used in public API, prefer to use C0/1/... in private code.
@@ -757,7 +2369,27 @@ enum {
     wfc__optFlipC0 = wfc_optFlipV,
     wfc__optFlipC1 = wfc_optFlipH,
     wfc__optEdgeFixC0 = wfc_optEdgeFixV,
-    wfc__optEdgeFixC1 = wfc_optEdgeFixH
+    wfc__optEdgeFixC1 = wfc_optEdgeFixH,
+
+    // Private options, never passed in through public API.
+    // Wave does not wrap around along a dimension.
+    // This is implied by fixing edges along it,
+    // but parts of a larger output need it without restricting the patterns
+    // that may be placed along their edges.
+    wfc__optNoWrapC0 = 1 << 16,
+    wfc__optNoWrapC1 = 1 << 17
+};
+
+// Sides of the output, used to tell which sides of a part of the output
+// are also sides of the whole output.
+enum {
+    wfc__sideC0Lo = 1 << 0,
+    wfc__sideC0Hi = 1 << 1,
+    wfc__sideC1Lo = 1 << 2,
+    wfc__sideC1Hi = 1 << 3,
+
+    wfc__sideAll =
+        wfc__sideC0Lo | wfc__sideC0Hi | wfc__sideC1Lo | wfc__sideC1Hi
 };
 
 // Transformations for patterns are encoded in a bitmask.
@@ -834,6 +2466,17 @@ void wfc__coords2dPlusDir(
     if (rC1 != NULL) *rC1 = rC1_;
 }
 
+// Returns the 1D index of the neighbouring point in a particular direction,
+// wrapping around the edges of a d0 by d1 array.
+int wfc__neighbourInd(
+    void *ctx, int d0, int d1, int c0, int c1, enum wfc__Dir dir) {
+    int nC0, nC1;
+    wfc__coords2dPlusDir(ctx, c0, c1, dir, &nC0, &nC1);
+
+    return wfc__coords2dToInd(
+        d1, wfc__indWrap(nC0, d0), wfc__indWrap(nC1, d1));
+}
+
 // uint8_ts are used instead of bools for performance concerns.
 WFC__A2D_DEF(bool, b);
 WFC__A2D_DEF(uint8_t, u8);
@@ -876,71 +2519,642 @@ void wfc__setBitA3d(
     wfc__setBit(&WFC__A3D_GET(arr, c0, c1, 0), c2, val);
 }
 
-// Bit packs may have surplus bit positions that need to equal 0.
-// That is why a function to set all bits to 1 is not provided
-// as it would be easy to make the mistake of setting surplus bits to 1.
-void wfc__clearBitPackA3d(
-    const struct wfc__A3d_u arr, int c0, int c1) {
-    memset(&WFC__A3D_GET(arr, c0, c1, 0), 0, (size_t)arr.d23 * sizeof(*arr.a));
+// wave utility
+
+// The wave is stored as a list of rows, each holding patterns present
+// at the points with the same c0 coordinate.
+// Rows may be shared between waves, eg. of a state and its clones,
+// as well as between different rows of the same wave,
+// and only get copied once they need to be modified (copy-on-write).
+// This way, initializing or cloning a wave takes time proportional
+// to its number of rows, instead of to its full size.
+// Once all points in a row are collapsed, it's replaced with a collapsed row,
+// which only holds the index of each point's pattern.
+struct wfc__WaveRow {
+    // Number of references to this row, across all waves.
+    volatile int refCnt;
+    // Whether this is a collapsed row.
+    bool collapsed;
+    // Arena the row is placed in, or null if it was allocated on its own.
+    struct wfc__RowArena *arena;
+    // Patterns of the row's points are placed right after this header.
+    // In collapsed rows, that's a pattern index for each point,
+    // or -1 for a point left with no patterns.
+    // Otherwise, it's a list length for each point (see wfc__Pnt),
+    // or -1 for a point stored as a bit pack,
+    // followed by d23 elements for each point to store either in.
+};
+
+struct wfc__Wave {
+    int d03, d13, d23;
+    struct wfc__WaveRow **rows;
+    // Where rows of this wave are placed when they get copied,
+    // or null if they are allocated on their own.
+    struct wfc__RowArena *arena;
+};
+
+// Memory for rows of a wave, either backed by huge pages (see wfc__mapHuge())
+// or mapped from a file (see wfc__mapFile()).
+// Each row of the wave has its own slot,
+// which the row gets placed in whenever it's copied or expanded,
+// unless an older copy of the row is still there.
+// Other waves may keep referencing rows in the arena,
+// so it's only unmapped once no rows are left in it.
+struct wfc__RowArena {
+    // One reference is held by the wave, and one by each row in a slot.
+    volatile int refCnt;
+    int slotCnt;
+    size_t slotSz;
+    // Whether slots are mapped from a file.
+    bool file;
+    // A slot is free while the reference count of the row in it is zero,
+    // which is also what it is in newly mapped memory.
+    unsigned char *slots;
+};
+
+enum {
+    // Points with this few patterns present are stored as lists,
+    // as long as those fit where their bit pack was.
+    // That way, work done on them scales with the number of their patterns
+    // rather than with the number of all patterns.
+    wfc__maxListLen = 64,
+    // With fewer patterns than this many bit pack elements hold,
+    // going through bit packs is cheap enough that lists don't pay off.
+    wfc__minListPackLen = 4
+};
+
+// Patterns present at a wave point,
+// either as a bit pack or as a list of pattern indexes in increasing order.
+// Patterns get removed from lists by being set to -1,
+// which can be done from multiple threads at once
+// (see wfc__propagateOntoDirectionShared()), and are skipped over.
+// Collapsed points are read as lists of length one.
+struct wfc__Pnt {
+    // NULL if patterns are listed.
+    const unsigned *pack;
+    const int *list;
+    int len;
+};
+
+size_t wfc__waveRowSize(const struct wfc__Wave wave) {
+    const size_t lensSz = wfc__mulSz((size_t)wave.d13, sizeof(int));
+    const size_t slotsSz = wfc__mulSz(
+        wfc__mulSz((size_t)wave.d13, (size_t)wave.d23), sizeof(unsigned));
+
+    return wfc__addSz(
+        wfc__addSz(sizeof(struct wfc__WaveRow), lensSz), slotsSz);
 }
 
-int wfc__popcountBitPackA3d(
-    const struct wfc__A3d_u arr, int c0, int c1) {
-    int cnt = 0;
-    for (int i = 0; i < arr.d23; ++i) {
-        cnt += wfc__popcount_u(WFC__A3D_GET(arr, c0, c1, i));
-    }
+size_t wfc__waveCollapsedRowSize(const struct wfc__Wave wave) {
+    return wfc__addSz(
+        sizeof(struct wfc__WaveRow),
+        wfc__mulSz((size_t)wave.d13, sizeof(int)));
+}
 
-    return cnt;
+// Pattern indexes of a collapsed row, or list lengths of other rows.
+int* wfc__waveRowLens(struct wfc__WaveRow *row) {
+    return (int*)(row + 1);
 }
 
-struct wfc__Pattern {
-    // Coordinates of the top-left pixel in the source image.
-    int c0, c1;
-    // Bitmask for transformation done to produce this pattern.
-    int tf;
+unsigned* wfc__waveRowSlot(
+    const struct wfc__Wave wave, struct wfc__WaveRow *row, int c1) {
+    unsigned *slots = (unsigned*)(wfc__waveRowLens(row) + wave.d13);
 
-    // Whether this pattern may be placed along a particular edge in output.
-    bool edgeC0Lo, edgeC0Hi, edgeC1Lo, edgeC1Hi;
-    // How often this pattern appeared in different places in the source image.
-    int freq;
-};
+    return slots + (size_t)c1 * (size_t)wave.d23;
+}
 
-void wfc__coordsPattToSrc(
-    int n,
-    struct wfc__Pattern patt, int pC0, int pC1,
-    int sD0, int sD1, int *sC0, int *sC1) {
-    int tfC0 = pC0;
-    int tfC1 = pC1;
+// Maps slots from the file if fd is not negative,
+// and backs them by huge pages otherwise.
+// Returns null if there is not enough memory or the file could not be mapped.
+struct wfc__RowArena* wfc__makeRowArena(
+    void *ctx, const struct wfc__Wave wave, int fd) {
+    (void)ctx;
 
-    // Map from pattern space to source space.
-    {
-        if (patt.tf & wfc__tfFlipC0) tfC0 = n - 1 - tfC0;
-        if (patt.tf & wfc__tfFlipC1) tfC1 = n - 1 - tfC1;
+    struct wfc__RowArena *arena =
+        (struct wfc__RowArena*)WFC_MALLOC(ctx, sizeof(*arena));
+    if (arena == NULL) return NULL;
+    arena->refCnt = 1;
+    arena->slotCnt = wave.d03;
+    arena->file = fd >= 0;
+    arena->slotSz = wfc__alignUp(
+        wfc__waveRowSize(wave),
+        arena->file ? wfc__filePageSz : wfc__cacheLineSz);
+
+    const size_t sz = wfc__mulSz((size_t)arena->slotCnt, arena->slotSz);
+    arena->slots = (unsigned char*)
+        (arena->file ? wfc__mapFile(fd, sz) : wfc__mapHuge(sz));
+    if (arena->slots == NULL) {
+        WFC_FREE(ctx, arena);
+        return NULL;
+    }
 
-        // Rot-270 is rot-90 plus rot-180 both in bitmask and as transformation.
-        if (patt.tf & wfc__tfRot90) {
-            int tmpC0 = tfC0;
-            int tmpC1 = tfC1;
+    return arena;
+}
 
-            tfC0 = tmpC1;
-            tfC1 = n - 1 - tmpC0;
+void wfc__releaseRowArena(void *ctx, struct wfc__RowArena *arena) {
+    (void)ctx;
+
+    if (wfc__addShared_i(&arena->refCnt, -1) == 0) {
+        const size_t sz = wfc__mulSz((size_t)arena->slotCnt, arena->slotSz);
+        if (arena->file) {
+            wfc__unmapFile(arena->slots, sz);
+        } else {
+            wfc__unmapHuge(arena->slots, sz);
         }
-        if (patt.tf & wfc__tfRot180) {
-            tfC0 = n - 1 - tfC0;
-            tfC1 = n - 1 - tfC1;
+        WFC_FREE(ctx, arena);
+    }
+}
+
+// Allocates a row that is not collapsed for the given row of the wave,
+// placing it in the wave's arena if its slot is free.
+// Returns null if there is not enough memory.
+struct wfc__WaveRow* wfc__allocWaveRow(
+    void *ctx, const struct wfc__Wave wave, int c0) {
+    (void)ctx;
+
+    struct wfc__RowArena *arena = wave.arena;
+    if (arena != NULL) {
+        struct wfc__WaveRow *slot = (struct wfc__WaveRow*)
+            (arena->slots + (size_t)c0 * arena->slotSz);
+        // Only this wave places rows in the slot,
+        // so it can't get taken after being found free.
+        if (wfc__loadShared_i(&slot->refCnt) == 0) {
+            wfc__addShared_i(&arena->refCnt, 1);
+            slot->arena = arena;
+            return slot;
         }
     }
 
-    int sC0_ = wfc__indWrap(patt.c0 + tfC0, sD0);
-    int sC1_ = wfc__indWrap(patt.c1 + tfC1, sD1);
+    struct wfc__WaveRow *row =
+        (struct wfc__WaveRow*)WFC_MALLOC(ctx, wfc__waveRowSize(wave));
+    if (row != NULL) row->arena = NULL;
 
-    if (sC0 != NULL) *sC0 = sC0_;
-    if (sC1 != NULL) *sC1 = sC1_;
+    return row;
 }
 
-// Fill in edge info in a pattern.
-void wfc__fillPattEdges(
+void wfc__releaseWaveRow(void *ctx, struct wfc__WaveRow *row) {
+    (void)ctx;
+
+    // Once the row is released, its slot may get reused right away.
+    struct wfc__RowArena *arena = row->arena;
+    if (wfc__addShared_i(&row->refCnt, -1) == 0) {
+        if (arena != NULL) {
+            wfc__releaseRowArena(ctx, arena);
+        } else {
+            WFC_FREE(ctx, row);
+        }
+    }
+}
+
+// Makes a wave with all patterns present at each point,
+// placing pointers to its rows in the given array.
+// All of its rows reference the same one.
+// Returns false if there is not enough memory.
+bool wfc__makeWave(
+    void *ctx, int d0, int d1, int pattCnt,
+    struct wfc__WaveRow **rows, struct wfc__Wave *wave) {
+    (void)ctx;
+
+    wave->d03 = d0;
+    wave->d13 = d1;
+    wave->d23 = wfc__bitPackLen(pattCnt);
+    wave->rows = rows;
+
+    wave->arena = NULL;
+
+    struct wfc__WaveRow *row =
+        (struct wfc__WaveRow*)WFC_MALLOC(ctx, wfc__waveRowSize(*wave));
+    if (row == NULL) return false;
+    row->refCnt = d0;
+    row->collapsed = false;
+    row->arena = NULL;
+
+    // Surplus bits need to stay 0.
+    unsigned *pack = wfc__waveRowSlot(*wave, row, 0);
+    memset(pack, 0, (size_t)wave->d23 * sizeof(*pack));
+    for (int p = 0; p < pattCnt; ++p) wfc__setBit(pack, p, true);
+    for (int c1 = 0; c1 < d1; ++c1) {
+        wfc__waveRowLens(row)[c1] = -1;
+        memcpy(
+            wfc__waveRowSlot(*wave, row, c1), pack,
+            (size_t)wave->d23 * sizeof(*pack));
+    }
+
+    for (int c0 = 0; c0 < d0; ++c0) rows[c0] = row;
+
+    return true;
+}
+
+// Called once the array of row pointers has been copied to another wave.
+void wfc__shareWaveRows(const struct wfc__Wave wave) {
+    for (int c0 = 0; c0 < wave.d03; ++c0) {
+        wfc__addShared_i(&wave.rows[c0]->refCnt, 1);
+    }
+}
+
+// The array of row pointers is owned by whoever passed it in.
+void wfc__releaseWaveRows(void *ctx, struct wfc__Wave wave) {
+    (void)ctx;
+
+    for (int c0 = 0; c0 < wave.d03; ++c0) {
+        wfc__releaseWaveRow(ctx, wave.rows[c0]);
+    }
+}
+
+// Replaces the row with a copy that only this place in the wave references.
+// Returns false if there is not enough memory, leaving the row as it was.
+bool wfc__waveCopyRow(void *ctx, struct wfc__Wave wave, int c0) {
+    struct wfc__WaveRow *row = wave.rows[c0];
+
+    size_t rowSz;
+    struct wfc__WaveRow *copy;
+    if (row->collapsed) {
+        rowSz = wfc__waveCollapsedRowSize(wave);
+        copy = (struct wfc__WaveRow*)WFC_MALLOC(ctx, rowSz);
+        if (copy == NULL) return false;
+        copy->arena = NULL;
+    } else {
+        rowSz = wfc__waveRowSize(wave);
+        copy = wfc__allocWaveRow(ctx, wave, c0);
+        if (copy == NULL) return false;
+    }
+    copy->refCnt = 1;
+    copy->collapsed = row->collapsed;
+    memcpy(copy + 1, row + 1, rowSz - sizeof(*row));
+
+    wave.rows[c0] = copy;
+    wfc__releaseWaveRow(ctx, row);
+
+    return true;
+}
+
+// Makes sure that a row is only referenced from this place in the wave,
+// copying it if it isn't, so that it can be modified.
+// Must not be called for the same row from multiple threads at once
+// unless it's already owned (see wfc__waveOwnAll()).
+// Returns false if there is not enough memory, leaving the row as it was.
+bool wfc__waveOwnRow(void *ctx, struct wfc__Wave wave, int c0) {
+    // Other references to the row can get released concurrently,
+    // but new ones can't be made, since only this wave references it.
+    if (wfc__loadShared_i(&wave.rows[c0]->refCnt) == 1) return true;
+
+    return wfc__waveCopyRow(ctx, wave, c0);
+}
+
+struct wfc__WaveOwnAll {
+    void *ctx;
+    struct wfc__Wave wave;
+    // Set once a row could not be copied.
+    volatile int failed;
+};
+
+void wfc__waveOwnRowItem(void *data, int c0) {
+    struct wfc__WaveOwnAll *own = (struct wfc__WaveOwnAll*)data;
+
+    if (!wfc__waveOwnRow(own->ctx, own->wave, c0)) {
+        wfc__storeShared_i(&own->failed, 1);
+    }
+}
+
+// Done before modifying the wave from multiple threads.
+// Collapsed rows stay collapsed (see wfc__waveClearCollapsed()).
+// Rows copied into an arena are first touched there,
+// so they are copied on multiple threads,
+// each starting with a contiguous share of rows
+// that it's then likely to work on (see wfc__parallelFor()).
+// Returns false if there is not enough memory.
+// Rows that were copied by then stay owned.
+bool wfc__waveOwnAll(void *ctx, int threads, struct wfc__Wave wave) {
+    if (wave.arena != NULL) {
+        struct wfc__WaveOwnAll own = {ctx, wave, 0};
+        wfc__parallelFor(ctx, threads, wave.d03, wfc__waveOwnRowItem, &own);
+        return !own.failed;
+    }
+
+    for (int c0 = 0; c0 < wave.d03; ++c0) {
+        if (!wfc__waveOwnRow(ctx, wave, c0)) return false;
+    }
+
+    return true;
+}
+
+bool wfc__waveRowCollapsed(const struct wfc__Wave wave, int c0) {
+    return wave.rows[c0]->collapsed;
+}
+
+// Removes the pattern of a point in a collapsed row.
+// This is the only way those get modified, which may be done
+// from multiple threads once the row is owned.
+// Returns false if there is not enough memory, leaving the point as it was.
+bool wfc__waveClearCollapsed(void *ctx, struct wfc__Wave wave, int c0, int c1) {
+    if (!wfc__waveOwnRow(ctx, wave, c0)) return false;
+
+    wfc__storeShared_i(&wfc__waveRowLens(wave.rows[c0])[c1], -1);
+
+    return true;
+}
+
+// The returned patterns must not be modified, as their row may be shared.
+struct wfc__Pnt wfc__wavePnt(const struct wfc__Wave wave, int c0, int c1) {
+    struct wfc__WaveRow *row = wave.rows[c0];
+
+    struct wfc__Pnt pnt;
+    if (row->collapsed) {
+        pnt.pack = NULL;
+        pnt.list = &wfc__waveRowLens(row)[c1];
+        pnt.len = 1;
+    } else {
+        const unsigned *slot = wfc__waveRowSlot(wave, row, c1);
+
+        pnt.len = wfc__waveRowLens(row)[c1];
+        pnt.pack = pnt.len < 0 ? slot : NULL;
+        pnt.list = (const int*)slot;
+    }
+
+    return pnt;
+}
+
+bool wfc__pntHas(const struct wfc__Pnt pnt, int p) {
+    if (pnt.pack != NULL) return wfc__getBit(pnt.pack, p);
+
+    for (int i = 0; i < pnt.len; ++i) {
+        if (pnt.list[i] == p) return true;
+    }
+
+    return false;
+}
+
+int wfc__pntCnt(const struct wfc__Pnt pnt, int d23) {
+    int cnt = 0;
+    if (pnt.pack != NULL) {
+        for (int i = 0; i < d23; ++i) cnt += wfc__popcount_u(pnt.pack[i]);
+    } else {
+        for (int i = 0; i < pnt.len; ++i) cnt += pnt.list[i] >= 0;
+    }
+
+    return cnt;
+}
+
+// Returns the only pattern present, or -1 if there are none or more than one.
+int wfc__pntSingle(const struct wfc__Pnt pnt, int d23) {
+    const int uSzBits = (int)sizeof(unsigned) * 8;
+
+    int patt = -1;
+    if (pnt.pack == NULL) {
+        for (int i = 0; i < pnt.len; ++i) {
+            if (pnt.list[i] < 0) continue;
+            if (patt >= 0) return -1;
+
+            patt = pnt.list[i];
+        }
+
+        return patt;
+    }
+
+    for (int i = 0; i < d23; ++i) {
+        const unsigned u = pnt.pack[i];
+        if (u == 0) continue;
+        if (patt >= 0 || (u & (u - 1)) != 0) return -1;
+
+        patt = i * uSzBits;
+        for (unsigned v = u; v > 1; v >>= 1) ++patt;
+    }
+
+    return patt;
+}
+
+// Goes through the patterns present at a point in increasing order.
+struct wfc__PntIter {
+    struct wfc__Pnt pnt;
+    int pattCnt;
+    int i;
+};
+
+struct wfc__PntIter wfc__pntIter(const struct wfc__Pnt pnt, int pattCnt) {
+    struct wfc__PntIter it = {pnt, pattCnt, -1};
+
+    return it;
+}
+
+// Returns -1 once there are no more patterns.
+int wfc__pntNext(struct wfc__PntIter *it) {
+    const int uSzBits = (int)sizeof(unsigned) * 8;
+
+    if (it->pnt.pack != NULL) {
+        while (++it->i < it->pattCnt) {
+            // Skips over the rest of the element at once if it has no bits.
+            unsigned u = it->pnt.pack[it->i / uSzBits] >>
+                (unsigned)(it->i % uSzBits);
+            if (u == 0) {
+                it->i += uSzBits - 1 - it->i % uSzBits;
+                continue;
+            }
+
+            for (; !(u & 1u); u >>= 1) ++it->i;
+            return it->i;
+        }
+    } else {
+        while (++it->i < it->pnt.len) {
+            if (it->pnt.list[it->i] >= 0) return it->pnt.list[it->i];
+        }
+    }
+
+    return -1;
+}
+
+// Copies patterns present at a point into a bit pack.
+// Patterns may be concurrently removed from other threads.
+void wfc__pntLoad(const struct wfc__Pnt pnt, int d23, unsigned *pack) {
+    if (pnt.pack != NULL) {
+        for (int i = 0; i < d23; ++i) {
+            pack[i] = wfc__loadShared_u((const volatile unsigned*)&pnt.pack[i]);
+        }
+        return;
+    }
+
+    memset(pack, 0, (size_t)d23 * sizeof(*pack));
+    for (int i = 0; i < pnt.len; ++i) {
+        int p = wfc__loadShared_i((const volatile int*)&pnt.list[i]);
+        if (p >= 0) wfc__setBit(pack, p, true);
+    }
+}
+
+// Makes sure a row can be modified, copying it first if it's shared.
+// Collapsed rows get turned back into rows of lists.
+// Returns false if there is not enough memory, leaving the row as it was.
+bool wfc__waveOwnRowMut(void *ctx, struct wfc__Wave wave, int c0) {
+    struct wfc__WaveRow *row = wave.rows[c0];
+    if (!row->collapsed) return wfc__waveOwnRow(ctx, wave, c0);
+
+    struct wfc__WaveRow *expanded = wfc__allocWaveRow(ctx, wave, c0);
+    if (expanded == NULL) return false;
+    expanded->refCnt = 1;
+    expanded->collapsed = false;
+    for (int c1 = 0; c1 < wave.d13; ++c1) {
+        int p = wfc__waveRowLens(row)[c1];
+
+        wfc__waveRowLens(expanded)[c1] = p >= 0 ? 1 : 0;
+        *(int*)wfc__waveRowSlot(wave, expanded, c1) = p;
+    }
+
+    wave.rows[c0] = expanded;
+    wfc__releaseWaveRow(ctx, row);
+
+    return true;
+}
+
+// Gives access to a point for modification.
+// Its row needs to be made modifiable first (see wfc__waveOwnRowMut()).
+unsigned* wfc__waveSlot(const struct wfc__Wave wave, int c0, int c1) {
+    return wfc__waveRowSlot(wave, wave.rows[c0], c1);
+}
+
+int* wfc__waveLen(const struct wfc__Wave wave, int c0, int c1) {
+    return &wfc__waveRowLens(wave.rows[c0])[c1];
+}
+
+// Turns a point stored as a bit pack into a list
+// if it has few enough patterns left.
+void wfc__waveListPnt(const struct wfc__Wave wave, int c0, int c1) {
+    const int uSzBits = (int)sizeof(unsigned) * 8;
+
+    int *len = wfc__waveLen(wave, c0, c1);
+    unsigned *slot = wfc__waveSlot(wave, c0, c1);
+    if (*len >= 0 || wave.d23 < wfc__minListPackLen) return;
+
+    const int maxLen = wfc__min_i(wave.d23, wfc__maxListLen);
+
+    int list[wfc__maxListLen];
+    int cnt = 0;
+    for (int i = 0; i < wave.d23; ++i) {
+        if (slot[i] == 0) continue;
+
+        for (int b = 0; b < uSzBits; ++b) {
+            if (!(slot[i] & (1u << (unsigned)b))) continue;
+            if (cnt == maxLen) return;
+
+            list[cnt++] = i * uSzBits + b;
+        }
+    }
+
+    memcpy(slot, list, (size_t)cnt * sizeof(*list));
+    *len = cnt;
+}
+
+// Removes a pattern from a point, which must have it present.
+// Returns false if there is not enough memory, leaving the point as it was.
+bool wfc__waveClearPatt(
+    void *ctx, struct wfc__Wave wave, int c0, int c1, int p) {
+    if (!wfc__waveOwnRowMut(ctx, wave, c0)) return false;
+
+    int *len = wfc__waveLen(wave, c0, c1);
+    unsigned *slot = wfc__waveSlot(wave, c0, c1);
+
+    if (*len < 0) {
+        wfc__setBit(slot, p, false);
+        wfc__waveListPnt(wave, c0, c1);
+        return true;
+    }
+
+    int *list = (int*)slot;
+    int cnt = 0;
+    for (int i = 0; i < *len; ++i) {
+        if (list[i] >= 0 && list[i] != p) list[cnt++] = list[i];
+    }
+    *len = cnt;
+
+    return true;
+}
+
+// Sets a point to have just the one pattern present.
+// Returns false if there is not enough memory, leaving the point as it was.
+bool wfc__waveSetSingle(
+    void *ctx, struct wfc__Wave wave, int c0, int c1, int p) {
+    if (!wfc__waveOwnRowMut(ctx, wave, c0)) return false;
+
+    *wfc__waveLen(wave, c0, c1) = 1;
+    *(int*)wfc__waveSlot(wave, c0, c1) = p;
+
+    return true;
+}
+
+bool wfc__waveGetBit(const struct wfc__Wave wave, int c0, int c1, int p) {
+    return wfc__pntHas(wfc__wavePnt(wave, c0, c1), p);
+}
+
+int wfc__wavePopcount(const struct wfc__Wave wave, int c0, int c1) {
+    return wfc__pntCnt(wfc__wavePnt(wave, c0, c1), wave.d23);
+}
+
+// Replaces the row with a collapsed one.
+// Each of its points must have at most one pattern present.
+void wfc__waveCollapseRow(void *ctx, struct wfc__Wave wave, int c0) {
+    struct wfc__WaveRow *row = wave.rows[c0];
+    if (row->collapsed) return;
+
+    struct wfc__WaveRow *collapsed = (struct wfc__WaveRow*)WFC_MALLOC(
+        ctx, wfc__waveCollapsedRowSize(wave));
+    // The row keeps working the same, only taking up more memory.
+    if (collapsed == NULL) return;
+    collapsed->refCnt = 1;
+    collapsed->collapsed = true;
+    collapsed->arena = NULL;
+    for (int c1 = 0; c1 < wave.d13; ++c1) {
+        wfc__waveRowLens(collapsed)[c1] =
+            wfc__pntSingle(wfc__wavePnt(wave, c0, c1), wave.d23);
+    }
+
+    wave.rows[c0] = collapsed;
+    wfc__releaseWaveRow(ctx, row);
+}
+
+struct wfc__Pattern {
+    // Coordinates of the top-left pixel in the source image.
+    int c0, c1;
+    // Bitmask for transformation done to produce this pattern.
+    int tf;
+
+    // Whether this pattern may be placed along a particular edge in output.
+    bool edgeC0Lo, edgeC0Hi, edgeC1Lo, edgeC1Hi;
+    // How often this pattern appeared in different places in the source image.
+    int freq;
+};
+
+void wfc__coordsPattToSrc(
+    int n,
+    struct wfc__Pattern patt, int pC0, int pC1,
+    int sD0, int sD1, int *sC0, int *sC1) {
+    int tfC0 = pC0;
+    int tfC1 = pC1;
+
+    // Map from pattern space to source space.
+    {
+        if (patt.tf & wfc__tfFlipC0) tfC0 = n - 1 - tfC0;
+        if (patt.tf & wfc__tfFlipC1) tfC1 = n - 1 - tfC1;
+
+        // Rot-270 is rot-90 plus rot-180 both in bitmask and as transformation.
+        if (patt.tf & wfc__tfRot90) {
+            int tmpC0 = tfC0;
+            int tmpC1 = tfC1;
+
+            tfC0 = tmpC1;
+            tfC1 = n - 1 - tmpC0;
+        }
+        if (patt.tf & wfc__tfRot180) {
+            tfC0 = n - 1 - tfC0;
+            tfC1 = n - 1 - tfC1;
+        }
+    }
+
+    int sC0_ = wfc__indWrap(patt.c0 + tfC0, sD0);
+    int sC1_ = wfc__indWrap(patt.c1 + tfC1, sD1);
+
+    if (sC0 != NULL) *sC0 = sC0_;
+    if (sC1 != NULL) *sC1 = sC1_;
+}
+
+// Fill in edge info in a pattern.
+void wfc__fillPattEdges(
     int n, int sD0, int sD1,
     struct wfc__Pattern *patt) {
     bool edgeC0Lo = patt->c0 == 0;
@@ -999,7 +3213,7 @@ void wfc__fillPattEdges(
 // but with different offsets.
 void wfc__coordsDstToWave(
     int dC0, int dC1,
-    const struct wfc__A3d_u wave,
+    const struct wfc__Wave wave,
     int *wC0, int *wC1,
     int *offC0, int *offC1) {
     int wC0_ = wfc__min_i(dC0, wave.d03 - 1);
@@ -1073,81 +3287,129 @@ bool wfc__patternsEq(
     return true;
 }
 
-struct wfc__Pattern* wfc__gatherPatterns(
-    void *ctx,
-    int n, int options,
-    const struct wfc__A3d_cu8 src,
-    int *cnt) {
-    (void)ctx;
+struct wfc__GatherPatterns {
+    int n, options;
+    struct wfc__A3d_cu8 src;
+    // For each pattern combination, index of the first combination
+    // containing the same subimage, or -1 if it's not allowed by options.
+    int *firstEq;
+};
 
-    struct wfc__Pattern *patts = NULL;
+void wfc__findFirstEqPatts(void *data, int block) {
+    struct wfc__GatherPatterns *gather = (struct wfc__GatherPatterns*)data;
+    const int n = gather->n, options = gather->options;
+    const struct wfc__A3d_cu8 src = gather->src;
+
+    int lo = block * wfc__parallelBlockLen;
+    int hi = wfc__min_i(
+        lo + wfc__parallelBlockLen, wfc__pattCombCnt(src.d03, src.d13));
+
+    for (int i = lo; i < hi; ++i) {
+        gather->firstEq[i] = -1;
 
-    // First, determine the number of unique patterns.
-    // This is done by iterating through all patterns
-    // and then through all patterns before that one, comparing the two.
-    int pattCnt = 0;
-    for (int i = 0; i < wfc__pattCombCnt(src.d03, src.d13); ++i) {
         struct wfc__Pattern patt = {0, 0, 0, 0, 0, 0, 0, 0};
         wfc__indToPattComb(src.d13, i, &patt);
         if (!wfc__satisfiesOptions(n, options, src.d03, src.d13, patt)) {
             continue;
         }
 
-        bool seenBefore = false;
-        for (int i1 = 0; !seenBefore && i1 < i; ++i1) {
+        // Compare with all combinations before this one, stopping at a match.
+        // If there is none, this is the first occurence of its subimage.
+        gather->firstEq[i] = i;
+        for (int i1 = 0; i1 < i; ++i1) {
             struct wfc__Pattern patt1 = {0, 0, 0, 0, 0, 0, 0, 0};
             wfc__indToPattComb(src.d13, i1, &patt1);
             if (!wfc__satisfiesOptions(n, options, src.d03, src.d13, patt1)) {
                 continue;
             }
 
-            if (wfc__patternsEq(n, src, patt, patt1)) seenBefore = true;
+            if (wfc__patternsEq(n, src, patt, patt1)) {
+                gather->firstEq[i] = i1;
+                break;
+            }
         }
+    }
+}
+
+// Returns null if there is not enough memory.
+struct wfc__Pattern* wfc__gatherPatterns(
+    void *ctx, int threads,
+    int n, int options,
+    const struct wfc__A3d_cu8 src,
+    int *cnt) {
+    (void)ctx;
 
-        if (!seenBefore) ++pattCnt;
+    const int combCnt = wfc__pattCombCnt(src.d03, src.d13);
+
+    // First, for each pattern combination,
+    // find the first combination containing the same subimage.
+    // This is done by comparing it with all combinations before it.
+    // Combinations are independent of each other,
+    // so this is split across threads.
+    struct wfc__GatherPatterns gather;
+    gather.n = n;
+    gather.options = options;
+    gather.src = src;
+    gather.firstEq = (int*)WFC_MALLOC(
+        ctx, (size_t)combCnt * sizeof(*gather.firstEq));
+    if (gather.firstEq == NULL) return NULL;
+
+    wfc__parallelFor(
+        ctx, threads,
+        wfc__roundUpToDivBy(combCnt, wfc__parallelBlockLen) /
+            wfc__parallelBlockLen,
+        wfc__findFirstEqPatts, &gather);
+
+    // Combinations that are their own first occurence are unique patterns.
+    int pattCnt = 0;
+    for (int i = 0; i < combCnt; ++i) {
+        if (gather.firstEq[i] == i) ++pattCnt;
     }
 
     // Now that we know the number of unique patterns,
-    // we can allocate an array for them and start collecting them.
-    // Collection still works by iterating through all patterns
-    // and then through all patterns before that one, comparing the two.
-    // If no previous pattern is equal, collect the new pattern.
-    patts = (struct wfc__Pattern*)WFC_MALLOC(
+    // we can allocate an array for them and collect them in order.
+    // Repeated occurences are merged into the pattern they repeat.
+    // firstEq is reused to map unique combinations to their pattern indexes.
+    struct wfc__Pattern *patts = (struct wfc__Pattern*)WFC_MALLOC(
         ctx, (size_t)pattCnt * sizeof(*patts));
+    if (patts == NULL) {
+        WFC_FREE(ctx, gather.firstEq);
+        return NULL;
+    }
     int pattInd = 0;
-    for (int i = 0; i < wfc__pattCombCnt(src.d03, src.d13); ++i) {
-        struct wfc__Pattern patt = {0, 0, 0, 0, 0, 0, 0, 0};
-        wfc__indToPattComb(src.d13, i, &patt);
-        if (!wfc__satisfiesOptions(n, options, src.d03, src.d13, patt)) {
-            continue;
-        }
+    for (int i = 0; i < combCnt; ++i) {
+        if (gather.firstEq[i] < 0) continue;
 
         // We now need to fill in all pattern fields.
+        struct wfc__Pattern patt = {0, 0, 0, 0, 0, 0, 0, 0};
+        wfc__indToPattComb(src.d13, i, &patt);
         wfc__fillPattEdges(n, src.d03, src.d13, &patt);
         patt.freq = 1;
 
-        bool seenBefore = false;
-        for (int i1 = 0; !seenBefore && i1 < pattInd; ++i1) {
-            if (wfc__patternsEq(n, src, patt, patts[i1])) {
-                // If the patterns are equal, we know this is NOT a new pattern.
-                // However, it may have been placed along a different edge,
-                // which means the old pattern may also be placed along it.
-                // So, update the edge info of the old pattern.
-                patts[i1].edgeC0Lo |= patt.edgeC0Lo;
-                patts[i1].edgeC0Hi |= patt.edgeC0Hi;
-                patts[i1].edgeC1Lo |= patt.edgeC1Lo;
-                patts[i1].edgeC1Hi |= patt.edgeC1Hi;
-
-                ++patts[i1].freq;
-
-                seenBefore = true;
-            }
+        if (gather.firstEq[i] == i) {
+            gather.firstEq[i] = pattInd;
+            patts[pattInd++] = patt;
+        } else {
+            // Earlier combinations have already been mapped to patterns.
+            int first = gather.firstEq[i];
+            struct wfc__Pattern *pattOld = &patts[gather.firstEq[first]];
+
+            // If the patterns are equal, we know this is NOT a new pattern.
+            // However, it may have been placed along a different edge,
+            // which means the old pattern may also be placed along it.
+            // So, update the edge info of the old pattern.
+            pattOld->edgeC0Lo |= patt.edgeC0Lo;
+            pattOld->edgeC0Hi |= patt.edgeC0Hi;
+            pattOld->edgeC1Lo |= patt.edgeC1Lo;
+            pattOld->edgeC1Hi |= patt.edgeC1Hi;
+
+            ++pattOld->freq;
         }
-
-        if (!seenBefore) patts[pattInd++] = patt;
     }
     WFC_ASSERT(ctx, pattInd == pattCnt);
 
+    WFC_FREE(ctx, gather.firstEq);
+
     *cnt = pattCnt;
     return patts;
 }
@@ -1200,40 +3462,73 @@ bool wfc__overlapMatches(
     return true;
 }
 
+struct wfc__CalcOverlaps {
+    void *ctx;
+    int n;
+    struct wfc__A3d_cu8 src;
+    int pattCnt;
+    const struct wfc__Pattern *patts;
+    struct wfc__A3d_u overlaps;
+};
+
+// Calculates one bit pack of overlaps, for a direction and first pattern.
+// Bit packs don't share memory, so they can be calculated in parallel.
+void wfc__calcOverlapsRow(void *data, int row) {
+    struct wfc__CalcOverlaps *calc = (struct wfc__CalcOverlaps*)data;
+
+    int dir, i;
+    wfc__indToCoords2d(calc->pattCnt, row, &dir, &i);
+
+    for (int j = 0; j < calc->pattCnt; ++j) {
+        bool overlap = wfc__overlapMatches(calc->ctx, calc->n, calc->src,
+            (enum wfc__Dir)dir, calc->patts[i], calc->patts[j]);
+        wfc__setBitA3d(calc->overlaps, dir, i, j, overlap);
+    }
+}
+
+// The returned array is null if there is not enough memory.
+// If huge is true, the array is mapped in if possible (see wfc__mapHuge()),
+// which mapped is set to tell.
 struct wfc__A3d_u wfc__calcOverlaps(
-    void *ctx,
+    void *ctx, int threads,
     int n, const struct wfc__A3d_cu8 src,
-    int pattCnt, const struct wfc__Pattern *patts) {
+    int pattCnt, const struct wfc__Pattern *patts,
+    bool huge, bool *mapped) {
     struct wfc__A3d_u overlaps;
     overlaps.d03 = wfc__dirCnt;
     overlaps.d13 = pattCnt;
     overlaps.d23 = wfc__bitPackLen(pattCnt);
-    overlaps.a = (unsigned*)WFC_MALLOC(ctx, WFC__A3D_SIZE(overlaps));
-
-    memset(overlaps.a, 0, WFC__A3D_SIZE(overlaps));
-    for (int dir = 0; dir < wfc__dirCnt; ++dir) {
-        for (int i = 0; i < pattCnt; ++i) {
-            for (int j = 0; j < pattCnt; ++j) {
-                bool overlap = wfc__overlapMatches(ctx, n, src,
-                    (enum wfc__Dir)dir, patts[i], patts[j]);
-                wfc__setBitA3d(overlaps, dir, i, j, overlap);
-            }
-        }
-    }
 
-    return overlaps;
-}
+    // Mapped memory is already zeroed, and is left untouched until
+    // rows of it get calculated on the threads below.
+    overlaps.a = huge ?
+        (unsigned*)wfc__mapHuge(WFC__A3D_SIZE(overlaps)) : NULL;
+    *mapped = overlaps.a != NULL;
+    if (!*mapped) {
+        overlaps.a = (unsigned*)WFC_MALLOC(ctx, WFC__A3D_SIZE(overlaps));
+        if (overlaps.a == NULL) return overlaps;
 
-struct wfc__A2d_f wfc__makeEntropiesArray(void *ctx, int d0, int d1) {
-    (void)ctx;
+        memset(overlaps.a, 0, WFC__A3D_SIZE(overlaps));
+    }
 
-    struct wfc__A2d_f entropies;
+    struct wfc__CalcOverlaps calc;
+    calc.ctx = ctx;
+    calc.n = n;
+    calc.src = src;
+    calc.pattCnt = pattCnt;
+    calc.patts = patts;
+    calc.overlaps = overlaps;
 
-    entropies.d02 = d0;
-    entropies.d12 = d1;
+    wfc__parallelFor(
+        ctx, threads, wfc__dirCnt * pattCnt, wfc__calcOverlapsRow, &calc);
 
-    // The operation of finding points tied for the smallest entropy
-    // is split into multiple loop channels.
+    return overlaps;
+}
+
+// Number of floats to make room for in an entropies array.
+int wfc__entropiesLen(int d0, int d1) {
+    // The operation of finding points tied for the smallest entropy
+    // is split into multiple loop channels.
     // The way it's implemented means it will always pick up as many elements
     // as there are channels at each iteration.
     // To make that not be UB, extra float values are added
@@ -1241,13 +3536,18 @@ struct wfc__A2d_f wfc__makeEntropiesArray(void *ctx, int d0, int d1) {
     // The entropies array itself has the same length it would normally have.
     // Indexing past the end of the array is safe
     // as long as it is within the memory allocation.
-    int len = wfc__roundUpToDivBy(WFC__A2D_LEN(entropies), wfc__loopChannels);
+    return wfc__roundUpToDivBy(d0 * d1, wfc__loopChannels);
+}
 
-    entropies.a = (float*)WFC_MALLOC(ctx, (size_t)len * sizeof(*entropies.a));
+// The array is placed in the given memory,
+// which needs room for wfc__entropiesLen() floats.
+struct wfc__A2d_f wfc__makeEntropiesArray(int d0, int d1, float *a) {
+    struct wfc__A2d_f entropies = {d0, d1, a};
 
     // Extra values are set to the largest float
     // since this value has a neutral effect
     // in the operation mentioned above.
+    const int len = wfc__entropiesLen(d0, d1);
     for (int i = WFC__A2D_LEN(entropies); i < len; ++i) {
         entropies.a[i] = FLT_MAX;
     }
@@ -1255,13 +3555,16 @@ struct wfc__A2d_f wfc__makeEntropiesArray(void *ctx, int d0, int d1) {
     return entropies;
 }
 
-bool wfc__restrictKept(
+// Returns 1 if any patterns were removed and 0 if none were.
+// Returns wfc_outOfMemory if a row could not be copied.
+int wfc__restrictKept(
+    void *ctx,
     int n,
     const struct wfc__A3d_cu8 src,
     int pattCnt, const struct wfc__Pattern *patts,
     const struct wfc__A3d_cu8 dst,
     const struct wfc__A2d_b keep,
-    struct wfc__A3d_u wave) {
+    struct wfc__Wave wave) {
     const int bytesPerPixel = dst.d23;
 
     bool modif = false;
@@ -1280,7 +3583,7 @@ bool wfc__restrictKept(
                     const unsigned char *dPx = &WFC__A3D_GET(dst, dC0, dC1, 0);
 
                     for (int p = 0; p < pattCnt; ++p) {
-                        if (!wfc__getBitA3d(wave, wC0, wC1, p)) continue;
+                        if (!wfc__waveGetBit(wave, wC0, wC1, p)) continue;
 
                         int sC0, sC1;
                         wfc__coordsPattToSrc(
@@ -1293,7 +3596,9 @@ bool wfc__restrictKept(
                             &WFC__A3D_GET(src, sC0, sC1, 0);
 
                         if (memcmp(dPx, sPx, (size_t)bytesPerPixel) != 0) {
-                            wfc__setBitA3d(wave, wC0, wC1, p, false);
+                            if (!wfc__waveClearPatt(ctx, wave, wC0, wC1, p)) {
+                                return wfc_outOfMemory;
+                            }
                             modif = true;
                         }
                     }
@@ -1305,10 +3610,13 @@ bool wfc__restrictKept(
     return modif;
 }
 
-bool wfc__restrictEdges(
-    int options,
+// Only restricts patterns on the given sides (see wfc__side*).
+// Returns the same as wfc__restrictKept().
+int wfc__restrictEdges(
+    void *ctx,
+    int options, int sides,
     int pattCnt, const struct wfc__Pattern *patts,
-    struct wfc__A3d_u wave) {
+    struct wfc__Wave wave) {
     const int d0 = wave.d03, d1 = wave.d13;
 
     bool modif = false;
@@ -1316,12 +3624,18 @@ bool wfc__restrictEdges(
     if (options & wfc__optEdgeFixC0) {
         for (int i = 0; i < d1; ++i) {
             for (int p = 0; p < pattCnt; ++p) {
-                if (wfc__getBitA3d(wave, 0, i, p) && !patts[p].edgeC0Lo) {
-                    wfc__setBitA3d(wave, 0, i, p, false);
+                if ((sides & wfc__sideC0Lo) &&
+                    wfc__waveGetBit(wave, 0, i, p) && !patts[p].edgeC0Lo) {
+                    if (!wfc__waveClearPatt(ctx, wave, 0, i, p)) {
+                        return wfc_outOfMemory;
+                    }
                     modif = true;
                 }
-                if (wfc__getBitA3d(wave, d0 - 1, i, p) && !patts[p].edgeC0Hi) {
-                    wfc__setBitA3d(wave, d0 - 1, i, p, false);
+                if ((sides & wfc__sideC0Hi) &&
+                    wfc__waveGetBit(wave, d0 - 1, i, p) && !patts[p].edgeC0Hi) {
+                    if (!wfc__waveClearPatt(ctx, wave, d0 - 1, i, p)) {
+                        return wfc_outOfMemory;
+                    }
                     modif = true;
                 }
             }
@@ -1330,12 +3644,18 @@ bool wfc__restrictEdges(
     if (options & wfc__optEdgeFixC1) {
         for (int i = 0; i < d0; ++i) {
             for (int p = 0; p < pattCnt; ++p) {
-                if (wfc__getBitA3d(wave, i, 0, p) && !patts[p].edgeC1Lo) {
-                    wfc__setBitA3d(wave, i, 0, p, false);
+                if ((sides & wfc__sideC1Lo) &&
+                    wfc__waveGetBit(wave, i, 0, p) && !patts[p].edgeC1Lo) {
+                    if (!wfc__waveClearPatt(ctx, wave, i, 0, p)) {
+                        return wfc_outOfMemory;
+                    }
                     modif = true;
                 }
-                if (wfc__getBitA3d(wave, i, d1 - 1, p) && !patts[p].edgeC1Hi) {
-                    wfc__setBitA3d(wave, i, d1 - 1, p, false);
+                if ((sides & wfc__sideC1Hi) &&
+                    wfc__waveGetBit(wave, i, d1 - 1, p) && !patts[p].edgeC1Hi) {
+                    if (!wfc__waveClearPatt(ctx, wave, i, d1 - 1, p)) {
+                        return wfc_outOfMemory;
+                    }
                     modif = true;
                 }
             }
@@ -1345,50 +3665,128 @@ bool wfc__restrictEdges(
     return modif;
 }
 
+float wfc__entropyAt(
+    int pattCnt, const struct wfc__Pattern *patts,
+    const struct wfc__Wave wave,
+    int c0, int c1) {
+    const struct wfc__Pnt pnt = wfc__wavePnt(wave, c0, c1);
+
+    int totalFreq = 0;
+    int presentPatts = 0;
+    struct wfc__PntIter it = wfc__pntIter(pnt, pattCnt);
+    for (int p; (p = wfc__pntNext(&it)) >= 0;) {
+        totalFreq += patts[p].freq;
+        ++presentPatts;
+    }
+
+    // Entropy of collapsed points is set to the largest float.
+    // This does not adhere to the Shannon entropy formula,
+    // but speeds up finding points tied for the smallest entropy.
+    if (presentPatts <= 1) return FLT_MAX;
+
+    float entropy = 0;
+    it = wfc__pntIter(pnt, pattCnt);
+    for (int p; (p = wfc__pntNext(&it)) >= 0;) {
+        float prob = (float)patts[p].freq / (float)totalFreq;
+        entropy -= prob * wfc__log2f(prob);
+    }
+
+    return entropy;
+}
+
+enum {
+    // Work is only split across threads if there's at least this much of it,
+    // counted in patterns to look at.
+    wfc__parallelMinWork = 1 << 16
+};
+
+struct wfc__CalcEntropies {
+    int pattCnt;
+    const struct wfc__Pattern *patts;
+    struct wfc__Wave wave;
+    struct wfc__A2d_u8 modified;
+    struct wfc__A2d_f entropies;
+};
+
+// Rows don't share memory, so they can be calculated in parallel.
+void wfc__calcEntropiesRow(void *data, int c0) {
+    const struct wfc__CalcEntropies *calc =
+        (const struct wfc__CalcEntropies*)data;
+
+    for (int c1 = 0; c1 < calc->wave.d13; ++c1) {
+        if (!WFC__A2D_GET(calc->modified, c0, c1)) continue;
+
+        WFC__A2D_GET(calc->entropies, c0, c1) =
+            wfc__entropyAt(calc->pattCnt, calc->patts, calc->wave, c0, c1);
+    }
+}
+
 void wfc__calcEntropies(
+    void *ctx, int threads,
     int pattCnt, const struct wfc__Pattern *patts,
-    const struct wfc__A3d_u wave,
+    const struct wfc__Wave wave,
     const struct wfc__A2d_u8 modified,
     struct wfc__A2d_f entropies) {
-    for (int c0 = 0; c0 < wave.d03; ++c0) {
-        for (int c1 = 0; c1 < wave.d13; ++c1) {
-            if (!WFC__A2D_GET(modified, c0, c1)) continue;
+    // Most steps only modify a few points,
+    // which is not worth starting threads for.
+    if (threads > 1) {
+        long long modifiedCnt = 0;
+        for (int i = 0; i < WFC__A2D_LEN(modified); ++i) {
+            modifiedCnt += modified.a[i];
+        }
+        if ((long long)modifiedCnt * pattCnt < wfc__parallelMinWork) {
+            threads = 1;
+        }
+    }
 
-            int totalFreq = 0;
-            int presentPatts = 0;
-            for (int p = 0; p < pattCnt; ++p) {
-                if (wfc__getBitA3d(wave, c0, c1, p)) {
-                    totalFreq += patts[p].freq;
-                    ++presentPatts;
-                }
-            }
+    struct wfc__CalcEntropies calc = {
+        pattCnt, patts, wave, modified, entropies
+    };
+    wfc__parallelFor(ctx, threads, wave.d03, wfc__calcEntropiesRow, &calc);
+}
 
-            float entropy;
-            if (presentPatts > 1) {
-                entropy = 0;
-                for (int p = 0; p < pattCnt; ++p) {
-                    if (wfc__getBitA3d(wave, c0, c1, p)) {
-                        float prob = (float)patts[p].freq / (float)totalFreq;
-                        entropy -= prob * wfc__log2f(prob);
-                    }
-                }
-            } else {
-                // Entropy of collapsed points is set to the largest float.
-                // This does not adhere to the Shannon entropy formula,
-                // but speeds up finding points tied for the smallest entropy.
-                entropy = FLT_MAX;
-            }
+// Collapses the point into one of its patterns.
+// Picks based on pattern frequencies as weights.
+// Returns false if there is not enough memory, leaving the point as it was.
+bool wfc__observePoint(
+    void *ctx, struct wfc__Rng *rng,
+    int pattCnt, const struct wfc__Pattern *patts,
+    struct wfc__Wave wave,
+    struct wfc__A2d_u8 modified,
+    int c0, int c1) {
+    const struct wfc__Pnt pnt = wfc__wavePnt(wave, c0, c1);
+
+    int chosenPatt = 0;
+    {
+        int totalFreq = 0;
+        struct wfc__PntIter it = wfc__pntIter(pnt, pattCnt);
+        for (int i; (i = wfc__pntNext(&it)) >= 0;) {
+            totalFreq += patts[i].freq;
+        }
+        int chosenInst = wfc__rand_i(ctx, rng, totalFreq);
 
-            WFC__A2D_GET(entropies, c0, c1) = entropy;
+        it = wfc__pntIter(pnt, pattCnt);
+        for (int i; (i = wfc__pntNext(&it)) >= 0;) {
+            if (chosenInst < patts[i].freq) {
+                chosenPatt = i;
+                break;
+            }
+            chosenInst -= patts[i].freq;
         }
     }
+
+    if (!wfc__waveSetSingle(ctx, wave, c0, c1, chosenPatt)) return false;
+    WFC__A2D_GET(modified, c0, c1) = 1;
+
+    return true;
 }
 
-void wfc__observeOne(
-    void *ctx,
+// Returns false if there is not enough memory, leaving the wave as it was.
+bool wfc__observeOne(
+    void *ctx, struct wfc__Rng *rng,
     int pattCnt, const struct wfc__Pattern *patts,
     const struct wfc__A2d_f entropies,
-    struct wfc__A3d_u wave,
+    struct wfc__Wave wave,
     struct wfc__A2d_u8 modified,
     int *obsC0, int *obsC1) {
     float smallest;
@@ -1430,7 +3828,7 @@ void wfc__observeOne(
     {
         int chosenPnt = 0;
         // Pick which point tied for the lowest entropy to observe.
-        int chosenSmallestPnt = wfc__rand_i(ctx, smallestCnt);
+        int chosenSmallestPnt = wfc__rand_i(ctx, rng, smallestCnt);
         // Iterate through points until we get to the one we decided to observe.
         for (int i = 0; i < WFC__A2D_LEN(entropies); ++i) {
             if (wfc__approxEqNonNeg_f(entropies.a[i], smallest)) {
@@ -1442,51 +3840,92 @@ void wfc__observeOne(
         wfc__indToCoords2d(entropies.d12, chosenPnt, &chosenC0, &chosenC1);
     }
 
+    *obsC0 = chosenC0;
+    *obsC1 = chosenC1;
+
     // Now pick a pattern to collapse the chosen point into.
-    // Picks based on pattern frequencies as weights.
-    int chosenPatt = 0;
-    {
-        int totalFreq = 0;
-        for (int i = 0; i < pattCnt; ++i) {
-            if (wfc__getBitA3d(wave, chosenC0, chosenC1, i)) {
-                totalFreq += patts[i].freq;
-            }
-        }
-        int chosenInst = wfc__rand_i(ctx, totalFreq);
+    return wfc__observePoint(
+        ctx, rng, pattCnt, patts, wave, modified, chosenC0, chosenC1);
+}
 
-        for (int i = 0; i < pattCnt; ++i) {
-            if (wfc__getBitA3d(wave, chosenC0, chosenC1, i)) {
-                if (chosenInst < patts[i].freq) {
-                    chosenPatt = i;
-                    break;
-                }
-                chosenInst -= patts[i].freq;
+// Conditions under which WFC should be stopped before it completes.
+struct wfc__Stop {
+    // If non-null, WFC stops once the pointed to value becomes non-zero.
+    const volatile int *cancel;
+    // Value of WFC_CLOCK() after which WFC stops.
+    // Negative if there is no time limit.
+    double deadline;
+};
+
+enum {
+    // Checking stop conditions is cheap, but not free.
+    // During propagation, they are checked once per this many iterations.
+    wfc__stopCheckPeriod = 256
+};
+
+// Returns the status code WFC should be stopped with,
+// or zero if it should keep running.
+int wfc__checkStop(void *ctx, const struct wfc__Stop *stop) {
+    (void)ctx;
+
+    if (stop == NULL) return 0;
+
+    if (stop->cancel != NULL && wfc__loadShared_i(stop->cancel) != 0) {
+        return wfc_cancelled;
+    }
+    if (stop->deadline >= 0.0 && WFC_CLOCK(ctx) > stop->deadline) {
+        return wfc_timedOut;
+    }
+
+    return 0;
+}
+
+// Whether pattern p can be kept next to a point with the given patterns,
+// which is the case if one of them overlaps with it in the given direction.
+// If the point has a single pattern,
+// srcKept can be given as the bit pack of patterns it overlaps with.
+bool wfc__pattKept(
+    const struct wfc__Pnt src, const unsigned *srcKept,
+    const struct wfc__A3d_u overlaps, int dirOpposite, int p) {
+    if (srcKept != NULL) return wfc__getBit(srcKept, p);
+
+    const unsigned *pOverlaps = &WFC__A3D_GET(overlaps, dirOpposite, p, 0);
+
+    if (src.pack == NULL) {
+        for (int i = 0; i < src.len; ++i) {
+            if (src.list[i] >= 0 && wfc__getBit(pOverlaps, src.list[i])) {
+                return true;
             }
         }
+
+        return false;
     }
 
-    *obsC0 = chosenC0;
-    *obsC1 = chosenC1;
-    wfc__clearBitPackA3d(wave, chosenC0, chosenC1);
-    wfc__setBitA3d(wave, chosenC0, chosenC1, chosenPatt, true);
-    WFC__A2D_GET(modified, chosenC0, chosenC1) = 1;
+    unsigned total = 0;
+    for (int i = 0; i < overlaps.d23; ++i) {
+        total |= src.pack[i] & pOverlaps[i];
+    }
+
+    return total != 0;
 }
 
 // Propagate constraints from a recently modified point
 // onto the neighbouring one in a particular direction.
-// Returns whether the neighbouring point was modified.
-bool wfc__propagateOntoDirection(
+// Returns 1 if the neighbouring point was modified and 0 if it wasn't.
+// Returns wfc_outOfMemory if its row could not be copied,
+// in which case the point is left as it was.
+int wfc__propagateOntoDirection(
     void *ctx, int options, int pattCnt,
     int c0, int c1, enum wfc__Dir dir,
     const struct wfc__A3d_u overlaps,
-    struct wfc__A3d_u wave) {
+    struct wfc__Wave wave) {
     int nC0, nC1;
     wfc__coords2dPlusDir(ctx, c0, c1, dir, &nC0, &nC1);
 
-    // Constraints are not propagated along fixed edges.
-    if (((options & wfc__optEdgeFixC0) && (nC0 < 0 || nC0 >= wave.d03)) ||
-        ((options & wfc__optEdgeFixC1) && (nC1 < 0 || nC1 >= wave.d13))) {
-        return false;
+    // Constraints are not propagated around edges the wave doesn't wrap around.
+    if (((options & wfc__optNoWrapC0) && (nC0 < 0 || nC0 >= wave.d03)) ||
+        ((options & wfc__optNoWrapC1) && (nC1 < 0 || nC1 >= wave.d13))) {
+        return 0;
     }
 
     nC0 = wfc__indWrap(nC0, wave.d03);
@@ -1494,43 +3933,492 @@ bool wfc__propagateOntoDirection(
 
     int dirOpposite = (int)wfc__dirOpposite(ctx, dir);
 
-    // We will compare the old and new pattern count at the neighbouring point
-    // to know whether we modified it.
-    int oldPresentPattCnt = wfc__popcountBitPackA3d(wave, nC0, nC1);
+    struct wfc__Pnt src = wfc__wavePnt(wave, c0, c1);
 
-    // For each pattern at the neighbouring point
-    // figure out whether it can be kept,
-    // which is the case if there is a pattern at starting point
-    // whose overlap matches.
-    for (int p = 0; p < pattCnt; ++p) {
-        if (!wfc__getBitA3d(wave, nC0, nC1, p)) continue;
+    if (wfc__waveRowCollapsed(wave, nC0)) {
+        int p = wfc__wavePnt(wave, nC0, nC1).list[0];
+        if (p < 0 ||
+            wfc__pattKept(src, NULL, overlaps, dirOpposite, p)) {
+            return 0;
+        }
+
+        if (!wfc__waveClearCollapsed(ctx, wave, nC0, nC1)) {
+            return wfc_outOfMemory;
+        }
+        return 1;
+    }
+
+    const struct wfc__Pnt dst = wfc__wavePnt(wave, nC0, nC1);
 
-        // This is a very nested and hot loop in the code,
-        // so a few optimizations were made.
-        // All changes should be verified with benchmarks.
-        unsigned total = 0;
+    // Patterns that can be kept next to a collapsed point
+    // are those its pattern overlaps with in the given direction.
+    const int srcPatt = wfc__pntSingle(src, wave.d23);
+    const unsigned *srcKept = srcPatt >= 0 ?
+        &WFC__A3D_GET(overlaps, (int)dir, srcPatt, 0) : NULL;
+
+    // The neighbouring point is only written to (and its row copied if shared)
+    // once a pattern actually needs to be removed from it.
+
+    if (dst.pack == NULL) {
+        int removed = 0;
+        while (removed < dst.len &&
+            (dst.list[removed] < 0 ||
+                wfc__pattKept(
+                    src, srcKept, overlaps, dirOpposite, dst.list[removed]))) {
+            ++removed;
+        }
+        if (removed == dst.len) return 0;
+
+        if (!wfc__waveOwnRowMut(ctx, wave, nC0)) return wfc_outOfMemory;
+        // Copying the row may have released the one src was in.
+        src = wfc__wavePnt(wave, c0, c1);
+
+        int *list = (int*)wfc__waveSlot(wave, nC0, nC1);
+        int *len = wfc__waveLen(wave, nC0, nC1);
+
+        int cnt = 0;
+        for (int i = 0; i < *len; ++i) {
+            if (list[i] < 0 || i == removed) continue;
+            if (i > removed &&
+                !wfc__pattKept(src, srcKept, overlaps, dirOpposite, list[i])) {
+                continue;
+            }
+
+            list[cnt++] = list[i];
+        }
+        *len = cnt;
+
+        return 1;
+    }
+
+    const unsigned *dstPack = dst.pack;
+    unsigned *dstMut = NULL;
+
+    if (srcKept != NULL || src.pack == NULL) {
         for (int i = 0; i < wave.d23; ++i) {
-            total |= WFC__A3D_GET(wave, c0, c1, i) &
-                WFC__A3D_GET(overlaps, dirOpposite, p, i);
+            // Patterns that can be kept next to a point with few patterns
+            // are those any of its patterns overlap with.
+            unsigned kept = 0;
+            if (srcKept != NULL) {
+                kept = srcKept[i];
+            } else {
+                for (int j = 0; j < src.len; ++j) {
+                    if (src.list[j] < 0) continue;
+                    kept |= WFC__A3D_GET(overlaps, (int)dir, src.list[j], i);
+                }
+            }
+
+            if (!(dstPack[i] & ~kept)) continue;
+
+            if (dstMut == NULL) {
+                if (!wfc__waveOwnRowMut(ctx, wave, nC0)) {
+                    return wfc_outOfMemory;
+                }
+                dstMut = wfc__waveSlot(wave, nC0, nC1);
+                dstPack = dstMut;
+                // Copying the row may have released the one src was in.
+                src = wfc__wavePnt(wave, c0, c1);
+            }
+            dstMut[i] &= kept;
+        }
+    } else {
+        // For each pattern at the neighbouring point
+        // figure out whether it can be kept,
+        // which is the case if there is a pattern at starting point
+        // whose overlap matches.
+        for (int p = 0; p < pattCnt; ++p) {
+            if (!wfc__getBit(dstPack, p)) continue;
+
+            // This is a very nested and hot loop in the code,
+            // so a few optimizations were made.
+            // All changes should be verified with benchmarks.
+            unsigned total = 0;
+            for (int i = 0; i < wave.d23; ++i) {
+                total |=
+                    src.pack[i] & WFC__A3D_GET(overlaps, dirOpposite, p, i);
+            }
+            if (total) continue;
+
+            if (dstMut == NULL) {
+                if (!wfc__waveOwnRowMut(ctx, wave, nC0)) {
+                    return wfc_outOfMemory;
+                }
+                dstMut = wfc__waveSlot(wave, nC0, nC1);
+                dstPack = dstMut;
+                // Copying the row may have released the one src was in.
+                src = wfc__wavePnt(wave, c0, c1);
+            }
+
+            wfc__setBit(dstMut, p, false);
+        }
+    }
+
+    if (dstMut == NULL) return 0;
+
+    wfc__waveListPnt(wave, nC0, nC1);
+
+    return 1;
+}
+
+enum {
+    // Propagation is split across threads
+    // once this many points are waiting to be propagated from.
+    // Propagation after a single observation rarely gets there,
+    // and starting threads would cost more than it saves.
+    wfc__parallelPropagationMinLen = 256
+};
+
+// Lock-free work-stealing deque of wave point indexes (Chase-Lev).
+// The owner pushes and takes at the bottom, others steal from the top.
+// It never holds more than all wave points,
+// since a point is in at most one deque at a time.
+struct wfc__StealDeque {
+    volatile long long top, bottom;
+    int cap;
+    volatile int *a;
+};
+
+// Must only be called by the owner.
+void wfc__stealDequePush(struct wfc__StealDeque *deque, int ind) {
+    long long bottom = wfc__loadShared_ll(&deque->bottom);
+    wfc__storeShared_i(&deque->a[bottom % deque->cap], ind);
+    wfc__storeShared_ll(&deque->bottom, bottom + 1);
+}
+
+// Must only be called by the owner.
+// Returns -1 if the deque is empty.
+int wfc__stealDequeTake(struct wfc__StealDeque *deque) {
+    long long bottom = wfc__loadShared_ll(&deque->bottom) - 1;
+    wfc__storeShared_ll(&deque->bottom, bottom);
+    long long top = wfc__loadShared_ll(&deque->top);
+
+    if (top > bottom) {
+        wfc__storeShared_ll(&deque->bottom, bottom + 1);
+        return -1;
+    }
+
+    int ind = wfc__loadShared_i(&deque->a[bottom % deque->cap]);
+    if (top == bottom) {
+        // Last element, race against thieves for it.
+        if (!wfc__casShared_ll(&deque->top, top, top + 1)) ind = -1;
+        wfc__storeShared_ll(&deque->bottom, bottom + 1);
+    }
+
+    return ind;
+}
+
+// Returns -1 if the deque is empty or another thread stole first.
+int wfc__stealDequeSteal(struct wfc__StealDeque *deque) {
+    long long top = wfc__loadShared_ll(&deque->top);
+    long long bottom = wfc__loadShared_ll(&deque->bottom);
+
+    if (top >= bottom) return -1;
+
+    int ind = wfc__loadShared_i(&deque->a[top % deque->cap]);
+    if (!wfc__casShared_ll(&deque->top, top, top + 1)) return -1;
+
+    return ind;
+}
+
+// Same as wfc__propagateOntoDirection(),
+// except that the wave may be concurrently modified from other threads.
+// Patterns are propagated from src, a copy of the starting point.
+// Patterns are only ever removed, so propagating from a stale copy
+// removes fewer of them. The starting point gets propagated from again
+// if it was modified after being copied.
+bool wfc__propagateOntoDirectionShared(
+    void *ctx, int options,
+    int c0, int c1, enum wfc__Dir dir,
+    const unsigned *src,
+    const struct wfc__A3d_u overlaps,
+    struct wfc__Wave wave) {
+    const int uSzBits = (int)sizeof(unsigned) * 8;
+
+    int nC0, nC1;
+    wfc__coords2dPlusDir(ctx, c0, c1, dir, &nC0, &nC1);
+
+    if (((options & wfc__optNoWrapC0) && (nC0 < 0 || nC0 >= wave.d03)) ||
+        ((options & wfc__optNoWrapC1) && (nC1 < 0 || nC1 >= wave.d13))) {
+        return false;
+    }
+
+    nC0 = wfc__indWrap(nC0, wave.d03);
+    nC1 = wfc__indWrap(nC1, wave.d13);
+
+    int dirOpposite = (int)wfc__dirOpposite(ctx, dir);
+
+    const struct wfc__Pnt srcPnt = {src, NULL, -1};
+    const int srcPatt = wfc__pntSingle(srcPnt, wave.d23);
+    const unsigned *srcKept = srcPatt >= 0 ?
+        &WFC__A3D_GET(overlaps, (int)dir, srcPatt, 0) : NULL;
+
+    // All rows are owned during parallel propagation,
+    // so they can be written to directly,
+    // and points don't get turned from one form into another.
+    const struct wfc__Pnt dst = wfc__wavePnt(wave, nC0, nC1);
+
+    bool modified = false;
+
+    // This includes points in collapsed rows.
+    if (dst.pack == NULL) {
+        volatile int *list = (volatile int*)dst.list;
+
+        for (int i = 0; i < dst.len; ++i) {
+            int p = wfc__loadShared_i(&list[i]);
+            if (p < 0 ||
+                wfc__pattKept(srcPnt, srcKept, overlaps, dirOpposite, p)) {
+                continue;
+            }
+
+            wfc__storeShared_i(&list[i], -1);
+            modified = true;
+        }
+
+        return modified;
+    }
+
+    volatile unsigned *pack = (volatile unsigned*)dst.pack;
+
+    for (int i = 0; i < wave.d23; ++i) {
+        unsigned present = wfc__loadShared_u(&pack[i]);
+
+        unsigned kept = 0;
+        if (srcKept != NULL) {
+            kept = present & srcKept[i];
+        } else {
+            for (int b = 0; b < uSzBits; ++b) {
+                const unsigned bitMask = 1u << (unsigned)b;
+                if (!(present & bitMask)) continue;
+
+                const int p = i * uSzBits + b;
+                if (wfc__pattKept(srcPnt, NULL, overlaps, dirOpposite, p)) {
+                    kept |= bitMask;
+                }
+            }
+        }
+
+        // Bits removed by other threads in the meantime stay removed.
+        if (kept != present && (wfc__andShared_u(&pack[i], kept) & ~kept)) {
+            modified = true;
+        }
+    }
+
+    return modified;
+}
+
+struct wfc__ParallelPropagation {
+    void *ctx;
+    int options;
+    struct wfc__A3d_u overlaps;
+    struct wfc__Wave wave;
+    struct wfc__A2d_u8 modified;
+    const struct wfc__Stop *stop;
+    // Whether each wave point is waiting to be propagated from.
+    volatile uint8_t *queued;
+    int workerCnt;
+    struct wfc__StealDeque *deques;
+    // Number of points waiting to be or being propagated from.
+    volatile int pending;
+    // Status code to stop WFC with, or zero.
+    volatile int stopStatus;
+};
+
+struct wfc__ParallelPropagationWorker {
+    struct wfc__ParallelPropagation *prop;
+    int ind;
+    // Copy of the point being propagated from.
+    unsigned *src;
+};
+
+void wfc__parallelPropagationWorker(void *data, int ind) {
+    struct wfc__ParallelPropagationWorker *worker =
+        &((struct wfc__ParallelPropagationWorker*)data)[ind];
+    struct wfc__ParallelPropagation *prop = worker->prop;
+    struct wfc__StealDeque *own = &prop->deques[worker->ind];
+
+    const struct wfc__Wave wave = prop->wave;
+
+    int iters = 0;
+    while (wfc__loadShared_i(&prop->stopStatus) == 0) {
+        int ind = wfc__stealDequeTake(own);
+        for (int i = 1; ind < 0 && i < prop->workerCnt; ++i) {
+            ind = wfc__stealDequeSteal(
+                &prop->deques[(worker->ind + i) % prop->workerCnt]);
+        }
+
+        if (ind < 0) {
+            // Points being propagated from may still add more points.
+            if (wfc__loadShared_i(&prop->pending) == 0) break;
+
+            wfc__threadYield();
+            continue;
+        }
+
+        if (++iters == wfc__stopCheckPeriod) {
+            int stopStatus = wfc__checkStop(prop->ctx, prop->stop);
+            if (stopStatus != 0) {
+                wfc__storeShared_i(&prop->stopStatus, stopStatus);
+            }
+            iters = 0;
+        }
+
+        // Take the point out of the queue before copying its patterns.
+        // Whoever modifies it after the copy will queue it up again.
+        wfc__storeShared_u8(&prop->queued[ind], 0);
+
+        int c0, c1;
+        wfc__indToCoords2d(wave.d13, ind, &c0, &c1);
+
+        wfc__pntLoad(wfc__wavePnt(wave, c0, c1), wave.d23, worker->src);
+
+        for (int dir = 0; dir < wfc__dirCnt; ++dir) {
+            if (wfc__propagateOntoDirectionShared(
+                    prop->ctx, prop->options,
+                    c0, c1, (enum wfc__Dir)dir, worker->src,
+                    prop->overlaps, wave)) {
+                int nextC0, nextC1;
+                wfc__coords2dPlusDir(
+                    prop->ctx, c0, c1, (enum wfc__Dir)dir, &nextC0, &nextC1);
+                nextC0 = wfc__indWrap(nextC0, wave.d03);
+                nextC1 = wfc__indWrap(nextC1, wave.d13);
+
+                int next = wfc__coords2dToInd(wave.d13, nextC0, nextC1);
+
+                wfc__storeShared_u8(
+                    &WFC__A2D_GET(prop->modified, nextC0, nextC1), 1);
+
+                if (wfc__exchangeShared_u8(&prop->queued[next], 1) == 0) {
+                    wfc__addShared_i(&prop->pending, 1);
+                    wfc__stealDequePush(own, next);
+                }
+            }
+        }
+
+        wfc__addShared_i(&prop->pending, -1);
+    }
+}
+
+// Continues propagation from the points in the ripple linked list
+// on multiple threads, emptying the list.
+// Each worker has its own deque of points to propagate from
+// and steals from others once it runs out.
+// Propagation removes patterns until no more can be removed,
+// and which ones get removed does not depend on the order
+// points were propagated from in.
+// Ergo, the results are the same as those of serial propagation.
+// Returns wfc_outOfMemory without taking points out of the list
+// if there is not enough memory to start.
+int wfc__propagateParallel(
+    void *ctx, int threads, int options,
+    const struct wfc__A3d_u overlaps,
+    int head, struct wfc__A2d_i ripple,
+    struct wfc__Wave wave,
+    struct wfc__A2d_u8 modified,
+    const struct wfc__Stop *stop) {
+    const int pointCnt = WFC__A2D_LEN(ripple);
+
+    // So that workers never need to copy shared rows.
+    if (!wfc__waveOwnAll(ctx, threads, wave)) return wfc_outOfMemory;
+
+    struct wfc__ParallelPropagation prop = {
+        ctx, options, overlaps, wave, modified, stop,
+        NULL, threads, NULL, 0, 0
+    };
+
+    prop.queued = (volatile uint8_t*)WFC_MALLOC(ctx, (size_t)pointCnt);
+
+    prop.deques = (struct wfc__StealDeque*)WFC_MALLOC(
+        ctx, (size_t)prop.workerCnt * sizeof(*prop.deques));
+
+    struct wfc__ParallelPropagationWorker *workers =
+        (struct wfc__ParallelPropagationWorker*)WFC_MALLOC(
+            ctx, (size_t)prop.workerCnt * sizeof(*workers));
+
+    bool allocated =
+        prop.queued != NULL && prop.deques != NULL && workers != NULL;
+    // Number of workers whose buffers were allocated, or tried to be.
+    int readyCnt = 0;
+    for (int i = 0; allocated && i < prop.workerCnt; ++i) {
+        prop.deques[i].top = 0;
+        prop.deques[i].bottom = 0;
+        prop.deques[i].cap = pointCnt;
+        prop.deques[i].a = (volatile int*)WFC_MALLOC(
+            ctx, (size_t)pointCnt * sizeof(*prop.deques[i].a));
+
+        workers[i].prop = &prop;
+        workers[i].ind = i;
+        workers[i].src = (unsigned*)WFC_MALLOC(
+            ctx, (size_t)wave.d23 * sizeof(*workers[i].src));
+
+        readyCnt = i + 1;
+        if (prop.deques[i].a == NULL || workers[i].src == NULL) {
+            allocated = false;
         }
+    }
+
+    // The ripple is left untouched, so propagation can continue serially.
+    if (!allocated) {
+        for (int i = 0; i < readyCnt; ++i) {
+            if (workers[i].src != NULL) WFC_FREE(ctx, workers[i].src);
+            if (prop.deques[i].a != NULL) {
+                WFC_FREE(ctx, (int*)prop.deques[i].a);
+            }
+        }
+        if (workers != NULL) WFC_FREE(ctx, workers);
+        if (prop.deques != NULL) WFC_FREE(ctx, prop.deques);
+        if (prop.queued != NULL) WFC_FREE(ctx, (uint8_t*)prop.queued);
+
+        return wfc_outOfMemory;
+    }
+
+    memset((uint8_t*)prop.queued, 0, (size_t)pointCnt);
+
+    // Deal the points out to workers in turns.
+    for (int i = 0; head >= 0; i = (i + 1) % prop.workerCnt) {
+        prop.queued[head] = 1;
+        ++prop.pending;
+        wfc__stealDequePush(&prop.deques[i], head);
 
-        wfc__setBitA3d(wave, nC0, nC1, p, total);
+        int newHead = ripple.a[head];
+        ripple.a[head] = -1;
+        head = newHead;
     }
 
-    int newPresentPattCnt = wfc__popcountBitPackA3d(wave, nC0, nC1);
+    // Each worker takes points until there are none left anywhere,
+    // so it's fine if they don't all get to run at the same time.
+    wfc__parallelFor(
+        ctx, prop.workerCnt, prop.workerCnt,
+        wfc__parallelPropagationWorker, workers);
+
+    for (int i = 0; i < prop.workerCnt; ++i) {
+        WFC_FREE(ctx, workers[i].src);
+        WFC_FREE(ctx, (int*)prop.deques[i].a);
+    }
+    WFC_FREE(ctx, workers);
+    WFC_FREE(ctx, prop.deques);
+    WFC_FREE(ctx, (uint8_t*)prop.queued);
 
-    return oldPresentPattCnt != newPresentPattCnt;
+    return prop.stopStatus;
 }
 
-void wfc__propagateFromRipple(
-    void *ctx, int n, int options, int pattCnt,
+// If labels is non-null, constraints are not propagated
+// between points with different labels.
+// Returns zero, or the status code to stop WFC with
+// if stop conditions were met before propagation finished.
+// Returns wfc_outOfMemory if a row could not be copied. The wave then
+// has all constraints propagated but those from points left in the list,
+// all of which are marked as modified.
+int wfc__propagateFromRipple(
+    void *ctx, int threads, int n, int options, int pattCnt,
     const struct wfc__A3d_u overlaps,
-    int head, int tail, struct wfc__A2d_i ripple,
-    struct wfc__A3d_u wave,
-    struct wfc__A2d_u8 modified) {
+    int head, int tail, int len, struct wfc__A2d_i ripple,
+    struct wfc__Wave wave,
+    struct wfc__A2d_u8 modified,
+    const int *labels,
+    const struct wfc__Stop *stop) {
     // If patterns are 1x1, they never overlap
     // and points never constrain each other.
-    if (n == 1) return;
+    if (n == 1) return 0;
 
     // Constraints only need to be propagated from recently modified points.
     // As additional wave points are constrained,
@@ -1548,7 +4436,25 @@ void wfc__propagateFromRipple(
     // New points are added after tail
     // if they become modified and are not already in the list.
     // Propagation ends when the list is empty.
+    // len is the number of elements in the list.
+    int iters = 0;
     while (head >= 0) {
+        if (threads > 1 && len >= wfc__parallelPropagationMinLen &&
+            labels == NULL) {
+            int status = wfc__propagateParallel(
+                ctx, threads, options, overlaps, head, ripple, wave, modified,
+                stop);
+            // It may take fewer rows to continue serially.
+            if (status != wfc_outOfMemory) return status;
+            threads = 1;
+        }
+
+        if (++iters == wfc__stopCheckPeriod) {
+            int stopStatus = wfc__checkStop(ctx, stop);
+            if (stopStatus != 0) return stopStatus;
+            iters = 0;
+        }
+
         // This function uses both raw 1D array indexes and full coordinates.
         int headC0, headC1;
         wfc__indToCoords2d(ripple.d12, head, &headC0, &headC1);
@@ -1558,17 +4464,23 @@ void wfc__propagateFromRipple(
         // but with extra iterations in between.
         // This is still a significant performance improvement.
         for (int dir = 0; dir < wfc__dirCnt; ++dir) {
-            if (wfc__propagateOntoDirection(
-                    ctx, options, pattCnt,
-                    headC0, headC1, (enum wfc__Dir)dir,
-                    overlaps, wave)) {
-                int nextC0, nextC1;
-                wfc__coords2dPlusDir(
-                    ctx, headC0, headC1, (enum wfc__Dir)dir, &nextC0, &nextC1);
-                nextC0 = wfc__indWrap(nextC0, ripple.d02);
-                nextC1 = wfc__indWrap(nextC1, ripple.d12);
+            if (labels != NULL &&
+                labels[wfc__neighbourInd(
+                    ctx, ripple.d02, ripple.d12,
+                    headC0, headC1, (enum wfc__Dir)dir)] != labels[head]) {
+                continue;
+            }
 
-                int next = wfc__coords2dToInd(ripple.d12, nextC0, nextC1);
+            int propagated = wfc__propagateOntoDirection(
+                ctx, options, pattCnt,
+                headC0, headC1, (enum wfc__Dir)dir,
+                overlaps, wave);
+            // Points left in the list still need to be propagated from.
+            if (propagated < 0) return propagated;
+            if (propagated) {
+                int next = wfc__neighbourInd(
+                    ctx, ripple.d02, ripple.d12,
+                    headC0, headC1, (enum wfc__Dir)dir);
 
                 // If next was modified and is not in the list,
                 // add it to the list to be propagated from later on.
@@ -1577,9 +4489,10 @@ void wfc__propagateFromRipple(
                 if (ripple.a[next] < 0 && next != tail) {
                     ripple.a[tail] = next;
                     tail = next;
+                    ++len;
                 }
 
-                WFC__A2D_GET(modified, nextC0, nextC1) = 1;
+                modified.a[next] = 1;
             }
         }
 
@@ -1590,15 +4503,19 @@ void wfc__propagateFromRipple(
         int newHead = ripple.a[head];
         ripple.a[head] = -1;
         head = newHead;
+        --len;
     }
+
+    return 0;
 }
 
-void wfc__propagateFromAll(
-    void *ctx, int n, int options, int pattCnt,
+int wfc__propagateFromAll(
+    void *ctx, int threads, int n, int options, int pattCnt,
     const struct wfc__A3d_u overlaps,
     struct wfc__A2d_i ripple,
-    struct wfc__A3d_u wave,
-    struct wfc__A2d_u8 modified) {
+    struct wfc__Wave wave,
+    struct wfc__A2d_u8 modified,
+    const struct wfc__Stop *stop) {
     // The linked list will contain all elements in order.
     // Each element will point to the next one,
     // except for the last element, which will be the tail.
@@ -1608,17 +4525,19 @@ void wfc__propagateFromAll(
     }
     ripple.a[tail] = -1;
 
-    wfc__propagateFromRipple(
-        ctx, n, options, pattCnt, overlaps, head, tail, ripple, wave, modified);
+    return wfc__propagateFromRipple(
+        ctx, threads, n, options, pattCnt, overlaps,
+        head, tail, WFC__A2D_LEN(ripple), ripple, wave, modified, NULL, stop);
 }
 
-void wfc__propagateFromSeed(
-    void *ctx, int n, int options, int pattCnt,
+int wfc__propagateFromSeed(
+    void *ctx, int threads, int n, int options, int pattCnt,
     int seedC0, int seedC1,
     const struct wfc__A3d_u overlaps,
     struct wfc__A2d_i ripple,
-    struct wfc__A3d_u wave,
-    struct wfc__A2d_u8 modified) {
+    struct wfc__Wave wave,
+    struct wfc__A2d_u8 modified,
+    const struct wfc__Stop *stop) {
     // Only one element will be in the linked list
     // and will be both the head and the tail.
     // No one has a next element to point to.
@@ -1627,24 +4546,75 @@ void wfc__propagateFromSeed(
     }
     int head = wfc__coords2dToInd(ripple.d12, seedC0, seedC1), tail = head;
 
-    wfc__propagateFromRipple(
-        ctx, n, options, pattCnt, overlaps, head, tail, ripple, wave, modified);
+    return wfc__propagateFromRipple(
+        ctx, threads, n, options, pattCnt, overlaps,
+        head, tail, 1, ripple, wave, modified, NULL, stop);
 }
 
-void wfc__updateCnts(
-    const struct wfc__A3d_u wave,
-    const struct wfc__A2d_u8 modified,
-    struct wfc__A2d_i wavePattCnts,
-    int *collapsedCnt) {
-    for (int c0 = 0; c0 < wave.d03; ++c0) {
-        for (int c1 = 0; c1 < wave.d13; ++c1) {
+// Propagates constraints from all points marked as modified.
+int wfc__propagateFromModified(
+    void *ctx, int threads, int n, int options, int pattCnt,
+    const struct wfc__A3d_u overlaps,
+    struct wfc__A2d_i ripple,
+    struct wfc__Wave wave,
+    struct wfc__A2d_u8 modified,
+    const struct wfc__Stop *stop) {
+    int head = -1, tail = -1, len = 0;
+    for (int i = 0; i < WFC__A2D_LEN(ripple); ++i) {
+        ripple.a[i] = -1;
+        if (!modified.a[i]) continue;
+
+        if (head < 0) head = i;
+        else ripple.a[tail] = i;
+        tail = i;
+        ++len;
+    }
+    if (head < 0) return 0;
+
+    return wfc__propagateFromRipple(
+        ctx, threads, n, options, pattCnt, overlaps,
+        head, tail, len, ripple, wave, modified, NULL, stop);
+}
+
+// Replaces the row with a collapsed one if all of its points are collapsed.
+void wfc__collapseRowIfDone(
+    void *ctx, struct wfc__Wave wave,
+    const struct wfc__A2d_i wavePattCnts, int c0) {
+    if (wfc__waveRowCollapsed(wave, c0)) return;
+
+    for (int c1 = 0; c1 < wave.d13; ++c1) {
+        if (WFC__A2D_GET(wavePattCnts, c0, c1) > 1) return;
+    }
+
+    wfc__waveCollapseRow(ctx, wave, c0);
+}
+
+// Only counts points that were not collapsed before, so modified points
+// may include ones already counted.
+void wfc__updateCnts(
+    void *ctx,
+    struct wfc__Wave wave,
+    const struct wfc__A2d_u8 modified,
+    struct wfc__A2d_i wavePattCnts,
+    int *collapsedCnt) {
+    for (int c0 = 0; c0 < wave.d03; ++c0) {
+        bool collapsedAny = false;
+
+        for (int c1 = 0; c1 < wave.d13; ++c1) {
             if (!WFC__A2D_GET(modified, c0, c1)) continue;
 
-            int cntPatts = wfc__popcountBitPackA3d(wave, c0, c1);
+            int cntPatts = wfc__wavePopcount(wave, c0, c1);
+            int oldCnt = WFC__A2D_GET(wavePattCnts, c0, c1);
 
             WFC__A2D_GET(wavePattCnts, c0, c1) = cntPatts;
-            if (cntPatts == 1) ++(*collapsedCnt);
+            if (cntPatts == 1 && oldCnt != 1) {
+                ++(*collapsedCnt);
+                collapsedAny = true;
+            }
         }
+
+        // Only rows with newly collapsed points may have become done.
+        if (collapsedAny) wfc__collapseRowIfDone(ctx, wave, wavePattCnts, c0);
     }
 }
 
@@ -1670,14 +4640,37 @@ int wfc__calcStatus(int pattCnt, const struct wfc__A2d_i wavePattCnts) {
     return 0;
 }
 
-struct wfc_State {
-    int status;
-    // User context.
-    void *ctx;
-    int n, options, bytesPerPixel;
-    int srcD0, srcD1, dstD0, dstD1;
-    // Number of collapsed wave points.
-    int collapsedCnt;
+// Observation of multiple points per step, set through wfc_setSpeculation().
+struct wfc__Speculation {
+    // Most points to observe in one step. Off unless greater than one.
+    int obsCnt;
+    // Smallest distance between points observed in the same step.
+    int minDist;
+    // Points observed in the current step.
+    int *obs;
+    // Tells which observed point's area each wave point is in.
+    int *labels;
+    // Rows of the wave from before the step, restored on contradiction.
+    // They are shared with the wave, so only rows modified get copied.
+    struct wfc__WaveRow **backup;
+};
+
+// Observations made by wfc_step(),
+// recorded if turned on through wfc_setObservationLog().
+struct wfc__ObsLog {
+    bool on;
+    // Number of observations and how many fit into the array.
+    int len, cap;
+    // Index of the wave point and the pattern for each observation.
+    int *a;
+};
+
+// Data gathered from the source image during initialization.
+// It never changes after that, so states cloned from one another share it.
+struct wfc__Model {
+    // Number of states referencing this model.
+    // The last one to be freed also frees the model.
+    volatile int refCnt;
     // Number of collected patterns.
     int pattCnt;
     // Patterns collected from source.
@@ -1692,13 +4685,39 @@ struct wfc_State {
     // Ergo, booleans are represented as bits and tightly packed.
     // Use bit pack utility functions when working with this array.
     struct wfc__A3d_u overlaps;
+    // Whether overlaps were mapped in (see wfc__mapHuge()).
+    bool overlapsMapped;
+    // File that patterns and overlaps were mapped in from
+    // (see wfc_initFromModel()), or null if they were allocated.
+    void *file;
+    size_t fileSz;
+};
+
+struct wfc_State {
+    int status;
+    // User context.
+    void *ctx;
+    // Allocation holding the state and its arrays (see wfc__StateLayout),
+    // or null if the caller provided the memory.
+    void *mem;
+    int n, options, bytesPerPixel;
+    int srcD0, srcD1, dstD0, dstD1;
+    // Number of collapsed wave points.
+    int collapsedCnt;
+    // Patterns and their overlaps.
+    // May be shared with other states, must not be modified.
+    struct wfc__Model *model;
+    // Random number generator used in observations.
+    struct wfc__Rng rng;
+    // Number of threads that constraint propagation may use.
+    int threads;
     // Whether, for each point (first two indexes),
     // a particular pattern (bit pack position)
     // is still present.
     // This is a series of bit packs stored as arrays of unsigned.
     // Ergo, booleans are represented as bits and tightly packed.
     // Use bit pack utility functions when working with this array.
-    struct wfc__A3d_u wave;
+    struct wfc__Wave wave;
     // Number of remaining patterns on corresponding wave points.
     struct wfc__A2d_i wavePattCnts;
     // Allocated once and reused when new entropy values are calculated.
@@ -1707,12 +4726,51 @@ struct wfc_State {
     // in the last round of observation and propagation.
     // Allocated once and reused in all propagation calls.
     struct wfc__A2d_u8 modified;
+    // Set if a step ran out of memory before propagating constraints
+    // from all points it modified. The next step does that first.
+    bool unpropagated;
     // Scratch space used for constraint propagation.
     // Check out propagation code to understand how it's used.
     // Allocated once and reused in all propagation calls.
     struct wfc__A2d_i ripple;
+    // Conditions for stopping WFC early, set through wfc_setLimits().
+    struct wfc__Stop stop;
+    struct wfc__Speculation spec;
+    struct wfc__ObsLog log;
 };
 
+// Wave points, and combinations of source pixels and transformations
+// patterns are gathered from, are counted and indexed with ints.
+// There must be few enough of them for that to work,
+// including for propagation and for entropies' extra loop channels.
+bool wfc__countsFit(
+    long long srcD0, long long srcD1, long long dstD0, long long dstD1) {
+    return
+        srcD0 * srcD1 * wfc__tfCnt * wfc__dirCnt <= INT_MAX &&
+        dstD0 * dstD1 + wfc__loopChannels <= INT_MAX;
+}
+
+// Checks the arguments of wfc_initEx(), so that callers can tell
+// argument errors apart from running out of memory.
+bool wfc__initArgsValid(
+    int n, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    const bool *keep) {
+    if (n <= 0 ||
+        bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL ||
+        dstW <= 0 || dstH <= 0 ||
+        n > srcW || n > srcH || n > dstW || n > dstH) {
+        return false;
+    }
+    if (keep != NULL && dst == NULL) {
+        return false;
+    }
+
+    return wfc__countsFit(srcH, srcW, dstH, dstW);
+}
+
 int wfc_generate(
     int n, int options, int bytesPerPixel,
     int srcW, int srcH, const unsigned char *src,
@@ -1731,17 +4789,42 @@ int wfc_generateEx(
     int dstW, int dstH, unsigned char *dst,
     void *ctx,
     bool *keep) {
+    return wfc_generateLimited(
+        n, options, bytesPerPixel,
+        srcW, srcH, src,
+        dstW, dstH, dst,
+        ctx, keep,
+        0.0, NULL
+    );
+}
+
+int wfc_generateLimited(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    bool *keep,
+    double timeLimit, const volatile int *cancel) {
+    if (!wfc__initArgsValid(
+            n, bytesPerPixel, srcW, srcH, src, dstW, dstH, dst, keep)) {
+        return wfc_callerError;
+    }
+
     int ret = 0;
 
     wfc_State *state = wfc_initEx(n, options, bytesPerPixel,
         srcW, srcH, src, dstW, dstH, dst, ctx, keep);
-    if (state == NULL) return wfc_callerError;
+    if (state == NULL) return wfc_outOfMemory;
 
-    while (!wfc_step(state));
+    wfc_setLimits(state, timeLimit, cancel);
 
-    if (wfc_status(state) < 0) {
-        ret = wfc_status(state);
-    } else if (wfc_status(state) == wfc_completed) {
+    // Steps can run out of memory without changing the status.
+    int status;
+    while ((status = wfc_step(state)) == 0);
+
+    if (status < 0) {
+        ret = status;
+    } else if (status == wfc_completed) {
         int code = wfc_blit(state, src, dst);
         if (code != 0) ret = code;
     }
@@ -1751,354 +4834,3600 @@ int wfc_generateEx(
     return ret;
 }
 
-wfc_State* wfc_init(
-    int n, int options, int bytesPerPixel,
-    int srcW, int srcH, const unsigned char *src,
-    int dstW, int dstH) {
-    return wfc_initEx(
-        n, options, bytesPerPixel,
-        srcW, srcH, src,
-        dstW, dstH, NULL,
-        NULL, NULL
-    );
+struct wfc__Portfolio {
+    // Freshly initialized state from which all runs are cloned.
+    const wfc_State *proto;
+    int seedCnt;
+    const unsigned *seeds;
+    // Raised once a run completes to stop the others.
+    volatile int cancel;
+    // Number of seeds taken to be tried so far.
+    volatile int takenSeeds;
+    // Index of the seed of the first state to complete, or -1.
+    // Only the run that sets it writes the winner.
+    volatile long long winnerInd;
+    wfc_State *winner;
+    // Raised if any run ran out of memory.
+    volatile int outOfMemory;
+};
+
+void wfc__portfolioWorker(void *data, int ind) {
+    struct wfc__Portfolio *portfolio = (struct wfc__Portfolio*)data;
+    (void)ind;
+
+    while (!wfc__loadShared_i(&portfolio->cancel)) {
+        int seedInd = wfc__addShared_i(&portfolio->takenSeeds, 1) - 1;
+        if (seedInd >= portfolio->seedCnt) break;
+
+        wfc_State *state = wfc_clone(portfolio->proto);
+        if (state == NULL) {
+            wfc__storeShared_i(&portfolio->outOfMemory, 1);
+            break;
+        }
+        // Runs are already spread across threads.
+        state->threads = 1;
+        wfc_setSeed(state, portfolio->seeds[seedInd]);
+        wfc_setLimits(state, 0.0, &portfolio->cancel);
+
+        int status;
+        while ((status = wfc_step(state)) == 0);
+        if (status == wfc_outOfMemory) {
+            wfc__storeShared_i(&portfolio->outOfMemory, 1);
+        }
+
+        if (status == wfc_completed &&
+            wfc__casShared_ll(&portfolio->winnerInd, -1, seedInd)) {
+            portfolio->winner = state;
+            state = NULL;
+            wfc__storeShared_i(&portfolio->cancel, 1);
+        }
+
+        wfc_free(state);
+    }
 }
 
-// All allocations happen during initialization.
-// @TODO Return an error when there's not enough memory.
-wfc_State* wfc_initEx(
+int wfc_generatePortfolio(
     int n, int options, int bytesPerPixel,
     int srcW, int srcH, const unsigned char *src,
-    int dstW, int dstH, const unsigned char *dst,
+    int dstW, int dstH, unsigned char *dst,
     void *ctx,
-    bool *keep) {
-    if (n <= 0 ||
-        bytesPerPixel <= 0 ||
-        srcW <= 0 || srcH <= 0 || src == NULL ||
-        dstW <= 0 || dstH <= 0 ||
-        n > srcW || n > srcH || n > dstW || n > dstH) {
-        return NULL;
-    }
-    if (keep != NULL && dst == NULL) {
-        return NULL;
+    bool *keep,
+    int threads, int seedCnt, const unsigned *seeds, unsigned *winningSeed) {
+    if (threads <= 0 || seedCnt <= 0 || seeds == NULL) return wfc_callerError;
+    if (!wfc__initArgsValid(
+            n, bytesPerPixel, srcW, srcH, src, dstW, dstH, dst, keep)) {
+        return wfc_callerError;
     }
 
-    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
-
-    wfc_State *state = (wfc_State*)WFC_MALLOC(ctx, sizeof(*state));
-
-    state->status = 0;
-    state->ctx = ctx;
-    state->n = n;
-    state->options = options;
-    state->bytesPerPixel = bytesPerPixel;
-    state->srcD0 = srcH;
-    state->srcD1 = srcW;
-    state->dstD0 = dstH;
-    state->dstD1 = dstW;
-    state->collapsedCnt = 0;
+    int ret = 0;
 
-    state->patts = wfc__gatherPatterns(ctx, n, options, srcA, &state->pattCnt);
+    wfc_State *proto = wfc_initEx(n, options, bytesPerPixel,
+        srcW, srcH, src, dstW, dstH, dst, ctx, keep);
+    if (proto == NULL) return wfc_outOfMemory;
 
-    state->overlaps = wfc__calcOverlaps(
-        ctx, n, srcA, state->pattCnt, state->patts);
+    // All runs would fail in the same way.
+    if (wfc_status(proto) < 0) {
+        ret = wfc_status(proto);
+        wfc_free(proto);
+        return ret;
+    }
 
-    state->wave.d03 = dstH;
-    if (options & wfc__optEdgeFixC0) state->wave.d03 -= n - 1;
-    state->wave.d13 = dstW;
-    if (options & wfc__optEdgeFixC1) state->wave.d13 -= n - 1;
-    state->wave.d23 = wfc__bitPackLen(state->pattCnt);
-    state->wave.a = (unsigned*)WFC_MALLOC(ctx, WFC__A3D_SIZE(state->wave));
-    // Set all patterns as present.
-    memset(state->wave.a, 0xFF, WFC__A3D_SIZE(state->wave));
-    // Surplus bit pack positions don't correspond to any real patterns
-    // so they get set to false.
-    {
-        const int pLo = state->pattCnt;
-        const int pHi = state->wave.d23 * (int)sizeof(*state->wave.a) * 8;
-        for (int c0 = 0; c0 < state->wave.d03; ++c0) {
-            for (int c1 = 0; c1 < state->wave.d13; ++c1) {
-                for (int p = pLo; p < pHi; ++p) {
-                    wfc__setBitA3d(state->wave, c0, c1, p, false);
-                }
-            }
+    struct wfc__Portfolio portfolio;
+    portfolio.proto = proto;
+    portfolio.seedCnt = seedCnt;
+    portfolio.seeds = seeds;
+    portfolio.cancel = 0;
+    portfolio.takenSeeds = 0;
+    portfolio.winnerInd = -1;
+    portfolio.winner = NULL;
+    portfolio.outOfMemory = 0;
+
+    // Each worker keeps taking seeds in order until one run completes.
+    const int workerCnt = wfc__min_i(threads, seedCnt);
+    wfc__parallelFor(
+        ctx, workerCnt, workerCnt, wfc__portfolioWorker, &portfolio);
+
+    if (portfolio.winner == NULL) {
+        ret = portfolio.outOfMemory ? wfc_outOfMemory : wfc_failed;
+    } else {
+        ret = wfc_blit(portfolio.winner, src, dst);
+        if (winningSeed != NULL) {
+            *winningSeed = seeds[(int)portfolio.winnerInd];
         }
     }
 
-    state->wavePattCnts.d02 = state->wave.d03;
-    state->wavePattCnts.d12 = state->wave.d13;
-    state->wavePattCnts.a = (int*)WFC_MALLOC(
-        ctx, WFC__A2D_SIZE(state->wavePattCnts));
-
-    state->entropies = wfc__makeEntropiesArray(
-        ctx, state->wave.d03, state->wave.d13);
-
-    state->modified.d02 = state->wave.d03;
-    state->modified.d12 = state->wave.d13;
-    state->modified.a = (uint8_t*)WFC_MALLOC(
-        ctx, WFC__A2D_SIZE(state->modified));
-    memset(state->modified.a, 1, WFC__A2D_SIZE(state->modified));
+    wfc_free(portfolio.winner);
+    wfc_free(proto);
 
-    state->ripple.d02 = state->wave.d03;
-    state->ripple.d12 = state->wave.d13;
-    state->ripple.a = (int*)WFC_MALLOC(ctx, WFC__A2D_SIZE(state->ripple));
+    return ret;
+}
 
-    // Usually, all patterns are present in all wave points,
-    // unless some extra options were used.
-    // Don't needlessly try to propagate in the usual case.
-    bool propagate = false;
+struct wfc__Batch {
+    // State from which all outputs are cloned. It is freshly initialized
+    // for batches and partially collapsed for variations.
+    const wfc_State *proto;
+    const unsigned char *src;
+    const unsigned *seeds;
+    unsigned char * const *dsts;
+    int *statuses;
+};
 
-    if (keep != NULL) {
-        struct wfc__A3d_cu8 dstA =
-            {state->dstD0, state->dstD1, state->bytesPerPixel, dst};
-        struct wfc__A2d_b keepA = {state->dstD0, state->dstD1, keep};
+void wfc__generateBatchItem(void *data, int ind) {
+    struct wfc__Batch *batch = (struct wfc__Batch*)data;
 
-        if (wfc__restrictKept(
-                n, srcA,
-                state->pattCnt, state->patts,
-                dstA, keepA, state->wave)) {
-            propagate = true;
-        }
+    wfc_State *state = wfc_clone(batch->proto);
+    if (state == NULL) {
+        batch->statuses[ind] = wfc_outOfMemory;
+        return;
     }
+    // Items are already spread across threads.
+    state->threads = 1;
+    wfc_setSeed(state, batch->seeds[ind]);
 
-    if (options & (wfc__optEdgeFixC0 | wfc__optEdgeFixC1)) {
-        if (wfc__restrictEdges(
-                options, state->pattCnt, state->patts, state->wave)) {
-            propagate = true;
-        }
-    }
+    // Steps can run out of memory without changing the status,
+    // so the code they return is what the item ended with.
+    int status;
+    while ((status = wfc_step(state)) == 0);
 
-    if (propagate) {
-        wfc__propagateFromAll(
-            ctx, n, options, state->pattCnt,
-            state->overlaps, state->ripple, state->wave, state->modified);
+    if (status == wfc_completed) {
+        int code = wfc_blit(state, batch->src, batch->dsts[ind]);
+        if (code != 0) status = code;
     }
+    batch->statuses[ind] = status;
 
-    wfc__updateCnts(
-        state->wave, state->modified,
-        state->wavePattCnts, &state->collapsedCnt);
-    state->status = wfc__calcStatus(state->pattCnt, state->wavePattCnts);
-
-    return state;
+    wfc_free(state);
 }
 
-int wfc_status(const wfc_State *state) {
-    if (state == NULL) return wfc_callerError;
+int wfc_generateBatch(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    void *ctx,
+    int threads, int cnt, const unsigned *seeds,
+    unsigned char * const *dsts, int *statuses) {
+    if (threads <= 0 || cnt <= 0 || seeds == NULL || dsts == NULL) {
+        return wfc_callerError;
+    }
+    for (int i = 0; i < cnt; ++i) {
+        if (dsts[i] == NULL) return wfc_callerError;
+    }
+    if (!wfc__initArgsValid(
+            n, bytesPerPixel, srcW, srcH, src, dstW, dstH, NULL, NULL)) {
+        return wfc_callerError;
+    }
 
-    return state->status;
-}
+    int ret = 0;
 
-int wfc_step(wfc_State *state) {
-    if (state == NULL) return wfc_callerError;
+    wfc_State *proto = wfc_initEx(n, options, bytesPerPixel,
+        srcW, srcH, src, dstW, dstH, NULL, ctx, NULL);
+    if (proto == NULL) return wfc_outOfMemory;
+
+    // Each item needs a place to write its status,
+    // even if the caller is not interested in it.
+    int *statusesA = statuses;
+    if (statusesA == NULL) {
+        statusesA = (int*)WFC_MALLOC(ctx, (size_t)cnt * sizeof(*statusesA));
+        if (statusesA == NULL) {
+            wfc_free(proto);
+            return wfc_outOfMemory;
+        }
+    }
 
-    if (state->status != 0) return state->status;
+    struct wfc__Batch batch;
+    batch.proto = proto;
+    batch.src = src;
+    batch.seeds = seeds;
+    batch.dsts = dsts;
+    batch.statuses = statusesA;
 
-    wfc__calcEntropies(
-        state->pattCnt, state->patts, state->wave, state->modified,
-        state->entropies);
+    wfc__parallelFor(ctx, threads, cnt, wfc__generateBatchItem, &batch);
 
-    memset(state->modified.a, 0, WFC__A2D_SIZE(state->modified));
+    for (int i = 0; i < cnt; ++i) {
+        if (statusesA[i] != wfc_completed) ret = wfc_failed;
+    }
 
-    int obsC0, obsC1;
-    wfc__observeOne(
-        state->ctx, state->pattCnt, state->patts, state->entropies,
-        state->wave, state->modified,
-        &obsC0, &obsC1);
+    if (statuses == NULL) WFC_FREE(ctx, statusesA);
+    wfc_free(proto);
 
-    wfc__propagateFromSeed(
-        state->ctx, state->n, state->options, state->pattCnt,
-        obsC0, obsC1,
-        state->overlaps, state->ripple, state->wave, state->modified);
+    return ret;
+}
 
-    wfc__updateCnts(
-        state->wave, state->modified,
-        state->wavePattCnts, &state->collapsedCnt);
-    state->status = wfc__calcStatus(state->pattCnt, state->wavePattCnts);
+wfc_State* wfc_init(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH) {
+    return wfc_initEx(
+        n, options, bytesPerPixel,
+        srcW, srcH, src,
+        dstW, dstH, NULL,
+        NULL, NULL
+    );
+}
 
-    return state->status;
+// Size of a model and its patterns, but not of its overlaps.
+size_t wfc__modelSize(int pattCnt) {
+    return sizeof(struct wfc__Model) +
+        (size_t)pattCnt * sizeof(struct wfc__Pattern);
 }
 
-int wfc_blit(
-    const wfc_State *state,
-    const unsigned char *src, unsigned char *dst) {
-    if (state == NULL || state->status != wfc_completed ||
-        src == NULL || dst == NULL) {
-        return wfc_callerError;
+// Allocates a model with a single reference, owned by the caller.
+// Returns null if there is not enough memory.
+struct wfc__Model* wfc__makeModel(
+    void *ctx, int threads, int n, int options,
+    const struct wfc__A3d_cu8 src) {
+    struct wfc__Model *model =
+        (struct wfc__Model*)WFC_MALLOC(ctx, sizeof(*model));
+    if (model == NULL) return NULL;
+    model->refCnt = 1;
+
+    model->patts = wfc__gatherPatterns(
+        ctx, threads, n, options, src, &model->pattCnt);
+    if (model->patts == NULL) {
+        WFC_FREE(ctx, model);
+        return NULL;
     }
 
-    struct wfc__A3d_cu8 srcA =
-        {state->srcD0, state->srcD1, state->bytesPerPixel, src};
-    struct wfc__A3d_u8 dstA =
-        {state->dstD0, state->dstD1, state->bytesPerPixel, dst};
-
-    for (int c0 = 0; c0 < state->dstD0; ++c0) {
-        for (int c1 = 0; c1 < state->dstD1; ++c1) {
-            int wC0, wC1, pC0, pC1;
-            wfc__coordsDstToWave(c0, c1, state->wave, &wC0, &wC1, &pC0, &pC1);
-
-            int patt = 0;
-            for (int p = 0; p < state->pattCnt; ++p) {
-                if (wfc__getBitA3d(state->wave, wC0, wC1, p)) {
-                    patt = p;
-                    break;
-                }
-            }
+    model->overlaps = wfc__calcOverlaps(
+        ctx, threads, n, src, model->pattCnt, model->patts,
+        wfc__hugePagesOn(options), &model->overlapsMapped);
+    if (model->overlaps.a == NULL) {
+        WFC_FREE(ctx, model->patts);
+        WFC_FREE(ctx, model);
+        return NULL;
+    }
 
-            int sC0, sC1;
-            wfc__coordsPattToSrc(
-                state->n, state->patts[patt], pC0, pC1, srcA.d03, srcA.d13,
-                &sC0, &sC1);
+    model->file = NULL;
+    model->fileSz = 0;
 
-            const uint8_t *srcPx = &WFC__A3D_GET(srcA, sC0, sC1, 0);
-            uint8_t *dstPx = &WFC__A3D_GET(dstA, c0, c1, 0);
+    return model;
+}
+
+// Drops a reference to the model, freeing it if that was the last one.
+void wfc__releaseModel(void *ctx, struct wfc__Model *model) {
+    (void)ctx;
 
-            memcpy(dstPx, srcPx, (size_t)state->bytesPerPixel);
+    if (wfc__addShared_i(&model->refCnt, -1) == 0) {
+        if (model->file != NULL) {
+            wfc__unmapFile(model->file, model->fileSz);
+            WFC_FREE(ctx, model);
+            return;
         }
-    }
 
-    return 0;
+        if (model->overlapsMapped) {
+            wfc__unmapHuge(model->overlaps.a, WFC__A3D_SIZE(model->overlaps));
+        } else {
+            WFC_FREE(ctx, model->overlaps.a);
+        }
+        WFC_FREE(ctx, model->patts);
+        WFC_FREE(ctx, model);
+    }
 }
 
-wfc_State* wfc_clone(const wfc_State *state) {
-    if (state == NULL) return NULL;
+// Fixing edges also means that the wave does not wrap around them.
+int wfc__wrapOptions(int options) {
+    options &= ~(wfc__optNoWrapC0 | wfc__optNoWrapC1);
+    if (options & wfc__optEdgeFixC0) options |= wfc__optNoWrapC0;
+    if (options & wfc__optEdgeFixC1) options |= wfc__optNoWrapC1;
+
+    return options;
+}
 
-    wfc_State *clone = (wfc_State*)WFC_MALLOC(state->ctx, sizeof(*clone));
+// Wave points that patterns placed at them would go past an edge of the output
+// are left out, unless the wave wraps around that edge.
+void wfc__waveDims(
+    int n, int options, int dstD0, int dstD1, int *waveD0, int *waveD1) {
+    *waveD0 = dstD0;
+    if (options & wfc__optNoWrapC0) *waveD0 -= n - 1;
+    *waveD1 = dstD1;
+    if (options & wfc__optNoWrapC1) *waveD1 -= n - 1;
+}
 
-    *clone = *state;
+// A state and all of its arrays whose sizes don't depend on the model
+// are laid out in a single block of memory, in this order.
+// Offsets are from the start of the state,
+// which is aligned to a cache line.
+// Wave rows aren't in the block, as they get shared between clones.
+struct wfc__StateLayout {
+    size_t rows, wavePattCnts, entropies, modified, ripple;
+    // Bytes from the start of the state to the end of the last array.
+    size_t used;
+    // Bytes the block needs to have, with room for aligning the state.
+    size_t size;
+};
 
-    size_t pattsSz = (size_t)state->pattCnt * sizeof(*state->patts);
-    clone->patts = (struct wfc__Pattern*)WFC_MALLOC(state->ctx, pattsSz);
-    memcpy(clone->patts, state->patts, pattsSz);
+// Wave dimensions must have been checked with wfc__countsFit().
+struct wfc__StateLayout wfc__stateLayout(int waveD0, int waveD1) {
+    const size_t pntCnt = wfc__mulSz((size_t)waveD0, (size_t)waveD1);
+    const size_t entropiesLen = (size_t)wfc__entropiesLen(waveD0, waveD1);
 
-    clone->overlaps.a = (unsigned*)WFC_MALLOC(
-        state->ctx, WFC__A3D_SIZE(state->overlaps));
-    memcpy(clone->overlaps.a, state->overlaps.a,
-        WFC__A3D_SIZE(state->overlaps));
+    struct wfc__StateLayout layout;
+    size_t off = wfc__alignUp(sizeof(wfc_State), wfc__cacheLineSz);
 
-    clone->wave.a = (unsigned*)WFC_MALLOC(
-        state->ctx, WFC__A3D_SIZE(state->wave));
-    memcpy(clone->wave.a, state->wave.a,
-        WFC__A3D_SIZE(state->wave));
+    layout.rows = off;
+    off = wfc__addSz(
+        off, wfc__mulSz((size_t)waveD0, sizeof(struct wfc__WaveRow*)));
+    off = wfc__alignUp(off, wfc__cacheLineSz);
 
-    clone->wavePattCnts.a = (int*)WFC_MALLOC(
-        state->ctx, WFC__A2D_SIZE(state->wavePattCnts));
-    memcpy(clone->wavePattCnts.a, state->wavePattCnts.a,
-        WFC__A2D_SIZE(state->wavePattCnts));
+    layout.wavePattCnts = off;
+    off = wfc__addSz(off, wfc__mulSz(pntCnt, sizeof(int)));
+    off = wfc__alignUp(off, wfc__cacheLineSz);
 
-    clone->entropies = wfc__makeEntropiesArray(
-        state->ctx, state->entropies.d02, state->entropies.d12);
-    memcpy(clone->entropies.a, state->entropies.a,
-        WFC__A2D_SIZE(state->entropies));
+    layout.entropies = off;
+    off = wfc__addSz(off, wfc__mulSz(entropiesLen, sizeof(float)));
+    off = wfc__alignUp(off, wfc__cacheLineSz);
 
-    clone->modified.a = (uint8_t*)WFC_MALLOC(
-        state->ctx, WFC__A2D_SIZE(state->modified));
-    memcpy(clone->modified.a, state->modified.a,
-        WFC__A2D_SIZE(state->modified));
+    layout.modified = off;
+    off = wfc__addSz(off, wfc__mulSz(pntCnt, sizeof(uint8_t)));
+    off = wfc__alignUp(off, wfc__cacheLineSz);
 
-    clone->ripple.a = (int*)WFC_MALLOC(
-        state->ctx, WFC__A2D_SIZE(state->ripple));
-    memcpy(clone->ripple.a, state->ripple.a,
-        WFC__A2D_SIZE(state->ripple));
+    layout.ripple = off;
+    off = wfc__addSz(off, wfc__mulSz(pntCnt, sizeof(int)));
 
-    return clone;
-}
+    layout.used = off;
+    layout.size = wfc__addSz(off, wfc__cacheLineSz - 1);
 
-size_t wfc__sizeOfAllocs(wfc_State *state) {
-    return
-        (size_t)state->pattCnt * sizeof(*state->patts) +
-        WFC__A3D_SIZE(state->overlaps) +
-        WFC__A3D_SIZE(state->wave) +
-        WFC__A2D_SIZE(state->wavePattCnts) +
-        WFC__A2D_SIZE(state->entropies) +
-        WFC__A2D_SIZE(state->modified) +
-        WFC__A2D_SIZE(state->ripple);
+    return layout;
 }
 
-void wfc_free(wfc_State *state) {
-    if (state == NULL) return;
+// Points the state's arrays into the block of memory it starts.
+// Their dimensions need to already be set.
+void wfc__placeStateArrays(wfc_State *state) {
+    const struct wfc__StateLayout layout =
+        wfc__stateLayout(state->wave.d03, state->wave.d13);
 
-    void *ctx = state->ctx;
-    (void)ctx;
+    unsigned char *block = (unsigned char*)state;
 
-    WFC_FREE(ctx, state->ripple.a);
-    WFC_FREE(ctx, state->modified.a);
-    WFC_FREE(ctx, state->entropies.a);
-    WFC_FREE(ctx, state->wavePattCnts.a);
-    WFC_FREE(ctx, state->wave.a);
-    WFC_FREE(ctx, state->overlaps.a);
-    WFC_FREE(ctx, state->patts);
-    WFC_FREE(ctx, state);
+    state->wave.rows = (struct wfc__WaveRow**)(block + layout.rows);
+    state->wavePattCnts.a = (int*)(block + layout.wavePattCnts);
+    state->entropies.a = (float*)(block + layout.entropies);
+    state->modified.a = (uint8_t*)(block + layout.modified);
+    state->ripple.a = (int*)(block + layout.ripple);
 }
 
-int wfc_collapsedCount(const wfc_State *state) {
-    if (state == NULL) return wfc_callerError;
+// Where a state starts in a block of memory of wfc__StateLayout.size bytes.
+wfc_State* wfc__stateInBlock(void *mem) {
+    const uintptr_t addr = (uintptr_t)mem;
 
-    return state->collapsedCnt;
+    return (wfc_State*)
+        ((unsigned char*)mem + (wfc__alignUp(addr, wfc__cacheLineSz) - addr));
 }
 
-int wfc_patternCount(const wfc_State *state) {
-    if (state == NULL) return wfc_callerError;
+// Initializes a state that references an existing model.
+// Patterns are only restricted on the given sides of the output
+// (see wfc__restrictEdges()).
+// The state is placed in the given memory,
+// which must be of at least wfc__StateLayout.size bytes,
+// or in newly allocated memory if none is given.
+// Further allocations are only made for wave rows as they get modified
+// and for buffers of speculative observation.
+// Returns null if there is not enough memory.
+wfc_State* wfc__initWithModel(
+    void *ctx, int threads, struct wfc__Model *model,
+    int n, int options, const struct wfc__A3d_cu8 srcA,
+    int dstD0, int dstD1, const unsigned char *dst,
+    bool *keep, int sides,
+    void *mem) {
+    int waveD0, waveD1;
+    wfc__waveDims(n, options, dstD0, dstD1, &waveD0, &waveD1);
+
+    const struct wfc__StateLayout layout = wfc__stateLayout(waveD0, waveD1);
+
+    void *alloc = NULL;
+    if (mem == NULL) {
+        alloc = WFC_MALLOC(ctx, layout.size);
+        if (alloc == NULL) return NULL;
+
+        mem = alloc;
+    }
 
-    return state->pattCnt;
-}
+    wfc_State *state = wfc__stateInBlock(mem);
 
-int wfc_patternPresentAt(const wfc_State *state, int patt, int x, int y) {
-    if (state == NULL ||
-        patt < 0 || patt >= state->pattCnt ||
-        x < 0 || x >= state->dstD1 ||
-        y < 0 || y >= state->dstD0) {
-        return wfc_callerError;
+    state->status = 0;
+    state->ctx = ctx;
+    state->mem = alloc;
+    state->n = n;
+    state->options = options;
+    state->bytesPerPixel = srcA.d23;
+    state->srcD0 = srcA.d03;
+    state->srcD1 = srcA.d13;
+    state->dstD0 = dstD0;
+    state->dstD1 = dstD1;
+    state->collapsedCnt = 0;
+    state->unpropagated = false;
+    state->stop.cancel = NULL;
+    state->stop.deadline = -1.0;
+    state->spec.obsCnt = 1;
+    state->spec.minDist = 1;
+    state->spec.obs = NULL;
+    state->spec.labels = NULL;
+    state->spec.backup = NULL;
+    state->log.on = false;
+    state->log.len = 0;
+    state->log.cap = 0;
+    state->log.a = NULL;
+
+    state->rng.seeded = false;
+    state->rng.state = 0;
+
+    state->threads = threads;
+
+    state->wave.d03 = waveD0;
+    state->wave.d13 = waveD1;
+    state->wavePattCnts.d02 = waveD0;
+    state->wavePattCnts.d12 = waveD1;
+    state->modified.d02 = waveD0;
+    state->modified.d12 = waveD1;
+    state->ripple.d02 = waveD0;
+    state->ripple.d12 = waveD1;
+    wfc__placeStateArrays(state);
+
+    state->entropies =
+        wfc__makeEntropiesArray(waveD0, waveD1, state->entropies.a);
+
+    // Set all patterns as present.
+    if (!wfc__makeWave(
+            ctx, waveD0, waveD1, model->pattCnt,
+            state->wave.rows, &state->wave)) {
+        if (alloc != NULL) WFC_FREE(ctx, alloc);
+        return NULL;
+    }
+    // Rows are allocated on their own if the arena can't be mapped.
+    if (wfc__hugePagesOn(options)) {
+        state->wave.arena = wfc__makeRowArena(ctx, state->wave, -1);
     }
 
-    // x and y are only needed when some edges are fixed
-    // and wave is smaller than destination.
-    // wfc__coordsDstToWave handles all of that.
-    // In that case, a different wave point
-    // may contain which patterns are present for multiple destination points.
-    int wC0, wC1;
-    wfc__coordsDstToWave(y, x, state->wave, &wC0, &wC1, NULL, NULL);
+    wfc__addShared_i(&model->refCnt, 1);
+    state->model = model;
 
-    return wfc__getBitA3d(state->wave, wC0, wC1, patt);
-}
+    memset(state->modified.a, 1, WFC__A2D_SIZE(state->modified));
+    memset(state->wavePattCnts.a, 0, WFC__A2D_SIZE(state->wavePattCnts));
 
-int wfc_modifiedAt(const wfc_State *state, int x, int y) {
-    if (state == NULL ||
-        x < 0 || x >= state->dstD1 ||
-        y < 0 || y >= state->dstD0) {
+    // Usually, all patterns are present in all wave points,
+    // unless some extra options were used.
+    // Don't needlessly try to propagate in the usual case.
+    bool propagate = false;
+    // Set to wfc_outOfMemory if a row could not be copied.
+    int code = 0;
+
+    if (keep != NULL) {
+        struct wfc__A3d_cu8 dstA =
+            {state->dstD0, state->dstD1, state->bytesPerPixel, dst};
+        struct wfc__A2d_b keepA = {state->dstD0, state->dstD1, keep};
+
+        code = wfc__restrictKept(
+            ctx, n, srcA,
+            state->model->pattCnt, state->model->patts,
+            dstA, keepA, state->wave);
+        if (code > 0) propagate = true;
+    }
+
+    if (code >= 0 && (options & (wfc__optEdgeFixC0 | wfc__optEdgeFixC1))) {
+        code = wfc__restrictEdges(
+            ctx, options, sides, state->model->pattCnt, state->model->patts,
+            state->wave);
+        if (code > 0) propagate = true;
+    }
+
+    if (code >= 0 && propagate) {
+        code = wfc__propagateFromAll(
+            ctx, threads, n, options, state->model->pattCnt,
+            state->model->overlaps, state->ripple, state->wave, state->modified,
+            NULL);
+    }
+
+    if (code < 0) {
+        wfc_free(state);
+        return NULL;
+    }
+
+    wfc__updateCnts(
+        ctx, state->wave, state->modified,
+        state->wavePattCnts, &state->collapsedCnt);
+    state->status = wfc__calcStatus(state->model->pattCnt, state->wavePattCnts);
+
+    return state;
+}
+
+// Shared by wfc_initEx(), wfc_initInPlace() and wfc_initFromModel().
+// If mem is null, memory for the state is allocated.
+// If model is null, patterns are gathered from the source.
+wfc_State* wfc__init(
+    void *mem, size_t memSz,
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    void *ctx,
+    bool *keep,
+    struct wfc__Model *model) {
+    if (!wfc__initArgsValid(
+            n, bytesPerPixel, srcW, srcH, src, dstW, dstH, dst, keep)) {
+        return NULL;
+    }
+    if (mem != NULL && memSz < wfc_stateSize(n, options, dstW, dstH)) {
+        return NULL;
+    }
+
+    options = wfc__wrapOptions(options);
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+
+    const int threads = WFC_THREADS(ctx);
+
+    if (model != NULL) {
+        wfc__addShared_i(&model->refCnt, 1);
+    } else {
+        model = wfc__makeModel(ctx, threads, n, options, srcA);
+        if (model == NULL) return NULL;
+    }
+
+    wfc_State *state = wfc__initWithModel(
+        ctx, threads, model, n, options, srcA,
+        dstH, dstW, dst, keep, wfc__sideAll, mem);
+
+    wfc__releaseModel(ctx, model);
+
+    return state;
+}
+
+size_t wfc_stateSize(int n, int options, int dstW, int dstH) {
+    if (n <= 0 || dstW <= 0 || dstH <= 0 || n > dstW || n > dstH ||
+        !wfc__countsFit(n, n, dstH, dstW)) {
+        return 0;
+    }
+
+    int waveD0, waveD1;
+    wfc__waveDims(
+        n, wfc__wrapOptions(options), dstH, dstW, &waveD0, &waveD1);
+
+    return wfc__stateLayout(waveD0, waveD1).size;
+}
+
+wfc_State* wfc_initInPlace(
+    void *mem, size_t memSz,
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    void *ctx,
+    bool *keep) {
+    if (mem == NULL) return NULL;
+
+    return wfc__init(
+        mem, memSz,
+        n, options, bytesPerPixel,
+        srcW, srcH, src,
+        dstW, dstH, dst,
+        ctx, keep, NULL);
+}
+
+int wfc_analyze(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    void *ctx,
+    wfc_Analysis *analysis) {
+    if (n <= 0 ||
+        bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL ||
+        dstW <= 0 || dstH <= 0 ||
+        n > srcW || n > srcH || n > dstW || n > dstH ||
+        analysis == NULL) {
+        return wfc_callerError;
+    }
+    if (!wfc__countsFit(srcH, srcW, dstH, dstW)) {
         return wfc_callerError;
     }
 
-    int wC0, wC1;
-    wfc__coordsDstToWave(y, x, state->wave, &wC0, &wC1, NULL, NULL);
+    options = wfc__wrapOptions(options);
 
-    return WFC__A2D_GET(state->modified, wC0, wC1);
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+
+    int pattCnt;
+    struct wfc__Pattern *patts = wfc__gatherPatterns(
+        ctx, WFC_THREADS(ctx), n, options, srcA, &pattCnt);
+    if (patts == NULL) return wfc_outOfMemory;
+    WFC_FREE(ctx, patts);
+
+    int waveD0, waveD1;
+    wfc__waveDims(n, options, dstH, dstW, &waveD0, &waveD1);
+
+    const struct wfc__A3d_u overlaps = {
+        wfc__dirCnt, pattCnt, wfc__bitPackLen(pattCnt), NULL
+    };
+    const struct wfc__Wave wave = {
+        waveD0, waveD1, wfc__bitPackLen(pattCnt), NULL, NULL
+    };
+
+    analysis->patternCount = pattCnt;
+    analysis->patternsSize = wfc__modelSize(pattCnt);
+    analysis->overlapsSize = WFC__A3D_SIZE(overlaps);
+    analysis->waveSize =
+        wfc__mulSz((size_t)waveD0, wfc__waveRowSize(wave));
+    analysis->stateSize = wfc__stateLayout(waveD0, waveD1).size;
+    analysis->scratchSize = wfc__mulSz(
+        (size_t)wfc__pattCombCnt(srcH, srcW), sizeof(int));
+    analysis->totalSize = wfc__addSz(
+        wfc__addSz(analysis->patternsSize, analysis->overlapsSize),
+        wfc__addSz(analysis->waveSize, analysis->stateSize));
+
+    return 0;
 }
 
-const unsigned char* wfc_pixelToBlitAt(
-    const wfc_State *state, const unsigned char *src,
-    int patt, int x, int y) {
-    if (state == NULL ||
-        src == NULL ||
-        patt < 0 || patt >= state->pattCnt ||
-        x < 0 || x >= state->dstD1 ||
-        y < 0 || y >= state->dstD0) {
+wfc_State* wfc_initEx(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    void *ctx,
+    bool *keep) {
+    return wfc__init(
+        NULL, 0,
+        n, options, bytesPerPixel,
+        srcW, srcH, src,
+        dstW, dstH, dst,
+        ctx, keep, NULL);
+}
+
+// Files that models are saved to start with this header,
+// followed by patterns, and then by overlaps on a page of their own.
+// Values are stored as they are in memory.
+struct wfc__ModelFile {
+    char magic[8];
+    // Changes whenever the format changes.
+    int version;
+    // Sizes of types stored in the file, to catch files from other systems.
+    int pattSz, unsignedSz;
+
+    // See wfc_modelKey().
+    unsigned long long key;
+    int n, options, bytesPerPixel, srcD0, srcD1;
+    int pattCnt;
+
+    // Offsets from the start of the file.
+    size_t pattsOff, overlapsOff;
+    size_t size;
+};
+
+enum { wfc__modelFileVersion = 1 };
+
+// Options that make no difference to the gathered patterns are left out.
+int wfc__modelOptions(int options) {
+    return wfc__wrapOptions(options) & ~wfc_optHugePages;
+}
+
+// FNV-1a, followed by mixing in the other parameters.
+unsigned long long wfc__modelKey(
+    int n, int options, const struct wfc__A3d_cu8 src) {
+    uint64_t h = 14695981039346656037u;
+    const size_t sz = WFC__A3D_SIZE(src);
+    for (size_t i = 0; i < sz; ++i) {
+        h = (h ^ src.a[i]) * 1099511628211u;
+    }
+
+    const int params[] = {n, options, src.d23, src.d03, src.d13};
+    for (size_t i = 0; i < sizeof(params) / sizeof(*params); ++i) {
+        h ^= (uint64_t)(uint32_t)params[i];
+        h = wfc__splitMix64(&h);
+    }
+
+    return h;
+}
+
+// The header a file saved for the given model and source would have.
+struct wfc__ModelFile wfc__modelFileHeader(
+    int n, int options, const struct wfc__A3d_cu8 src, int pattCnt) {
+    struct wfc__ModelFile header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, "wfcmodel", sizeof(header.magic));
+    header.version = wfc__modelFileVersion;
+    header.pattSz = (int)sizeof(struct wfc__Pattern);
+    header.unsignedSz = (int)sizeof(unsigned);
+
+    header.key = wfc__modelKey(n, options, src);
+    header.n = n;
+    header.options = options;
+    header.bytesPerPixel = src.d23;
+    header.srcD0 = src.d03;
+    header.srcD1 = src.d13;
+    header.pattCnt = pattCnt;
+
+    const struct wfc__A3d_u overlaps =
+        {wfc__dirCnt, pattCnt, wfc__bitPackLen(pattCnt), NULL};
+
+    header.pattsOff = wfc__alignUp(sizeof(header), wfc__cacheLineSz);
+    header.overlapsOff = wfc__alignUp(
+        wfc__addSz(
+            header.pattsOff,
+            wfc__mulSz((size_t)pattCnt, sizeof(struct wfc__Pattern))),
+        wfc__filePageSz);
+    header.size = wfc__addSz(header.overlapsOff, WFC__A3D_SIZE(overlaps));
+
+    return header;
+}
+
+// Returns null if the file does not hold a model for these arguments,
+// or if there is not enough memory.
+struct wfc__Model* wfc__loadModel(
+    void *ctx, int fd, int n, int options, const struct wfc__A3d_cu8 src) {
+    (void)ctx;
+
+#ifdef WFC_USE_MMAP
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        st.st_size < (off_t)sizeof(struct wfc__ModelFile)) {
+        return NULL;
+    }
+
+    struct wfc__ModelFile header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        return NULL;
+    }
+    if (memcmp(header.magic, "wfcmodel", sizeof(header.magic)) != 0 ||
+        header.version != wfc__modelFileVersion ||
+        header.pattCnt <= 0) {
+        return NULL;
+    }
+
+    // Everything else is checked by comparing against the header
+    // this library would write for the same arguments.
+    const struct wfc__ModelFile expected =
+        wfc__modelFileHeader(n, options, src, header.pattCnt);
+    if (memcmp(&header, &expected, sizeof(header)) != 0 ||
+        (size_t)st.st_size != header.size) {
+        return NULL;
+    }
+
+    unsigned char *file = (unsigned char*)mmap(
+        NULL, header.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED) return NULL;
+
+    // A file can be overwritten, so patterns are checked
+    // before their coordinates get used as indexes,
+    // and before their frequencies get used as weights.
+    const struct wfc__Pattern *patts =
+        (const struct wfc__Pattern*)(file + header.pattsOff);
+    for (int i = 0; i < header.pattCnt; ++i) {
+        if (patts[i].c0 < 0 || patts[i].c0 >= src.d03 ||
+            patts[i].c1 < 0 || patts[i].c1 >= src.d13 ||
+            patts[i].tf < 0 || patts[i].tf >= wfc__tfCnt ||
+            patts[i].freq <= 0) {
+            munmap(file, header.size);
+            return NULL;
+        }
+    }
+
+    struct wfc__Model *model =
+        (struct wfc__Model*)WFC_MALLOC(ctx, sizeof(*model));
+    if (model == NULL) {
+        munmap(file, header.size);
         return NULL;
     }
 
+    // The mapping is read-only, but models are never modified anyway.
+    model->refCnt = 1;
+    model->pattCnt = header.pattCnt;
+    model->patts = (struct wfc__Pattern*)patts;
+    model->overlaps.d03 = wfc__dirCnt;
+    model->overlaps.d13 = header.pattCnt;
+    model->overlaps.d23 = wfc__bitPackLen(header.pattCnt);
+    model->overlaps.a = (unsigned*)(file + header.overlapsOff);
+    model->overlapsMapped = false;
+    model->file = file;
+    model->fileSz = header.size;
+
+    return model;
+#else
+    (void)fd;
+    (void)n;
+    (void)options;
+    (void)src;
+    return NULL;
+#endif
+}
+
+unsigned long long wfc_modelKey(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src) {
+    if (n <= 0 || bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL) {
+        return 0;
+    }
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+
+    return wfc__modelKey(n, wfc__modelOptions(options), srcA);
+}
+
+int wfc_saveModel(const wfc_State *state, const unsigned char *src, int fd) {
+    if (state == NULL || src == NULL || fd < 0) return wfc_callerError;
+
+#ifdef WFC_USE_MMAP
+    const struct wfc__Model *model = state->model;
+
     struct wfc__A3d_cu8 srcA =
         {state->srcD0, state->srcD1, state->bytesPerPixel, src};
 
-    // Similar case as in wfc_patternPresentAt(),
-    // except here we care about the offsets
-    // which are also the pattern-space coordinates of the pixel.
-    int pC0, pC1;
-    wfc__coordsDstToWave(y, x, state->wave, NULL, NULL, &pC0, &pC1);
+    const struct wfc__ModelFile header = wfc__modelFileHeader(
+        state->n, wfc__modelOptions(state->options), srcA, model->pattCnt);
+    if (header.size == SIZE_MAX) return wfc_outOfMemory;
 
-    int sC0, sC1;
-    wfc__coordsPattToSrc(
-        state->n, state->patts[patt], pC0, pC1, srcA.d03, srcA.d13,
-        &sC0, &sC1);
+    unsigned char *file = (unsigned char*)wfc__mapFile(fd, header.size);
+    if (file == NULL) return wfc_outOfMemory;
 
-    return &WFC__A3D_GET(srcA, sC0, sC1, 0);
+    memcpy(file + header.pattsOff, model->patts,
+        (size_t)model->pattCnt * sizeof(*model->patts));
+    memcpy(file + header.overlapsOff, model->overlaps.a,
+        WFC__A3D_SIZE(model->overlaps));
+
+    // Until the header is written, the file is rejected when loaded,
+    // so the rest of it must reach the disk first.
+    int ret = 0;
+    if (msync(file, header.size, MS_SYNC) != 0) ret = wfc_outOfMemory;
+    if (ret == 0) {
+        memcpy(file, &header, sizeof(header));
+        if (msync(file, header.size, MS_SYNC) != 0) ret = wfc_outOfMemory;
+    }
+
+    wfc__unmapFile(file, header.size);
+
+    return ret;
+#else
+    return wfc_callerError;
+#endif
+}
+
+wfc_State* wfc_initFromModel(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, const unsigned char *dst,
+    void *ctx,
+    bool *keep,
+    int fd) {
+    if (n <= 0 || bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL || fd < 0) {
+        return NULL;
+    }
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+
+    struct wfc__Model *model =
+        wfc__loadModel(ctx, fd, n, wfc__modelOptions(options), srcA);
+    if (model == NULL) return NULL;
+
+    wfc_State *state = wfc__init(
+        NULL, 0,
+        n, options, bytesPerPixel,
+        srcW, srcH, src,
+        dstW, dstH, dst,
+        ctx, keep, model);
+
+    wfc__releaseModel(ctx, model);
+
+    return state;
+}
+
+int wfc_status(const wfc_State *state) {
+    if (state == NULL) return wfc_callerError;
+
+    return state->status;
+}
+
+int wfc_setSeed(wfc_State *state, unsigned seed) {
+    if (state == NULL) return wfc_callerError;
+
+    wfc__rngSeed(&state->rng, seed);
+
+    return 0;
+}
+
+int wfc_setLimits(
+    wfc_State *state, double timeLimit, const volatile int *cancel) {
+    if (state == NULL) return wfc_callerError;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    state->stop.cancel = cancel;
+    state->stop.deadline = timeLimit > 0.0 ? WFC_CLOCK(ctx) + timeLimit : -1.0;
+
+    return 0;
+}
+
+// speculative observation
+
+// Sets the label of all wave points at most radius away from the given one.
+void wfc__labelSquare(
+    const wfc_State *state, int *labels, int ind, int radius, int label) {
+    const int d0 = state->wave.d03, d1 = state->wave.d13;
+
+    int c0, c1;
+    wfc__indToCoords2d(d1, ind, &c0, &c1);
+
+    for (int i = c0 - radius; i <= c0 + radius; ++i) {
+        if ((state->options & wfc__optNoWrapC0) && (i < 0 || i >= d0)) continue;
+
+        for (int j = c1 - radius; j <= c1 + radius; ++j) {
+            if ((state->options & wfc__optNoWrapC1) && (j < 0 || j >= d1)) {
+                continue;
+            }
+
+            labels[wfc__coords2dToInd(
+                d1, wfc__indWrap(i, d0), wfc__indWrap(j, d1))] = label;
+        }
+    }
+}
+
+// Same as picking a point in wfc__observeOne(),
+// but only out of the points labelled -1.
+// Returns -1 if all of those are collapsed.
+int wfc__pickUnlabelled(wfc_State *state, const int *labels) {
+    const struct wfc__A2d_f entropies = state->entropies;
+
+    float smallest = FLT_MAX;
+    for (int i = 0; i < WFC__A2D_LEN(entropies); ++i) {
+        if (labels[i] == -1) smallest = wfc__min_f(smallest, entropies.a[i]);
+    }
+    if (smallest == FLT_MAX) return -1;
+
+    int smallestCnt = 0;
+    for (int i = 0; i < WFC__A2D_LEN(entropies); ++i) {
+        if (labels[i] == -1 &&
+            wfc__approxEqNonNeg_f(entropies.a[i], smallest)) {
+            ++smallestCnt;
+        }
+    }
+
+    int chosenSmallestPnt = wfc__rand_i(state->ctx, &state->rng, smallestCnt);
+    for (int i = 0; i < WFC__A2D_LEN(entropies); ++i) {
+        if (labels[i] == -1 &&
+            wfc__approxEqNonNeg_f(entropies.a[i], smallest)) {
+            if (chosenSmallestPnt == 0) return i;
+            --chosenSmallestPnt;
+        }
+    }
+
+    // Unreachable.
+    return -1;
+}
+
+struct wfc__SpeculativePropagation {
+    wfc_State *state;
+    // Non-zero if a propagation was stopped early.
+    volatile int stopStatus;
+};
+
+void wfc__propagateSpeculativeItem(void *data, int ind) {
+    struct wfc__SpeculativePropagation *prop =
+        (struct wfc__SpeculativePropagation*)data;
+    wfc_State *state = prop->state;
+
+    // Same as wfc__propagateFromSeed(),
+    // except that ripple was already emptied.
+    const int obs = state->spec.obs[ind];
+    int status = wfc__propagateFromRipple(
+        state->ctx, 1, state->n, state->options, state->model->pattCnt,
+        state->model->overlaps,
+        obs, obs, 1, state->ripple, state->wave, state->modified,
+        state->spec.labels, &state->stop);
+
+    if (status != 0) wfc__storeShared_i(&prop->stopStatus, status);
+}
+
+// Makes room for recording the given number of observations.
+// Returns false if there is not enough memory.
+bool wfc__reserveObsLog(wfc_State *state, int cnt) {
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    struct wfc__ObsLog *log = &state->log;
+    if (!log->on || log->cap - log->len >= cnt) return true;
+
+    int cap = log->cap > 0 ? log->cap : 64;
+    while (cap - log->len < cnt) {
+        if (cap > INT_MAX / 4) return false;
+        cap *= 2;
+    }
+
+    int *a = (int*)WFC_MALLOC(ctx, (size_t)cap * 2 * sizeof(*a));
+    if (a == NULL) return false;
+
+    if (log->a != NULL) {
+        memcpy(a, log->a, (size_t)log->len * 2 * sizeof(*a));
+        WFC_FREE(ctx, log->a);
+    }
+    log->a = a;
+    log->cap = cap;
+
+    return true;
+}
+
+// Records the observation of a point that was just collapsed.
+// Room for it needs to be made first (see wfc__reserveObsLog()).
+void wfc__logObservation(wfc_State *state, int c0, int c1) {
+    struct wfc__ObsLog *log = &state->log;
+    if (!log->on) return;
+
+    log->a[log->len * 2] = wfc__coords2dToInd(state->wave.d13, c0, c1);
+    log->a[log->len * 2 + 1] = wfc__pntSingle(
+        wfc__wavePnt(state->wave, c0, c1), state->wave.d23);
+    ++log->len;
+}
+
+// Observes the points picked for a speculative step all at once.
+// Each point gets an area around itself, which doesn't overlap other areas.
+// Propagation within different areas touches different points,
+// so it's done in parallel, then continued serially from area edges.
+// Returns 1 if that worked, or the status code to stop WFC with.
+// Returns 0 if the step needs to be undone, either because the points
+// were not compatible with each other or because a row could not be copied.
+int wfc__observeSpeculative(wfc_State *state, int obsCnt) {
+    void *ctx = state->ctx;
+    struct wfc__Speculation *spec = &state->spec;
+
+    const int pattCnt = state->model->pattCnt;
+    const struct wfc__Pattern *patts = state->model->patts;
+    const int len = WFC__A2D_LEN(state->ripple);
+
+    // Areas are squares half as wide as the distance between points.
+    for (int i = 0; i < len; ++i) spec->labels[i] = -1;
+    for (int k = 0; k < obsCnt; ++k) {
+        wfc__labelSquare(
+            state, spec->labels, spec->obs[k], (spec->minDist - 1) / 2, k);
+    }
+
+    // Rows are copied up front, so that they aren't copied
+    // from multiple threads during propagation within areas.
+    long long areaPnts = 0;
+    for (int i = 0; i < len; ++i) {
+        if (spec->labels[i] < 0) continue;
+
+        int c0, c1;
+        wfc__indToCoords2d(state->wave.d13, i, &c0, &c1);
+        if (!wfc__waveOwnRow(ctx, state->wave, c0)) return 0;
+
+        if (state->wavePattCnts.a[i] > 1) ++areaPnts;
+    }
+
+    // Once areas are mostly collapsed, propagation within them
+    // is not worth starting threads for.
+    int threads = state->threads;
+    if (areaPnts * pattCnt < wfc__parallelMinWork) threads = 1;
+
+    for (int k = 0; k < obsCnt; ++k) {
+        int c0, c1;
+        wfc__indToCoords2d(state->wave.d13, spec->obs[k], &c0, &c1);
+        if (!wfc__observePoint(
+                ctx, &state->rng, pattCnt, patts, state->wave, state->modified,
+                c0, c1)) {
+            return 0;
+        }
+        wfc__logObservation(state, c0, c1);
+    }
+
+    for (int i = 0; i < len; ++i) state->ripple.a[i] = -1;
+
+    struct wfc__SpeculativePropagation prop = {state, 0};
+    wfc__parallelFor(
+        ctx, threads, obsCnt, wfc__propagateSpeculativeItem, &prop);
+    if (prop.stopStatus == wfc_outOfMemory) return 0;
+    if (prop.stopStatus != 0) return prop.stopStatus;
+
+    // Propagation was held back from crossing between areas,
+    // so it continues from the modified points on their edges.
+    int head = -1, tail = -1, rippleLen = 0;
+    for (int i = 0; i < len; ++i) {
+        if (!state->modified.a[i]) continue;
+
+        int c0, c1;
+        wfc__indToCoords2d(state->wave.d13, i, &c0, &c1);
+
+        bool edge = false;
+        for (int dir = 0; dir < wfc__dirCnt; ++dir) {
+            int next = wfc__neighbourInd(
+                ctx, state->wave.d03, state->wave.d13,
+                c0, c1, (enum wfc__Dir)dir);
+            if (spec->labels[next] != spec->labels[i]) edge = true;
+        }
+        if (!edge) continue;
+
+        if (head < 0) head = i;
+        else state->ripple.a[tail] = i;
+        tail = i;
+        ++rippleLen;
+    }
+
+    if (head >= 0) {
+        int status = wfc__propagateFromRipple(
+            ctx, state->threads,
+            state->n, state->options, pattCnt, state->model->overlaps,
+            head, tail, rippleLen, state->ripple,
+            state->wave, state->modified,
+            NULL, &state->stop);
+        if (status == wfc_outOfMemory) return 0;
+        if (status != 0) return status;
+    }
+
+    for (int c0 = 0; c0 < state->wave.d03; ++c0) {
+        for (int c1 = 0; c1 < state->wave.d13; ++c1) {
+            if (WFC__A2D_GET(state->modified, c0, c1) &&
+                wfc__wavePopcount(state->wave, c0, c1) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Observes multiple points and propagates constraints from them
+// (see wfc__observeSpeculative()).
+// Returns 1 if the step was completed.
+// Returns 0 if a single point was observed at obsC0 and obsC1 instead
+// and constraints still need to be propagated from it.
+// Returns wfc_outOfMemory if not even that point could be observed,
+// in which case the wave and the generator are left as they were.
+int wfc__stepSpeculative(wfc_State *state, int *obsC0, int *obsC1) {
+    void *ctx = state->ctx;
+    struct wfc__Speculation *spec = &state->spec;
+
+    const int pattCnt = state->model->pattCnt;
+    const struct wfc__Pattern *patts = state->model->patts;
+    const int len = WFC__A2D_LEN(state->ripple);
+
+    // Points too close to those already picked are labelled -2.
+    for (int i = 0; i < len; ++i) spec->labels[i] = -1;
+    int obsCnt = 0;
+    while (obsCnt < spec->obsCnt) {
+        int obs = wfc__pickUnlabelled(state, spec->labels);
+        if (obs < 0) break;
+
+        spec->obs[obsCnt++] = obs;
+        wfc__labelSquare(state, spec->labels, obs, spec->minDist - 1, -2);
+    }
+
+    if (obsCnt > 1) {
+        for (int c0 = 0; c0 < state->wave.d03; ++c0) {
+            wfc__addShared_i(&state->wave.rows[c0]->refCnt, 1);
+            spec->backup[c0] = state->wave.rows[c0];
+        }
+
+        const int logLen = state->log.len;
+        const int result = wfc__observeSpeculative(state, obsCnt);
+
+        if (result != 0) {
+            for (int c0 = 0; c0 < state->wave.d03; ++c0) {
+                wfc__releaseWaveRow(ctx, spec->backup[c0]);
+            }
+
+            if (result == 1) {
+                wfc__updateCnts(
+                    ctx, state->wave, state->modified,
+                    state->wavePattCnts, &state->collapsedCnt);
+                state->status = wfc__calcStatus(pattCnt, state->wavePattCnts);
+            } else {
+                state->status = result;
+            }
+
+            return 1;
+        }
+
+        // The points may not have been compatible with each other,
+        // or there may not have been enough memory for all of them,
+        // so the step is undone and redone with a single point.
+        // Entropies are left as they were before the step.
+        for (int c0 = 0; c0 < state->wave.d03; ++c0) {
+            wfc__releaseWaveRow(ctx, state->wave.rows[c0]);
+            state->wave.rows[c0] = spec->backup[c0];
+        }
+        memset(state->modified.a, 0, WFC__A2D_SIZE(state->modified));
+        state->log.len = logLen;
+    }
+
+    if (obsCnt == 0) {
+        // Unreachable, as the state would have been completed.
+        WFC_ASSERT(ctx, false);
+    }
+
+    const struct wfc__Rng rng = state->rng;
+
+    wfc__indToCoords2d(state->wave.d13, spec->obs[0], obsC0, obsC1);
+    if (!wfc__observePoint(
+            ctx, &state->rng, pattCnt, patts, state->wave, state->modified,
+            *obsC0, *obsC1)) {
+        state->rng = rng;
+        return wfc_outOfMemory;
+    }
+
+    return 0;
+}
+
+// Buffers are only allocated while speculative observation is on.
+void wfc__freeSpeculation(wfc_State *state) {
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    if (state->spec.obsCnt <= 1) return;
+
+    WFC_FREE(ctx, state->spec.backup);
+    WFC_FREE(ctx, state->spec.labels);
+    WFC_FREE(ctx, state->spec.obs);
+}
+
+int wfc_setSpeculation(wfc_State *state, int obsCnt, int minDist) {
+    if (state == NULL || obsCnt <= 0 || minDist <= 0) return wfc_callerError;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    wfc__freeSpeculation(state);
+
+    state->spec.obsCnt = obsCnt;
+    state->spec.minDist = minDist;
+    state->spec.obs = NULL;
+    state->spec.labels = NULL;
+    state->spec.backup = NULL;
+
+    if (obsCnt > 1) {
+        state->spec.obs = (int*)WFC_MALLOC(
+            ctx, (size_t)obsCnt * sizeof(*state->spec.obs));
+        state->spec.labels = (int*)WFC_MALLOC(
+            ctx, WFC__A2D_SIZE(state->ripple));
+        state->spec.backup = (struct wfc__WaveRow**)WFC_MALLOC(
+            ctx, (size_t)state->wave.d03 * sizeof(*state->spec.backup));
+
+        if (state->spec.obs == NULL ||
+            state->spec.labels == NULL ||
+            state->spec.backup == NULL) {
+            if (state->spec.backup != NULL) WFC_FREE(ctx, state->spec.backup);
+            if (state->spec.labels != NULL) WFC_FREE(ctx, state->spec.labels);
+            if (state->spec.obs != NULL) WFC_FREE(ctx, state->spec.obs);
+
+            state->spec.obsCnt = 1;
+            state->spec.minDist = 1;
+            state->spec.obs = NULL;
+            state->spec.labels = NULL;
+            state->spec.backup = NULL;
+
+            return wfc_outOfMemory;
+        }
+    }
+
+    return 0;
+}
+
+int wfc_setWaveFile(wfc_State *state, int fd) {
+    if (state == NULL || fd < 0) return wfc_callerError;
+
+#ifdef WFC_USE_MMAP
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    struct wfc__RowArena *arena = wfc__makeRowArena(ctx, state->wave, fd);
+    if (arena == NULL) return wfc_outOfMemory;
+
+    struct wfc__RowArena *old = state->wave.arena;
+    state->wave.arena = arena;
+
+    // Rows shared with other states are moved once they get copied.
+    // Rows always fit in their slots of a new arena, but should one not,
+    // it keeps working from where it is.
+    for (int c0 = 0; c0 < state->wave.d03; ++c0) {
+        const struct wfc__WaveRow *row = state->wave.rows[c0];
+        if (!row->collapsed && wfc__loadShared_i(&row->refCnt) == 1) {
+            wfc__waveCopyRow(ctx, state->wave, c0);
+        }
+    }
+
+    if (old != NULL) wfc__releaseRowArena(ctx, old);
+
+    return 0;
+#else
+    return wfc_callerError;
+#endif
+}
+
+int wfc_setObservationLog(wfc_State *state, bool on) {
+    if (state == NULL) return wfc_callerError;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    if (!on && state->log.a != NULL) {
+        WFC_FREE(ctx, state->log.a);
+        state->log.a = NULL;
+        state->log.cap = 0;
+    }
+    state->log.on = on;
+    state->log.len = 0;
+
+    return 0;
+}
+
+int wfc_observationLog(const wfc_State *state, const int **log) {
+    if (state == NULL || log == NULL) return wfc_callerError;
+
+    *log = state->log.len > 0 ? state->log.a : NULL;
+
+    return state->log.len;
+}
+
+int wfc_step(wfc_State *state) {
+    if (state == NULL) return wfc_callerError;
+
+    if (state->status != 0) return state->status;
+
+    state->status = wfc__checkStop(state->ctx, &state->stop);
+    if (state->status != 0) return state->status;
+
+    if (!wfc__reserveObsLog(state, state->spec.obsCnt)) return wfc_outOfMemory;
+
+    if (state->unpropagated) {
+        // The previous step was observed, but not propagated through.
+        state->status = wfc__propagateFromModified(
+            state->ctx, state->threads,
+            state->n, state->options, state->model->pattCnt,
+            state->model->overlaps, state->ripple, state->wave, state->modified,
+            &state->stop);
+    } else {
+        wfc__calcEntropies(
+            state->ctx, state->threads,
+            state->model->pattCnt, state->model->patts,
+            state->wave, state->modified,
+            state->entropies);
+
+        memset(state->modified.a, 0, WFC__A2D_SIZE(state->modified));
+
+        int obsC0, obsC1;
+        if (state->spec.obsCnt > 1) {
+            int code = wfc__stepSpeculative(state, &obsC0, &obsC1);
+            if (code < 0) return code;
+            if (code > 0) return state->status;
+        } else {
+            const struct wfc__Rng rng = state->rng;
+            if (!wfc__observeOne(
+                    state->ctx, &state->rng,
+                    state->model->pattCnt, state->model->patts,
+                    state->entropies,
+                    state->wave, state->modified,
+                    &obsC0, &obsC1)) {
+                state->rng = rng;
+                return wfc_outOfMemory;
+            }
+        }
+        wfc__logObservation(state, obsC0, obsC1);
+
+        // If propagation was stopped midway, the wave is left in a state
+        // that does not satisfy all constraints, so WFC can't continue from it.
+        state->status = wfc__propagateFromSeed(
+            state->ctx, state->threads,
+            state->n, state->options, state->model->pattCnt,
+            obsC0, obsC1,
+            state->model->overlaps, state->ripple, state->wave, state->modified,
+            &state->stop);
+    }
+
+    // Running out of memory midway leaves constraints unpropagated
+    // only from modified points, so the step can be finished later.
+    state->unpropagated = state->status == wfc_outOfMemory;
+    if (state->unpropagated) {
+        state->status = 0;
+        return wfc_outOfMemory;
+    }
+    if (state->status != 0) return state->status;
+
+    wfc__updateCnts(
+        state->ctx, state->wave, state->modified,
+        state->wavePattCnts, &state->collapsedCnt);
+    state->status = wfc__calcStatus(state->model->pattCnt, state->wavePattCnts);
+
+    return state->status;
+}
+
+int wfc_replay(wfc_State *state, const int *log, int steps) {
+    if (state == NULL || steps < 0 || (steps > 0 && log == NULL)) {
+        return wfc_callerError;
+    }
+
+    if (state->status != 0) return state->status;
+
+    // Finishes the step that ran out of memory before applying more.
+    if (state->unpropagated) {
+        const int status = wfc_step(state);
+        if (status != 0) return status;
+    }
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    const int pattCnt = state->model->pattCnt;
+    const int len = WFC__A2D_LEN(state->modified);
+
+    // wfc_step() only calculates entropies of points modified since the
+    // previous step. Points modified along the way get their entropies
+    // marked as negative, so that they are all calculated once at the end.
+    for (int i = 0; i < len; ++i) {
+        if (state->modified.a[i]) state->entropies.a[i] = -1.0f;
+    }
+
+    int ret = 0;
+    for (int s = 0; s < steps && state->status == 0; ++s) {
+        const int pnt = log[s * 2], patt = log[s * 2 + 1];
+        if (pnt < 0 || pnt >= len || patt < 0 || patt >= pattCnt) {
+            ret = wfc_callerError;
+            break;
+        }
+
+        int c0, c1;
+        wfc__indToCoords2d(state->wave.d13, pnt, &c0, &c1);
+        if (!wfc__waveGetBit(state->wave, c0, c1, patt)) {
+            ret = wfc_callerError;
+            break;
+        }
+
+        if (!wfc__reserveObsLog(state, 1)) {
+            ret = wfc_outOfMemory;
+            break;
+        }
+
+        state->status = wfc__checkStop(ctx, &state->stop);
+        if (state->status != 0) break;
+
+        if (!wfc__waveSetSingle(ctx, state->wave, c0, c1, patt)) {
+            ret = wfc_outOfMemory;
+            break;
+        }
+        memset(state->modified.a, 0, WFC__A2D_SIZE(state->modified));
+        WFC__A2D_GET(state->modified, c0, c1) = 1;
+        wfc__logObservation(state, c0, c1);
+
+        state->status = wfc__propagateFromSeed(
+            ctx, state->threads,
+            state->n, state->options, pattCnt,
+            c0, c1,
+            state->model->overlaps, state->ripple, state->wave, state->modified,
+            &state->stop);
+        // Same as in wfc_step(), except that the next step propagates from
+        // all points modified during replay, which is still correct.
+        state->unpropagated = state->status == wfc_outOfMemory;
+        if (state->unpropagated) {
+            state->status = 0;
+            ret = wfc_outOfMemory;
+        } else if (state->status == 0) {
+            wfc__updateCnts(
+                ctx, state->wave, state->modified,
+                state->wavePattCnts, &state->collapsedCnt);
+            state->status = wfc__calcStatus(pattCnt, state->wavePattCnts);
+        }
+
+        for (int i = 0; i < len; ++i) {
+            if (state->modified.a[i]) state->entropies.a[i] = -1.0f;
+        }
+        if (ret != 0) break;
+    }
+
+    for (int i = 0; i < len; ++i) {
+        state->modified.a[i] = (uint8_t)(state->entropies.a[i] < 0.0f);
+    }
+
+    return ret != 0 ? ret : state->status;
+}
+
+// independent regions
+
+enum {
+    // wfc_runRegions() checks whether uncollapsed points have split
+    // into independent regions once per this many steps.
+    wfc__regionCheckPeriod = 16
+};
+
+// Returns the root of the set containing ind in a union-find forest.
+int wfc__findRoot(int *parents, int ind) {
+    while (parents[ind] != ind) {
+        // Path halving keeps the trees shallow.
+        parents[ind] = parents[parents[ind]];
+        ind = parents[ind];
+    }
+
+    return ind;
+}
+
+// Joins the sets containing a and b.
+// The smallest index in a set is always its root.
+void wfc__unite(int *parents, int a, int b) {
+    a = wfc__findRoot(parents, a);
+    b = wfc__findRoot(parents, b);
+
+    if (a < b) parents[b] = a;
+    else if (b < a) parents[a] = b;
+}
+
+struct wfc__Regions {
+    wfc_State *state;
+    // Number of regions.
+    int cnt;
+    // Region of each wave point, or -1 for collapsed points.
+    int *labels;
+    // Wave points grouped by region, in increasing order within a region.
+    int *pnts;
+    // Where the points of each region start in pnts,
+    // followed by the total number of points.
+    int *starts;
+    // Status code each region finished with.
+    int *statuses;
+    // Generators of individual regions are seeded from this.
+    uint64_t seed;
+    // Set once a region fails, so that the others can give up early.
+    volatile int failed;
+};
+
+// Splits uncollapsed wave points into regions
+// of points connected through their cardinal neighbours.
+// Returns the number of regions.
+int wfc__findRegions(struct wfc__Regions *regions) {
+    const wfc_State *state = regions->state;
+    const int d0 = state->wave.d03, d1 = state->wave.d13;
+    const int *pattCnts = state->wavePattCnts.a;
+
+    // The forest is only needed until labels are known,
+    // so it's kept in the memory that will later hold the points.
+    int *parents = regions->pnts;
+    for (int i = 0; i < d0 * d1; ++i) parents[i] = i;
+
+    for (int c0 = 0; c0 < d0; ++c0) {
+        for (int c1 = 0; c1 < d1; ++c1) {
+            int ind = wfc__coords2dToInd(d1, c0, c1);
+            if (pattCnts[ind] <= 1) continue;
+
+            // Points above and to the left join with this one on their own.
+            // Propagation does not cross edges the wave doesn't wrap around,
+            // so neither do regions.
+            if (c0 + 1 < d0 || !(state->options & wfc__optNoWrapC0)) {
+                int next = wfc__neighbourInd(
+                    state->ctx, d0, d1, c0, c1, wfc__dirC0More);
+                if (pattCnts[next] > 1) wfc__unite(parents, ind, next);
+            }
+            if (c1 + 1 < d1 || !(state->options & wfc__optNoWrapC1)) {
+                int next = wfc__neighbourInd(
+                    state->ctx, d0, d1, c0, c1, wfc__dirC1More);
+                if (pattCnts[next] > 1) wfc__unite(parents, ind, next);
+            }
+        }
+    }
+
+    // Roots come before the other points of their regions,
+    // so regions get numbered in the order of their first points.
+    regions->cnt = 0;
+    for (int i = 0; i < d0 * d1; ++i) {
+        if (pattCnts[i] <= 1) {
+            regions->labels[i] = -1;
+        } else {
+            int root = wfc__findRoot(parents, i);
+            regions->labels[i] =
+                root == i ? regions->cnt++ : regions->labels[root];
+        }
+    }
+
+    // Counting sort of points by their regions.
+    for (int r = 0; r <= regions->cnt; ++r) regions->starts[r] = 0;
+    for (int i = 0; i < d0 * d1; ++i) {
+        if (regions->labels[i] >= 0) ++regions->starts[regions->labels[i] + 1];
+    }
+    for (int r = 0; r < regions->cnt; ++r) {
+        regions->starts[r + 1] += regions->starts[r];
+    }
+    for (int i = 0; i < d0 * d1; ++i) {
+        if (regions->labels[i] >= 0) {
+            regions->pnts[regions->starts[regions->labels[i]]++] = i;
+        }
+    }
+    // Each start got moved to where the next region starts.
+    for (int r = regions->cnt; r > 0; --r) {
+        regions->starts[r] = regions->starts[r - 1];
+    }
+    regions->starts[0] = 0;
+
+    return regions->cnt;
+}
+
+// Runs WFC on a single region until all of its points are collapsed.
+// A collapsed point only loses its pattern if a neighbour has none left,
+// so propagation never needs to cross into collapsed points
+// and regions can't constrain each other.
+// Each region only touches the wave and scratch memory of its own points,
+// so different regions can be solved at the same time.
+// Returns the status code the region finished with,
+// or wfc_outOfMemory if it could not be finished.
+int wfc__solveRegion(struct wfc__Regions *regions, int region) {
+    wfc_State *state = regions->state;
+    void *ctx = state->ctx;
+
+    const int pattCnt = state->model->pattCnt;
+    const struct wfc__Pattern *patts = state->model->patts;
+    const int *pnts = regions->pnts + regions->starts[region];
+    const int pntCnt = regions->starts[region + 1] - regions->starts[region];
+
+    // Seeding from the first point makes the outcome independent of
+    // which thread the region is solved on and when.
+    uint64_t seed = regions->seed ^ (uint64_t)pnts[0];
+    struct wfc__Rng rng;
+    wfc__rngSeed(&rng, wfc__splitMix64(&seed));
+
+    for (int i = 0; i < pntCnt; ++i) state->modified.a[pnts[i]] = 1;
+
+    int uncollapsedCnt = pntCnt;
+    while (uncollapsedCnt > 0) {
+        if (wfc__loadShared_i(&regions->failed)) return wfc_failed;
+
+        int stopStatus = wfc__checkStop(ctx, &state->stop);
+        if (stopStatus != 0) return stopStatus;
+
+        // Same as wfc__calcEntropies() and wfc__observeOne(),
+        // but only over the points of this region.
+        float smallest = FLT_MAX;
+        for (int i = 0; i < pntCnt; ++i) {
+            int pnt = pnts[i];
+
+            if (state->modified.a[pnt]) {
+                int c0, c1;
+                wfc__indToCoords2d(state->wave.d13, pnt, &c0, &c1);
+
+                state->entropies.a[pnt] =
+                    wfc__entropyAt(pattCnt, patts, state->wave, c0, c1);
+                state->modified.a[pnt] = 0;
+            }
+
+            smallest = wfc__min_f(smallest, state->entropies.a[pnt]);
+        }
+
+        int smallestCnt = 0;
+        for (int i = 0; i < pntCnt; ++i) {
+            if (wfc__approxEqNonNeg_f(state->entropies.a[pnts[i]], smallest)) {
+                ++smallestCnt;
+            }
+        }
+
+        int obs = pnts[0];
+        int chosenSmallestPnt = wfc__rand_i(ctx, &rng, smallestCnt);
+        for (int i = 0; i < pntCnt; ++i) {
+            if (wfc__approxEqNonNeg_f(state->entropies.a[pnts[i]], smallest)) {
+                obs = pnts[i];
+                if (chosenSmallestPnt == 0) break;
+                --chosenSmallestPnt;
+            }
+        }
+
+        int obsC0, obsC1;
+        wfc__indToCoords2d(state->wave.d13, obs, &obsC0, &obsC1);
+
+        if (!wfc__observePoint(
+                ctx, &rng, pattCnt, patts, state->wave, state->modified,
+                obsC0, obsC1)) {
+            return wfc_outOfMemory;
+        }
+
+        // Finished propagations leave ripple empty,
+        // so the observed point can be made its only element directly.
+        stopStatus = wfc__propagateFromRipple(
+            ctx, 1, state->n, state->options, pattCnt, state->model->overlaps,
+            obs, obs, 1, state->ripple, state->wave, state->modified,
+            regions->labels, &state->stop);
+        if (stopStatus != 0) return stopStatus;
+
+        for (int i = 0; i < pntCnt; ++i) {
+            int pnt = pnts[i];
+            if (!state->modified.a[pnt]) continue;
+
+            int c0, c1;
+            wfc__indToCoords2d(state->wave.d13, pnt, &c0, &c1);
+
+            int oldCnt = state->wavePattCnts.a[pnt];
+            int newCnt = wfc__wavePopcount(state->wave, c0, c1);
+            state->wavePattCnts.a[pnt] = newCnt;
+
+            if (newCnt == 0) return wfc_failed;
+            if (newCnt == 1 && oldCnt > 1) --uncollapsedCnt;
+        }
+    }
+
+    return wfc_completed;
+}
+
+void wfc__solveRegionItem(void *data, int ind) {
+    struct wfc__Regions *regions = (struct wfc__Regions*)data;
+
+    regions->statuses[ind] = wfc__solveRegion(regions, ind);
+    if (regions->statuses[ind] == wfc_failed) {
+        wfc__storeShared_i(&regions->failed, 1);
+    }
+}
+
+// Solves all regions found by wfc__findRegions() and updates the state.
+// Returns wfc_outOfMemory if some regions could not be finished,
+// in which case stepping the state finishes them.
+int wfc__solveRegions(struct wfc__Regions *regions, int threads) {
+    wfc_State *state = regions->state;
+    void *ctx = state->ctx;
+
+    // Regions may share rows, which mustn't be copied from multiple threads.
+    // Nothing else needs to be allocated after this.
+    if (!wfc__waveOwnAll(ctx, threads, state->wave)) return wfc_outOfMemory;
+
+    regions->seed = wfc__rngNext64(ctx, &state->rng);
+    regions->failed = 0;
+
+    for (int i = 0; i < WFC__A2D_LEN(state->ripple); ++i) {
+        state->ripple.a[i] = -1;
+    }
+
+    wfc__parallelFor(
+        ctx, threads, regions->cnt, wfc__solveRegionItem, regions);
+
+    // A contradiction anywhere fails the whole state,
+    // even if other regions were stopped early.
+    state->status = wfc_completed;
+    bool outOfMemory = false;
+    for (int r = 0; r < regions->cnt; ++r) {
+        if (regions->statuses[r] == wfc_failed) {
+            state->status = wfc_failed;
+            break;
+        }
+        if (regions->statuses[r] == wfc_outOfMemory) {
+            outOfMemory = true;
+        } else if (regions->statuses[r] != wfc_completed &&
+            state->status == wfc_completed) {
+            state->status = regions->statuses[r];
+        }
+    }
+
+    // A region may have run out of memory while propagating,
+    // so the next step propagates from all points, same as after loading.
+    if (outOfMemory && state->status == wfc_completed) {
+        state->status = 0;
+        state->unpropagated = true;
+        memset(state->modified.a, 1, WFC__A2D_SIZE(state->modified));
+    }
+
+    state->collapsedCnt = 0;
+    for (int i = 0; i < WFC__A2D_LEN(state->wavePattCnts); ++i) {
+        if (state->wavePattCnts.a[i] == 1) ++state->collapsedCnt;
+    }
+
+    for (int c0 = 0; c0 < state->wave.d03; ++c0) {
+        wfc__collapseRowIfDone(ctx, state->wave, state->wavePattCnts, c0);
+    }
+
+    return state->status == 0 ? wfc_outOfMemory : 0;
+}
+
+int wfc_runRegions(wfc_State *state, int threads) {
+    if (state == NULL || threads <= 0) return wfc_callerError;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    const int len = WFC__A2D_LEN(state->wavePattCnts);
+
+    struct wfc__Regions regions;
+    regions.state = state;
+    regions.labels = (int*)WFC_MALLOC(
+        ctx, (size_t)len * sizeof(*regions.labels));
+    regions.pnts = (int*)WFC_MALLOC(
+        ctx, (size_t)len * sizeof(*regions.pnts));
+    regions.starts = (int*)WFC_MALLOC(
+        ctx, (size_t)(len + 1) * sizeof(*regions.starts));
+    regions.statuses = (int*)WFC_MALLOC(
+        ctx, (size_t)len * sizeof(*regions.statuses));
+
+    int code = wfc_outOfMemory;
+    if (regions.labels != NULL && regions.pnts != NULL &&
+        regions.starts != NULL && regions.statuses != NULL) {
+        code = state->status;
+    }
+
+    // Regions are only looked for once the wave is fully propagated.
+    for (int steps = 0; code == 0; ++steps) {
+        if (steps % wfc__regionCheckPeriod == 0 && !state->unpropagated &&
+            wfc__findRegions(&regions) > 1) {
+            code = wfc__solveRegions(&regions, threads);
+            if (code == 0) code = state->status;
+            break;
+        }
+
+        code = wfc_step(state);
+    }
+
+    if (regions.statuses != NULL) WFC_FREE(ctx, regions.statuses);
+    if (regions.starts != NULL) WFC_FREE(ctx, regions.starts);
+    if (regions.pnts != NULL) WFC_FREE(ctx, regions.pnts);
+    if (regions.labels != NULL) WFC_FREE(ctx, regions.labels);
+
+    return code;
+}
+
+struct wfc__Blit {
+    const wfc_State *state;
+    struct wfc__A3d_cu8 src;
+    struct wfc__A3d_u8 dst;
+};
+
+// Rows don't share memory, so they can be blitted in parallel.
+void wfc__blitRow(void *data, int c0) {
+    const struct wfc__Blit *blit = (const struct wfc__Blit*)data;
+    const wfc_State *state = blit->state;
+
+    for (int c1 = 0; c1 < state->dstD1; ++c1) {
+        int wC0, wC1, pC0, pC1;
+        wfc__coordsDstToWave(c0, c1, state->wave, &wC0, &wC1, &pC0, &pC1);
+
+        // Points of completed states have a single pattern.
+        int patt = wfc__pntSingle(
+            wfc__wavePnt(state->wave, wC0, wC1), state->wave.d23);
+
+        int sC0, sC1;
+        wfc__coordsPattToSrc(
+            state->n, state->model->patts[patt], pC0, pC1,
+            blit->src.d03, blit->src.d13,
+            &sC0, &sC1);
+
+        const uint8_t *srcPx = &WFC__A3D_GET(blit->src, sC0, sC1, 0);
+        uint8_t *dstPx = &WFC__A3D_GET(blit->dst, c0, c1, 0);
+
+        memcpy(dstPx, srcPx, (size_t)state->bytesPerPixel);
+    }
+}
+
+int wfc_blit(
+    const wfc_State *state,
+    const unsigned char *src, unsigned char *dst) {
+    if (state == NULL || state->status != wfc_completed ||
+        src == NULL || dst == NULL) {
+        return wfc_callerError;
+    }
+
+    struct wfc__Blit blit = {
+        state,
+        {state->srcD0, state->srcD1, state->bytesPerPixel, src},
+        {state->dstD0, state->dstD1, state->bytesPerPixel, dst}
+    };
+
+    int threads = state->threads;
+    if ((long long)state->dstD0 * state->dstD1 < wfc__parallelMinWork) {
+        threads = 1;
+    }
+
+    wfc__parallelFor(state->ctx, threads, state->dstD0, wfc__blitRow, &blit);
+
+    return 0;
+}
+
+wfc_State* wfc_clone(const wfc_State *state) {
+    if (state == NULL) return NULL;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    const struct wfc__StateLayout layout =
+        wfc__stateLayout(state->wave.d03, state->wave.d13);
+
+    void *alloc = WFC_MALLOC(ctx, layout.size);
+    if (alloc == NULL) return NULL;
+
+    wfc_State *clone = wfc__stateInBlock(alloc);
+
+    // Buffers for speculative observation don't carry over between steps.
+    int *specObs = NULL;
+    int *specLabels = NULL;
+    struct wfc__WaveRow **specBackup = NULL;
+    if (state->spec.obsCnt > 1) {
+        specObs = (int*)WFC_MALLOC(
+            ctx, (size_t)state->spec.obsCnt * sizeof(*specObs));
+        specLabels = (int*)WFC_MALLOC(ctx, WFC__A2D_SIZE(state->ripple));
+        specBackup = (struct wfc__WaveRow**)WFC_MALLOC(
+            ctx, (size_t)state->wave.d03 * sizeof(*specBackup));
+
+        if (specObs == NULL || specLabels == NULL || specBackup == NULL) {
+            if (specBackup != NULL) WFC_FREE(ctx, specBackup);
+            if (specLabels != NULL) WFC_FREE(ctx, specLabels);
+            if (specObs != NULL) WFC_FREE(ctx, specObs);
+            WFC_FREE(ctx, alloc);
+            return NULL;
+        }
+    }
+
+    // Ripple is only used during propagation and is empty in between,
+    // so it could be left out, but copying everything at once is simpler.
+    memcpy(clone, state, layout.used);
+    clone->mem = alloc;
+    wfc__placeStateArrays(clone);
+
+    clone->spec.obs = specObs;
+    clone->spec.labels = specLabels;
+    clone->spec.backup = specBackup;
+
+    clone->log.on = false;
+    clone->log.len = 0;
+    clone->log.cap = 0;
+    clone->log.a = NULL;
+
+    // The model is never modified, so it's shared instead of copied.
+    wfc__addShared_i(&state->model->refCnt, 1);
+
+    // Rows are only copied once either state modifies them.
+    // The clone places its copies in an arena of its own,
+    // which is never mapped from a file (see wfc_setWaveFile()).
+    wfc__shareWaveRows(clone->wave);
+    clone->wave.arena = NULL;
+    if (wfc__hugePagesOn(state->options)) {
+        clone->wave.arena = wfc__makeRowArena(ctx, clone->wave, -1);
+    }
+
+    return clone;
+}
+
+int wfc_generateVariations(
+    wfc_State *state, const unsigned char *src, double prefix,
+    int threads, int cnt, const unsigned *seeds,
+    unsigned char * const *dsts, int *statuses) {
+    if (state == NULL || src == NULL || !(prefix >= 0.0 && prefix <= 1.0) ||
+        threads <= 0 || cnt <= 0 || seeds == NULL || dsts == NULL) {
+        return wfc_callerError;
+    }
+    for (int i = 0; i < cnt; ++i) {
+        if (dsts[i] == NULL) return wfc_callerError;
+    }
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    const int target =
+        (int)(prefix * (double)WFC__A2D_LEN(state->wavePattCnts));
+    int code = 0;
+    while (state->collapsedCnt < target && (code = wfc_step(state)) == 0);
+    if (state->status < 0) code = state->status;
+
+    // All outputs would fail in the same way. This includes steps that ran
+    // out of memory, which leave the status as it was.
+    if (code < 0) {
+        if (statuses != NULL) {
+            for (int i = 0; i < cnt; ++i) statuses[i] = code;
+        }
+        return code;
+    }
+
+    int ret = 0;
+
+    // Each item needs a place to write its status,
+    // even if the caller is not interested in it.
+    int *statusesA = statuses;
+    if (statusesA == NULL) {
+        statusesA = (int*)WFC_MALLOC(ctx, (size_t)cnt * sizeof(*statusesA));
+        if (statusesA == NULL) return wfc_outOfMemory;
+    }
+
+    // Outputs are generated the same way as in a batch,
+    // only from the state instead of a freshly initialized one.
+    struct wfc__Batch batch;
+    batch.proto = state;
+    batch.src = src;
+    batch.seeds = seeds;
+    batch.dsts = dsts;
+    batch.statuses = statusesA;
+
+    wfc__parallelFor(ctx, threads, cnt, wfc__generateBatchItem, &batch);
+
+    for (int i = 0; i < cnt; ++i) {
+        if (statusesA[i] != wfc_completed) ret = wfc_failed;
+    }
+
+    if (statuses == NULL) WFC_FREE(ctx, statusesA);
+
+    return ret;
+}
+
+// Saved states start with this header, followed by the wave.
+// Its points are stored in row-major order, split into runs.
+// Each run starts with an int: a positive number of collapsed points,
+// each stored as the int index of its pattern (-1 for none),
+// or a negative number of other points, each stored as a bit pack.
+// Values are stored as they are in memory.
+struct wfc__StateFile {
+    char magic[8];
+    // Changes whenever the format changes.
+    int version;
+    int unsignedSz;
+
+    int n, options, bytesPerPixel, srcD0, srcD1, dstD0, dstD1;
+    int pattCnt;
+    // Hash of the patterns, to catch states saved from other sources.
+    uint64_t patts;
+
+    int status, collapsedCnt;
+    // 1 if the last step ran out of memory before propagating, else 0.
+    int unpropagated;
+    // Stored as 1 or 0, since bools may have other representations.
+    int rngSeeded;
+    uint64_t rngState;
+};
+
+enum { wfc__stateFileVersion = 3 };
+
+uint64_t wfc__pattsHash(int pattCnt, const struct wfc__Pattern *patts) {
+    uint64_t h = (uint64_t)pattCnt;
+    for (int p = 0; p < pattCnt; ++p) {
+        const int fields[] = {
+            patts[p].c0, patts[p].c1, patts[p].tf, patts[p].freq,
+            patts[p].edgeC0Lo, patts[p].edgeC0Hi,
+            patts[p].edgeC1Lo, patts[p].edgeC1Hi,
+        };
+        for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); ++i) {
+            h ^= (uint64_t)(uint32_t)fields[i];
+            h = wfc__splitMix64(&h);
+        }
+    }
+
+    return h;
+}
+
+// The header of the state, without the parts that change as WFC runs.
+struct wfc__StateFile wfc__stateFileHeader(const wfc_State *state) {
+    struct wfc__StateFile header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, "wfcstate", sizeof(header.magic));
+    header.version = wfc__stateFileVersion;
+    header.unsignedSz = (int)sizeof(unsigned);
+
+    header.n = state->n;
+    header.options = state->options;
+    header.bytesPerPixel = state->bytesPerPixel;
+    header.srcD0 = state->srcD0;
+    header.srcD1 = state->srcD1;
+    header.dstD0 = state->dstD0;
+    header.dstD1 = state->dstD1;
+    header.pattCnt = state->model->pattCnt;
+    header.patts = wfc__pattsHash(state->model->pattCnt, state->model->patts);
+
+    return header;
+}
+
+// Only counts bytes if buf is null.
+struct wfc__Writer {
+    unsigned char *buf;
+    size_t len;
+};
+
+void wfc__write(struct wfc__Writer *w, const void *data, size_t sz) {
+    if (w->buf != NULL) memcpy(w->buf + w->len, data, sz);
+    w->len = wfc__addSz(w->len, sz);
+}
+
+// Once a read goes past the end, ok is cleared and all further reads fail.
+struct wfc__Reader {
+    const unsigned char *buf;
+    size_t len, pos;
+    bool ok;
+};
+
+bool wfc__read(struct wfc__Reader *r, void *data, size_t sz) {
+    if (!r->ok || sz > r->len - r->pos) {
+        r->ok = false;
+        return false;
+    }
+
+    memcpy(data, r->buf + r->pos, sz);
+    r->pos += sz;
+
+    return true;
+}
+
+void wfc__writeState(const wfc_State *state, struct wfc__Writer *w) {
+    const struct wfc__Wave wave = state->wave;
+    const int uSzBits = (int)sizeof(unsigned) * 8;
+
+    struct wfc__StateFile header = wfc__stateFileHeader(state);
+    header.status = state->status;
+    header.collapsedCnt = state->collapsedCnt;
+    header.unpropagated = state->unpropagated ? 1 : 0;
+    // Points collapsed by an unfinished step are not counted yet,
+    // and the loaded state can't tell them apart from the others.
+    if (state->unpropagated) {
+        for (int i = 0; i < WFC__A2D_LEN(state->modified); ++i) {
+            int c0, c1;
+            wfc__indToCoords2d(wave.d13, i, &c0, &c1);
+            if (state->modified.a[i] && state->wavePattCnts.a[i] != 1 &&
+                wfc__wavePopcount(wave, c0, c1) == 1) {
+                ++header.collapsedCnt;
+            }
+        }
+    }
+    header.rngSeeded = state->rng.seeded ? 1 : 0;
+    header.rngState = state->rng.state;
+    wfc__write(w, &header, sizeof(header));
+
+    const int pntCnt = WFC__A2D_LEN(state->wavePattCnts);
+    for (int i = 0; i < pntCnt;) {
+        const bool collapsed = state->wavePattCnts.a[i] <= 1;
+
+        int j = i + 1;
+        while (j < pntCnt && (state->wavePattCnts.a[j] <= 1) == collapsed) {
+            ++j;
+        }
+
+        const int run = collapsed ? j - i : i - j;
+        wfc__write(w, &run, sizeof(run));
+
+        for (; i < j; ++i) {
+            int c0, c1;
+            wfc__indToCoords2d(wave.d13, i, &c0, &c1);
+            const struct wfc__Pnt pnt = wfc__wavePnt(wave, c0, c1);
+
+            if (collapsed) {
+                const int p = wfc__pntSingle(pnt, wave.d23);
+                wfc__write(w, &p, sizeof(p));
+            } else if (pnt.pack != NULL) {
+                wfc__write(w, pnt.pack, (size_t)wave.d23 * sizeof(unsigned));
+            } else {
+                // Lists are short, so going through them for each element
+                // of the pack is cheap enough.
+                for (int e = 0; e < wave.d23; ++e) {
+                    unsigned u = 0;
+                    for (int k = 0; k < pnt.len; ++k) {
+                        if (pnt.list[k] >= 0 && pnt.list[k] / uSzBits == e) {
+                            u |= 1u << (unsigned)(pnt.list[k] % uSzBits);
+                        }
+                    }
+                    wfc__write(w, &u, sizeof(u));
+                }
+            }
+        }
+    }
+}
+
+// Reads the wave into the given rows, or only checks it if rows is null.
+// Rows are placed as if they were rows of the state's wave.
+// Returns false if the saved state does not fit the state,
+// or if there is not enough memory, in which case rows are left null.
+bool wfc__readState(
+    const wfc_State *state, struct wfc__Reader *r,
+    struct wfc__StateFile *header, struct wfc__WaveRow **rows) {
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    const int uSzBits = (int)sizeof(unsigned) * 8;
+    const int pattCnt = state->model->pattCnt;
+
+    struct wfc__Wave wave = state->wave;
+    if (rows != NULL) wave.rows = rows;
+
+    if (!wfc__read(r, header, sizeof(*header))) return false;
+
+    struct wfc__StateFile expected = wfc__stateFileHeader(state);
+    expected.status = header->status;
+    expected.collapsedCnt = header->collapsedCnt;
+    // Flags other than 0 and 1 are left to not match.
+    if (header->unpropagated == 0 || header->unpropagated == 1) {
+        expected.unpropagated = header->unpropagated;
+    }
+    if (header->rngSeeded == 0 || header->rngSeeded == 1) {
+        expected.rngSeeded = header->rngSeeded;
+    }
+    expected.rngState = header->rngState;
+    if (memcmp(header, &expected, sizeof(expected)) != 0) return false;
+
+    // Bits past the last pattern must not be set.
+    const unsigned lastMask = pattCnt % uSzBits == 0 ?
+        ~0u : (1u << (unsigned)(pattCnt % uSzBits)) - 1u;
+
+    const int pntCnt = WFC__A2D_LEN(state->wavePattCnts);
+    int run = 0;
+    bool collapsed = false;
+    for (int i = 0; i < pntCnt; ++i) {
+        if (run == 0) {
+            if (!wfc__read(r, &run, sizeof(run)) ||
+                run == 0 || run < -(pntCnt - i) || run > pntCnt - i) {
+                return false;
+            }
+            collapsed = run > 0;
+            if (run < 0) run = -run;
+        }
+        --run;
+
+        int c0, c1;
+        wfc__indToCoords2d(wave.d13, i, &c0, &c1);
+
+        if (rows != NULL && c1 == 0) {
+            rows[c0] = wfc__allocWaveRow(ctx, wave, c0);
+            if (rows[c0] == NULL) return false;
+            rows[c0]->refCnt = 1;
+            rows[c0]->collapsed = false;
+        }
+
+        if (collapsed) {
+            int p;
+            if (!wfc__read(r, &p, sizeof(p)) || p < -1 || p >= pattCnt) {
+                return false;
+            }
+
+            if (rows != NULL) {
+                unsigned *slot = wfc__waveSlot(wave, c0, c1);
+                memset(slot, 0, (size_t)wave.d23 * sizeof(*slot));
+                if (p >= 0) {
+                    slot[p / uSzBits] |= 1u << (unsigned)(p % uSzBits);
+                }
+                *wfc__waveLen(wave, c0, c1) = -1;
+                wfc__waveListPnt(wave, c0, c1);
+            }
+        } else {
+            unsigned *slot =
+                rows != NULL ? wfc__waveSlot(wave, c0, c1) : NULL;
+
+            for (int e = 0; e < wave.d23; ++e) {
+                unsigned u;
+                if (!wfc__read(r, &u, sizeof(u)) ||
+                    (e == wave.d23 - 1 && (u & ~lastMask) != 0)) {
+                    return false;
+                }
+
+                if (slot != NULL) slot[e] = u;
+            }
+
+            if (rows != NULL) {
+                *wfc__waveLen(wave, c0, c1) = -1;
+                wfc__waveListPnt(wave, c0, c1);
+            }
+        }
+    }
+
+    return r->pos == r->len;
+}
+
+size_t wfc_saveState(const wfc_State *state, void *buf, size_t bufSz) {
+    if (state == NULL) return 0;
+
+    struct wfc__Writer w = {NULL, 0};
+    wfc__writeState(state, &w);
+
+    if (buf != NULL && bufSz >= w.len) {
+        w.buf = (unsigned char*)buf;
+        w.len = 0;
+        wfc__writeState(state, &w);
+    }
+
+    return w.len;
+}
+
+int wfc_loadState(wfc_State *state, const void *buf, size_t bufSz) {
+    if (state == NULL || buf == NULL) return wfc_callerError;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    struct wfc__StateFile header;
+
+    // Everything is checked before anything is allocated.
+    struct wfc__Reader r = {(const unsigned char*)buf, bufSz, 0, true};
+    if (!wfc__readState(state, &r, &header, NULL)) return wfc_callerError;
+
+    const int d0 = state->wave.d03;
+
+    struct wfc__WaveRow **rows = (struct wfc__WaveRow**)WFC_MALLOC(
+        ctx, (size_t)d0 * sizeof(*rows));
+    if (rows == NULL) return wfc_outOfMemory;
+    for (int c0 = 0; c0 < d0; ++c0) rows[c0] = NULL;
+
+    r.pos = 0;
+    if (!wfc__readState(state, &r, &header, rows)) {
+        for (int c0 = 0; c0 < d0 && rows[c0] != NULL; ++c0) {
+            wfc__releaseWaveRow(ctx, rows[c0]);
+        }
+        WFC_FREE(ctx, rows);
+        return wfc_outOfMemory;
+    }
+
+    for (int c0 = 0; c0 < d0; ++c0) {
+        wfc__releaseWaveRow(ctx, state->wave.rows[c0]);
+        state->wave.rows[c0] = rows[c0];
+    }
+    WFC_FREE(ctx, rows);
+
+    // All points are counted, and get their entropies calculated
+    // on the next step, as if they had all just been modified.
+    memset(state->modified.a, 1, WFC__A2D_SIZE(state->modified));
+    int collapsedCnt = 0;
+    wfc__updateCnts(
+        ctx, state->wave, state->modified,
+        state->wavePattCnts, &collapsedCnt);
+
+    // Points that collapsed and then lost their pattern are still counted.
+    state->collapsedCnt = header.collapsedCnt;
+    state->status = header.status;
+    state->unpropagated = header.unpropagated == 1;
+    state->rng.seeded = header.rngSeeded == 1;
+    state->rng.state = header.rngState;
+
+    return 0;
+}
+
+void wfc_free(wfc_State *state) {
+    if (state == NULL) return;
+
+    void *ctx = state->ctx;
+    (void)ctx;
+
+    wfc__freeSpeculation(state);
+    if (state->log.a != NULL) WFC_FREE(ctx, state->log.a);
+    wfc__releaseWaveRows(ctx, state->wave);
+    if (state->wave.arena != NULL) {
+        wfc__releaseRowArena(ctx, state->wave.arena);
+    }
+    wfc__releaseModel(ctx, state->model);
+    if (state->mem != NULL) WFC_FREE(ctx, state->mem);
+}
+
+int wfc_collapsedCount(const wfc_State *state) {
+    if (state == NULL) return wfc_callerError;
+
+    return state->collapsedCnt;
+}
+
+int wfc_patternCount(const wfc_State *state) {
+    if (state == NULL) return wfc_callerError;
+
+    return state->model->pattCnt;
+}
+
+size_t wfc_memoryUsage(const wfc_State *state) {
+    if (state == NULL) return 0;
+
+    const struct wfc__StateLayout layout =
+        wfc__stateLayout(state->wave.d03, state->wave.d13);
+    size_t sz = state->mem != NULL ? layout.size : layout.used;
+
+    const struct wfc__Model *model = state->model;
+    sz += (wfc__modelSize(model->pattCnt) + WFC__A3D_SIZE(model->overlaps)) /
+        (size_t)wfc__loadShared_i(&model->refCnt);
+
+    // Each row's share is taken once for each reference to it,
+    // which adds up to the whole row when only this state references it.
+    for (int i = 0; i < state->wave.d03; ++i) {
+        const struct wfc__WaveRow *row = state->wave.rows[i];
+        const size_t rowSz = row->collapsed ?
+            wfc__waveCollapsedRowSize(state->wave) :
+            wfc__waveRowSize(state->wave);
+        sz += rowSz / (size_t)wfc__loadShared_i(&row->refCnt);
+    }
+
+    if (state->spec.obs != NULL) {
+        sz += (size_t)state->spec.obsCnt * sizeof(*state->spec.obs);
+        sz += WFC__A2D_SIZE(state->ripple);
+        sz += (size_t)state->wave.d03 * sizeof(*state->spec.backup);
+    }
+
+    return sz;
+}
+
+int wfc_patternPresentAt(const wfc_State *state, int patt, int x, int y) {
+    if (state == NULL ||
+        patt < 0 || patt >= state->model->pattCnt ||
+        x < 0 || x >= state->dstD1 ||
+        y < 0 || y >= state->dstD0) {
+        return wfc_callerError;
+    }
+
+    // x and y are only needed when some edges are fixed
+    // and wave is smaller than destination.
+    // wfc__coordsDstToWave handles all of that.
+    // In that case, a different wave point
+    // may contain which patterns are present for multiple destination points.
+    int wC0, wC1;
+    wfc__coordsDstToWave(y, x, state->wave, &wC0, &wC1, NULL, NULL);
+
+    return wfc__waveGetBit(state->wave, wC0, wC1, patt);
+}
+
+int wfc_modifiedAt(const wfc_State *state, int x, int y) {
+    if (state == NULL ||
+        x < 0 || x >= state->dstD1 ||
+        y < 0 || y >= state->dstD0) {
+        return wfc_callerError;
+    }
+
+    int wC0, wC1;
+    wfc__coordsDstToWave(y, x, state->wave, &wC0, &wC1, NULL, NULL);
+
+    return WFC__A2D_GET(state->modified, wC0, wC1);
+}
+
+const unsigned char* wfc_pixelToBlitAt(
+    const wfc_State *state, const unsigned char *src,
+    int patt, int x, int y) {
+    if (state == NULL ||
+        src == NULL ||
+        patt < 0 || patt >= state->model->pattCnt ||
+        x < 0 || x >= state->dstD1 ||
+        y < 0 || y >= state->dstD0) {
+        return NULL;
+    }
+
+    struct wfc__A3d_cu8 srcA =
+        {state->srcD0, state->srcD1, state->bytesPerPixel, src};
+
+    // Similar case as in wfc_patternPresentAt(),
+    // except here we care about the offsets
+    // which are also the pattern-space coordinates of the pixel.
+    int pC0, pC1;
+    wfc__coordsDstToWave(y, x, state->wave, NULL, NULL, &pC0, &pC1);
+
+    int sC0, sC1;
+    wfc__coordsPattToSrc(
+        state->n, state->model->patts[patt], pC0, pC1, srcA.d03, srcA.d13,
+        &sC0, &sC1);
+
+    return &WFC__A3D_GET(srcA, sC0, sC1, 0);
+}
+
+// tiled generation
+
+enum {
+    // Number of seeds to try before giving up on a tile.
+    wfc__tileAttemptCnt = 8
+};
+
+// Splits one dimension of the output into tiles.
+// The last tile also takes the remainder, so it may be up to twice as long.
+// Returns the number of tiles. If starts is non-null,
+// it gets filled with where each tile starts, followed by len.
+int wfc__splitIntoTiles(int len, int tileLen, int *starts) {
+    int cnt = wfc__max_i(1, len / tileLen);
+
+    if (starts != NULL) {
+        for (int i = 0; i < cnt; ++i) starts[i] = i * tileLen;
+        starts[cnt] = len;
+    }
+
+    return cnt;
+}
+
+// Each tile is generated to fit the tiles above it and to its left,
+// including the one above and to the right.
+// So, tiles are generated in phases with tile (i, j) in phase 2 * i + j.
+// Tiles in the same phase never touch each other,
+// so they can be generated at the same time.
+int wfc__tilePhase(int i, int j) {
+    return 2 * i + j;
+}
+
+struct wfc__Tiled {
+    void *ctx;
+    struct wfc__Model *model;
+    int n, options;
+    unsigned seed;
+    struct wfc__A3d_cu8 src;
+    struct wfc__A3d_u8 dst;
+    int tileCnt0, tileCnt1;
+    const int *starts0, *starts1;
+    // Indexes of tiles generated in the current phase.
+    const int *tiles;
+    // Set to the code of the first tile that could not be generated.
+    volatile int failed;
+};
+
+// Returns zero if the tile was generated, wfc_failed if it could not be,
+// or wfc_outOfMemory.
+int wfc__generateTile(struct wfc__Tiled *tiled, int tile) {
+    void *ctx = tiled->ctx;
+    (void)ctx;
+
+    const int n = tiled->n;
+    const int bytesPerPixel = tiled->dst.d23;
+
+    const int i = tile / tiled->tileCnt1, j = tile % tiled->tileCnt1;
+
+    const int tileLo0 = tiled->starts0[i], tileHi0 = tiled->starts0[i + 1];
+    const int tileLo1 = tiled->starts1[j], tileHi1 = tiled->starts1[j + 1];
+
+    // Patterns reach n - 1 pixels away, so the tile is generated
+    // in a window that overlaps its already generated neighbours by that much,
+    // with their pixels kept so that the tile fits them.
+    // Not every image can be extended past its edges, so the window also
+    // covers the next tiles below and to the right, to leave room for them.
+    // Pixels generated there are thrown away.
+    // The window reaches over the top right tile too, but no further,
+    // as the tile after that one may be generated at the same time as this one.
+    const int lo0 = i > 0 ? tileLo0 - (n - 1) : tileLo0;
+    const int hi0 = i < tiled->tileCnt0 - 1 ? tiled->starts0[i + 2] : tileHi0;
+    const int lo1 = j > 0 ? tileLo1 - (n - 1) : tileLo1;
+    const int hi1 = j < tiled->tileCnt1 - 1 ? tiled->starts1[j + 2] : tileHi1;
+
+    struct wfc__A3d_u8 window = {hi0 - lo0, hi1 - lo1, bytesPerPixel, NULL};
+    window.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(window));
+    if (window.a == NULL) return wfc_outOfMemory;
+
+    struct wfc__A2d_b keep = {window.d03, window.d13, NULL};
+    keep.a = (bool*)WFC_MALLOC(ctx, WFC__A2D_SIZE(keep));
+    if (keep.a == NULL) {
+        WFC_FREE(ctx, window.a);
+        return wfc_outOfMemory;
+    }
+
+    for (int c0 = lo0; c0 < hi0; ++c0) {
+        for (int c1 = lo1; c1 < hi1; ++c1) {
+            bool kept = c0 < tileLo0 || (c1 < tileLo1 && c0 < tileHi0);
+
+            WFC__A2D_GET(keep, c0 - lo0, c1 - lo1) = kept;
+            if (kept) {
+                memcpy(&WFC__A3D_GET(window, c0 - lo0, c1 - lo1, 0),
+                    &WFC__A3D_GET(tiled->dst, c0, c1, 0),
+                    (size_t)bytesPerPixel);
+            }
+        }
+    }
+
+    int sides = 0;
+    if (lo0 == 0) sides |= wfc__sideC0Lo;
+    if (hi0 == tiled->dst.d03) sides |= wfc__sideC0Hi;
+    if (lo1 == 0) sides |= wfc__sideC1Lo;
+    if (hi1 == tiled->dst.d13) sides |= wfc__sideC1Hi;
+
+    // Tiles are already spread across threads.
+    wfc_State *proto = wfc__initWithModel(
+        ctx, 1, tiled->model,
+        n, tiled->options | wfc__optNoWrapC0 | wfc__optNoWrapC1, tiled->src,
+        window.d03, window.d13, window.a, keep.a, sides, NULL);
+
+    // Each tile gets its own seeds, independent of the order
+    // in which tiles get generated.
+    uint64_t seeds = ((uint64_t)tiled->seed << 32) ^ (uint64_t)tile;
+
+    int ret = proto == NULL ? wfc_outOfMemory : wfc_failed;
+    // If the kept pixels are contradictory, no seed can help.
+    for (int attempt = 0;
+        ret == wfc_failed && wfc_status(proto) >= 0 &&
+        attempt < wfc__tileAttemptCnt;
+        ++attempt) {
+        wfc_State *state = wfc_clone(proto);
+        if (state == NULL) {
+            ret = wfc_outOfMemory;
+            break;
+        }
+        wfc_setSeed(state, (unsigned)(wfc__splitMix64(&seeds) >> 32));
+
+        int status;
+        while ((status = wfc_step(state)) == 0);
+
+        if (status == wfc_completed) {
+            wfc_blit(state, tiled->src.a, window.a);
+            ret = 0;
+        } else if (status == wfc_outOfMemory) {
+            ret = status;
+        }
+
+        wfc_free(state);
+    }
+
+    if (ret == 0) {
+        for (int c0 = tileLo0; c0 < tileHi0; ++c0) {
+            memcpy(&WFC__A3D_GET(tiled->dst, c0, tileLo1, 0),
+                &WFC__A3D_GET(window, c0 - lo0, tileLo1 - lo1, 0),
+                (size_t)(tileHi1 - tileLo1) * (size_t)bytesPerPixel);
+        }
+    }
+
+    wfc_free(proto);
+    WFC_FREE(ctx, keep.a);
+    WFC_FREE(ctx, window.a);
+
+    return ret;
+}
+
+void wfc__generateTiledItem(void *data, int ind) {
+    struct wfc__Tiled *tiled = (struct wfc__Tiled*)data;
+
+    // Once one tile fails, there's no point in generating the rest.
+    if (wfc__loadShared_i(&tiled->failed)) return;
+
+    const int code = wfc__generateTile(tiled, tiled->tiles[ind]);
+    if (code != 0) wfc__storeShared_i(&tiled->failed, code);
+}
+
+int wfc_generateTiled(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    int threads, int tileW, int tileH, unsigned seed) {
+    if (n <= 0 ||
+        bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL ||
+        dstW <= 0 || dstH <= 0 || dst == NULL ||
+        n > srcW || n > srcH || n > dstW || n > dstH ||
+        threads <= 0 || tileW < n || tileH < n) {
+        return wfc_callerError;
+    }
+    // The last tile in a row or column takes up the remainder,
+    // and each tile's wave reaches into its neighbours.
+    if (!wfc__countsFit(
+            srcH, srcW,
+            wfc__min_ll(dstH, 2LL * tileH + 2LL * n),
+            wfc__min_ll(dstW, 2LL * tileW + 2LL * n))) {
+        return wfc_callerError;
+    }
+
+    options &= ~(wfc__optNoWrapC0 | wfc__optNoWrapC1);
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+    struct wfc__A3d_u8 dstA = {dstH, dstW, bytesPerPixel, dst};
+
+    struct wfc__Tiled tiled;
+    tiled.ctx = ctx;
+    tiled.model = wfc__makeModel(ctx, WFC_THREADS(ctx), n, options, srcA);
+    if (tiled.model == NULL) return wfc_outOfMemory;
+    tiled.n = n;
+    tiled.options = options;
+    tiled.seed = seed;
+    tiled.src = srcA;
+    tiled.dst = dstA;
+    tiled.failed = 0;
+
+    tiled.tileCnt0 = wfc__splitIntoTiles(dstH, tileH, NULL);
+    tiled.tileCnt1 = wfc__splitIntoTiles(dstW, tileW, NULL);
+
+    int *starts0 = (int*)WFC_MALLOC(
+        ctx, (size_t)(tiled.tileCnt0 + 1) * sizeof(*starts0));
+    int *starts1 = (int*)WFC_MALLOC(
+        ctx, (size_t)(tiled.tileCnt1 + 1) * sizeof(*starts1));
+    // No phase has more tiles than there are rows of tiles.
+    int *tiles = (int*)WFC_MALLOC(
+        ctx, (size_t)tiled.tileCnt0 * sizeof(*tiles));
+    if (starts0 == NULL || starts1 == NULL || tiles == NULL) {
+        if (tiles != NULL) WFC_FREE(ctx, tiles);
+        if (starts1 != NULL) WFC_FREE(ctx, starts1);
+        if (starts0 != NULL) WFC_FREE(ctx, starts0);
+        wfc__releaseModel(ctx, tiled.model);
+        return wfc_outOfMemory;
+    }
+    wfc__splitIntoTiles(dstH, tileH, starts0);
+    wfc__splitIntoTiles(dstW, tileW, starts1);
+    tiled.starts0 = starts0;
+    tiled.starts1 = starts1;
+    tiled.tiles = tiles;
+
+    const int phaseCnt =
+        wfc__tilePhase(tiled.tileCnt0 - 1, tiled.tileCnt1 - 1) + 1;
+    for (int phase = 0; phase < phaseCnt && !tiled.failed; ++phase) {
+        int tileCnt = 0;
+        for (int i = 0; i < tiled.tileCnt0; ++i) {
+            int j = phase - 2 * i;
+            if (j >= 0 && j < tiled.tileCnt1) {
+                tiles[tileCnt++] = i * tiled.tileCnt1 + j;
+            }
+        }
+
+        wfc__parallelFor(
+            ctx, threads, tileCnt, wfc__generateTiledItem, &tiled);
+    }
+
+    WFC_FREE(ctx, tiles);
+    WFC_FREE(ctx, starts1);
+    WFC_FREE(ctx, starts0);
+    wfc__releaseModel(ctx, tiled.model);
+
+    return tiled.failed;
+}
+
+// streamed generation
+
+// Top row of a band. Without a height, bands only stop where rows can
+// no longer be indexed. Otherwise, the last band also takes the remainder,
+// like tiles do.
+int wfc__bandStart(int band, int bandH, int dstH) {
+    if (dstH == 0) return (int)wfc__min_ll((long long)band * bandH, INT_MAX);
+
+    const int bandCnt = wfc__splitIntoTiles(dstH, bandH, NULL);
+    return band < bandCnt ? band * bandH : dstH;
+}
+
+int wfc_generateStream(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH,
+    void *ctx,
+    int bandH, unsigned seed,
+    int (*emitRow)(void *user, int y, const unsigned char *row),
+    void *user) {
+    if (n <= 0 ||
+        bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL ||
+        dstW <= 0 || dstH < 0 ||
+        n > srcW || n > srcH || n > dstW || (dstH > 0 && n > dstH) ||
+        bandH < n || emitRow == NULL) {
+        return wfc_callerError;
+    }
+    // A band's window holds the rows kept above it, the band,
+    // and the band below it, which may take the remainder.
+    if (!wfc__countsFit(srcH, srcW, 3LL * bandH + n, dstW)) {
+        return wfc_callerError;
+    }
+
+    const int threads = WFC_THREADS(ctx);
+
+    // Bands span the whole width, so they can wrap around it.
+    options = wfc__wrapOptions(options);
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+
+    struct wfc__Model *model = wfc__makeModel(ctx, threads, n, options, srcA);
+    if (model == NULL) return wfc_outOfMemory;
+
+    // Rows of the current window, starting with those kept from above.
+    struct wfc__A3d_u8 window = {3 * bandH + n, dstW, bytesPerPixel, NULL};
+    window.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(window));
+    struct wfc__A2d_b keep = {window.d03, window.d13, NULL};
+    keep.a = (bool*)WFC_MALLOC(ctx, WFC__A2D_SIZE(keep));
+    if (window.a == NULL || keep.a == NULL) {
+        if (keep.a != NULL) WFC_FREE(ctx, keep.a);
+        if (window.a != NULL) WFC_FREE(ctx, window.a);
+        wfc__releaseModel(ctx, model);
+        return wfc_outOfMemory;
+    }
+
+    int ret = 0;
+    for (int band = 0; ret == 0; ++band) {
+        const int bandLo = wfc__bandStart(band, bandH, dstH);
+        const int bandHi = wfc__bandStart(band + 1, bandH, dstH);
+        if (bandLo == bandHi) break;
+
+        // Patterns reach n - 1 pixels away, so that many rows are kept.
+        const int lo = band > 0 ? bandLo - (n - 1) : bandLo;
+        const int hi = wfc__bandStart(band + 2, bandH, dstH);
+        const int h = hi - lo;
+
+        for (int c0 = 0; c0 < h; ++c0) {
+            for (int c1 = 0; c1 < dstW; ++c1) {
+                WFC__A2D_GET(keep, c0, c1) = c0 < bandLo - lo;
+            }
+        }
+
+        int sides = wfc__sideC1Lo | wfc__sideC1Hi;
+        if (lo == 0) sides |= wfc__sideC0Lo;
+        if (hi == dstH) sides |= wfc__sideC0Hi;
+
+        wfc_State *proto = wfc__initWithModel(
+            ctx, threads, model,
+            n, options | wfc__optNoWrapC0, srcA,
+            h, dstW, window.a, keep.a, sides, NULL);
+        if (proto == NULL) {
+            ret = wfc_outOfMemory;
+            break;
+        }
+
+        // Each band gets its own seeds, like tiles do.
+        uint64_t seeds = ((uint64_t)seed << 32) ^ (uint64_t)band;
+
+        ret = wfc_failed;
+        // If the kept pixels are contradictory, no seed can help.
+        for (int attempt = 0;
+            ret == wfc_failed && wfc_status(proto) >= 0 &&
+            attempt < wfc__tileAttemptCnt;
+            ++attempt) {
+            wfc_State *state = wfc_clone(proto);
+            if (state == NULL) {
+                ret = wfc_outOfMemory;
+                break;
+            }
+            wfc_setSeed(state, (unsigned)(wfc__splitMix64(&seeds) >> 32));
+
+            int status;
+            while ((status = wfc_step(state)) == 0);
+
+            if (status == wfc_completed) {
+                wfc_blit(state, src, window.a);
+                ret = 0;
+            } else if (status == wfc_outOfMemory) {
+                ret = status;
+            }
+
+            wfc_free(state);
+        }
+
+        wfc_free(proto);
+
+        if (ret != 0) break;
+
+        for (int c0 = bandLo; c0 < bandHi; ++c0) {
+            if (emitRow(user, c0, &WFC__A3D_GET(window, c0 - lo, 0, 0))) {
+                ret = wfc_cancelled;
+                break;
+            }
+        }
+
+        // The band's last rows are kept for the next one.
+        memmove(
+            window.a, &WFC__A3D_GET(window, bandHi - (n - 1) - lo, 0, 0),
+            (size_t)(n - 1) * (size_t)dstW * (size_t)bytesPerPixel);
+    }
+
+    WFC_FREE(ctx, keep.a);
+    WFC_FREE(ctx, window.a);
+    wfc__releaseModel(ctx, model);
+
+    return ret;
+}
+
+// chunked worlds
+
+// Generated chunks are looked up by their coordinates
+// in an open addressing hash table.
+struct wfc__Chunk {
+    int cx, cy;
+    bool used;
+    // The chunk's border: its top and bottom n - 1 rows,
+    // then its left and right n - 1 columns, each including corners.
+    unsigned char *border;
+};
+
+struct wfc_World {
+    void *ctx;
+    struct wfc__Model *model;
+    int n, options;
+    unsigned seed;
+    struct wfc__A3d_cu8 src;
+    int chunkW, chunkH;
+
+    // Power of two, and never more than half full.
+    int capacity, chunkCnt;
+    struct wfc__Chunk *chunks;
+};
+
+uint64_t wfc__chunkHash(int cx, int cy) {
+    uint64_t h = ((uint64_t)(uint32_t)cx << 32) | (uint64_t)(uint32_t)cy;
+    return wfc__splitMix64(&h);
+}
+
+// Returns the chunk's slot in the table, or the empty slot it would go into.
+struct wfc__Chunk* wfc__findChunk(
+    const struct wfc_World *world, int cx, int cy) {
+    const uint64_t mask = (uint64_t)world->capacity - 1;
+
+    for (uint64_t i = wfc__chunkHash(cx, cy) & mask; ; i = (i + 1) & mask) {
+        struct wfc__Chunk *chunk = &world->chunks[i];
+        if (!chunk->used || (chunk->cx == cx && chunk->cy == cy)) return chunk;
+    }
+}
+
+size_t wfc__chunkBorderSize(const struct wfc_World *world) {
+    const size_t m = (size_t)(world->n - 1);
+    const size_t pxCnt =
+        2 * m * (size_t)world->chunkW + 2 * m * (size_t)world->chunkH;
+
+    return pxCnt * (size_t)world->src.d23;
+}
+
+// Returns a pixel of a generated chunk, which must be on its border.
+unsigned char* wfc__chunkBorderPx(
+    const struct wfc_World *world, const struct wfc__Chunk *chunk,
+    int c0, int c1) {
+    const int m = world->n - 1;
+    const int w = world->chunkW, h = world->chunkH;
+
+    size_t ind;
+    if (c0 < m) {
+        ind = (size_t)c0 * (size_t)w + (size_t)c1;
+    } else if (c0 >= h - m) {
+        ind = (size_t)(m + c0 - (h - m)) * (size_t)w + (size_t)c1;
+    } else if (c1 < m) {
+        ind = 2 * (size_t)m * (size_t)w + (size_t)c0 * (size_t)m + (size_t)c1;
+    } else {
+        ind = 2 * (size_t)m * (size_t)w + (size_t)h * (size_t)m +
+            (size_t)c0 * (size_t)m + (size_t)(c1 - (w - m));
+    }
+
+    return chunk->border + ind * (size_t)world->src.d23;
+}
+
+// Doubles the capacity of the table.
+bool wfc__growChunks(struct wfc_World *world) {
+    const int oldCapacity = world->capacity;
+    struct wfc__Chunk *oldChunks = world->chunks;
+
+    if (oldCapacity > INT_MAX / 2) return false;
+    struct wfc__Chunk *chunks = (struct wfc__Chunk*)WFC_MALLOC(
+        world->ctx, (size_t)oldCapacity * 2 * sizeof(*chunks));
+    if (chunks == NULL) return false;
+    memset(chunks, 0, (size_t)oldCapacity * 2 * sizeof(*chunks));
+
+    world->capacity = oldCapacity * 2;
+    world->chunks = chunks;
+    for (int i = 0; i < oldCapacity; ++i) {
+        if (oldChunks[i].used) {
+            *wfc__findChunk(world, oldChunks[i].cx, oldChunks[i].cy) =
+                oldChunks[i];
+        }
+    }
+
+    WFC_FREE(world->ctx, oldChunks);
+
+    return true;
+}
+
+wfc_World* wfc_initWorld(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int chunkW, int chunkH,
+    void *ctx,
+    unsigned seed) {
+    if (n <= 0 ||
+        bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL ||
+        n > srcW || n > srcH ||
+        chunkW < n || chunkH < n) {
+        return NULL;
+    }
+    // Each chunk's wave reaches into its neighbours.
+    if (!wfc__countsFit(
+            srcH, srcW, chunkH + 2LL * (n - 1), chunkW + 2LL * (n - 1))) {
+        return NULL;
+    }
+
+    // Worlds have no edges to wrap around or to fix.
+    options &= ~(wfc_optEdgeFixH | wfc_optEdgeFixV |
+        wfc__optNoWrapC0 | wfc__optNoWrapC1);
+
+    enum { initCapacity = 16 };
+
+    struct wfc_World *world =
+        (struct wfc_World*)WFC_MALLOC(ctx, sizeof(*world));
+    if (world == NULL) return NULL;
+    world->chunks = (struct wfc__Chunk*)WFC_MALLOC(
+        ctx, initCapacity * sizeof(*world->chunks));
+    if (world->chunks == NULL) {
+        WFC_FREE(ctx, world);
+        return NULL;
+    }
+    memset(world->chunks, 0, initCapacity * sizeof(*world->chunks));
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+
+    world->model = wfc__makeModel(ctx, WFC_THREADS(ctx), n, options, srcA);
+    if (world->model == NULL) {
+        WFC_FREE(ctx, world->chunks);
+        WFC_FREE(ctx, world);
+        return NULL;
+    }
+
+    world->ctx = ctx;
+    world->n = n;
+    world->options = options;
+    world->seed = seed;
+    world->src = srcA;
+    world->chunkW = chunkW;
+    world->chunkH = chunkH;
+    world->capacity = initCapacity;
+    world->chunkCnt = 0;
+
+    return world;
+}
+
+// Chunks are split into four phases, in a lattice of two by two chunks.
+// Each chunk is only generated to fit its neighbours of lower phases,
+// and leaves room for the rest of them.
+// That way, its pixels only depend on the world's seed and its coordinates.
+int wfc__chunkPhase(int cx, int cy) {
+    return (int)((unsigned)cx & 1u) + 2 * (int)((unsigned)cy & 1u);
+}
+
+// Generates a chunk, first generating its neighbours of lower phases
+// that have not been generated yet. The chunk's pixels are written to dst
+// if it's non-null. Chunks may be generated again, with the same result.
+int wfc__generateChunk(
+    struct wfc_World *world, int cx, int cy, unsigned char *dst) {
+    void *ctx = world->ctx;
+    const int n = world->n;
+    const int m = n - 1;
+    const int w = world->chunkW, h = world->chunkH;
+    const int bytesPerPixel = world->src.d23;
+    const int phase = wfc__chunkPhase(cx, cy);
+
+    // Recursion is at most three levels deep, since phases keep decreasing.
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            if (wfc__chunkPhase(cx + dx, cy + dy) >= phase ||
+                wfc__findChunk(world, cx + dx, cy + dy)->used) {
+                continue;
+            }
+
+            int code = wfc__generateChunk(world, cx + dx, cy + dy, NULL);
+            if (code != 0) return code;
+        }
+    }
+
+    const bool known = wfc__findChunk(world, cx, cy)->used;
+    // Make room up front, so that the chunk can always be added.
+    if (!known && (world->chunkCnt + 1) * 2 > world->capacity &&
+        !wfc__growChunks(world)) {
+        return wfc_outOfMemory;
+    }
+
+    // The chunk, surrounded by n - 1 pixels from each of its neighbours.
+    struct wfc__A3d_u8 window = {h + 2 * m, w + 2 * m, bytesPerPixel, NULL};
+    window.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(window));
+    struct wfc__A2d_b keep = {window.d03, window.d13, NULL};
+    keep.a = (bool*)WFC_MALLOC(ctx, WFC__A2D_SIZE(keep));
+    unsigned char *border = NULL;
+    if (!known && m > 0) border = (unsigned char*)WFC_MALLOC(
+        ctx, wfc__chunkBorderSize(world));
+    if (window.a == NULL || keep.a == NULL ||
+        (!known && m > 0 && border == NULL)) {
+        if (border != NULL) WFC_FREE(ctx, border);
+        if (keep.a != NULL) WFC_FREE(ctx, keep.a);
+        if (window.a != NULL) WFC_FREE(ctx, window.a);
+        return wfc_outOfMemory;
+    }
+
+    // Pixels of neighbours of lower phases are kept,
+    // the rest of them only leave room for neighbours to come.
+    for (int c0 = 0; c0 < window.d03; ++c0) {
+        for (int c1 = 0; c1 < window.d13; ++c1) {
+            const int y = c0 - m, x = c1 - m;
+            const int dy = y < 0 ? -1 : y >= h ? 1 : 0;
+            const int dx = x < 0 ? -1 : x >= w ? 1 : 0;
+
+            const struct wfc__Chunk *neighbour = NULL;
+            if ((dy != 0 || dx != 0) &&
+                wfc__chunkPhase(cx + dx, cy + dy) < phase) {
+                neighbour = wfc__findChunk(world, cx + dx, cy + dy);
+            }
+
+            WFC__A2D_GET(keep, c0, c1) = neighbour != NULL;
+            if (neighbour != NULL) {
+                const unsigned char *px = wfc__chunkBorderPx(
+                    world, neighbour, y - dy * h, x - dx * w);
+                memcpy(&WFC__A3D_GET(window, c0, c1, 0), px,
+                    (size_t)bytesPerPixel);
+            }
+        }
+    }
+
+    wfc_State *proto = wfc__initWithModel(
+        ctx, WFC_THREADS(ctx), world->model,
+        n, world->options | wfc__optNoWrapC0 | wfc__optNoWrapC1, world->src,
+        window.d03, window.d13, window.a, keep.a, 0, NULL);
+
+    // Each chunk gets its own seeds, independent of the order
+    // in which chunks get generated.
+    uint64_t seeds = (uint64_t)world->seed ^ wfc__chunkHash(cx, cy);
+
+    int ret = proto == NULL ? wfc_outOfMemory : wfc_failed;
+    bool done = false;
+    // If the kept pixels are contradictory, no seed can help.
+    for (int attempt = 0;
+        ret == wfc_failed && !done && wfc_status(proto) >= 0 &&
+        attempt < wfc__tileAttemptCnt;
+        ++attempt) {
+        wfc_State *state = wfc_clone(proto);
+        if (state == NULL) {
+            ret = wfc_outOfMemory;
+            break;
+        }
+        wfc_setSeed(state, (unsigned)(wfc__splitMix64(&seeds) >> 32));
+
+        int status;
+        while ((status = wfc_step(state)) == 0);
+
+        if (status == wfc_completed) {
+            wfc_blit(state, world->src.a, window.a);
+            done = true;
+        } else if (status == wfc_outOfMemory) {
+            ret = status;
+        }
+
+        wfc_free(state);
+    }
+
+    wfc_free(proto);
+
+    if (done && dst != NULL) {
+        for (int c0 = 0; c0 < h; ++c0) {
+            memcpy(dst + (size_t)c0 * (size_t)w * (size_t)bytesPerPixel,
+                &WFC__A3D_GET(window, c0 + m, m, 0),
+                (size_t)w * (size_t)bytesPerPixel);
+        }
+    }
+
+    if (done && !known) {
+        struct wfc__Chunk *chunk = wfc__findChunk(world, cx, cy);
+        chunk->cx = cx;
+        chunk->cy = cy;
+        chunk->used = true;
+        chunk->border = border;
+        ++world->chunkCnt;
+
+        for (int c0 = 0; c0 < h; ++c0) {
+            for (int c1 = 0; c1 < w; ++c1) {
+                if (c0 < m || c0 >= h - m || c1 < m || c1 >= w - m) {
+                    memcpy(wfc__chunkBorderPx(world, chunk, c0, c1),
+                        &WFC__A3D_GET(window, c0 + m, c1 + m, 0),
+                        (size_t)bytesPerPixel);
+                }
+            }
+        }
+
+        border = NULL;
+    }
+    if (done) ret = 0;
+
+    if (border != NULL) WFC_FREE(ctx, border);
+    WFC_FREE(ctx, keep.a);
+    WFC_FREE(ctx, window.a);
+
+    return ret;
+}
+
+int wfc_generateChunk(wfc_World *world, int cx, int cy, unsigned char *dst) {
+    if (world == NULL || dst == NULL) return wfc_callerError;
+
+    return wfc__generateChunk(world, cx, cy, dst);
+}
+
+int wfc_chunkGenerated(const wfc_World *world, int cx, int cy) {
+    if (world == NULL) return wfc_callerError;
+
+    return wfc__findChunk(world, cx, cy)->used;
+}
+
+void wfc_freeWorld(wfc_World *world) {
+    if (world == NULL) return;
+
+    void *ctx = world->ctx;
+
+    for (int i = 0; i < world->capacity; ++i) {
+        if (world->chunks[i].used && world->chunks[i].border != NULL) {
+            WFC_FREE(ctx, world->chunks[i].border);
+        }
+    }
+    WFC_FREE(ctx, world->chunks);
+    wfc__releaseModel(ctx, world->model);
+    WFC_FREE(ctx, world);
+}
+
+// coarse to fine generation
+
+// Each block of factor by factor pixels is replaced by its middle pixel.
+// Pixels left over past the last whole block are dropped.
+void wfc__downsample(
+    int factor, const struct wfc__A3d_cu8 from, struct wfc__A3d_u8 to) {
+    for (int c0 = 0; c0 < to.d03; ++c0) {
+        for (int c1 = 0; c1 < to.d13; ++c1) {
+            memcpy(&WFC__A3D_GET(to, c0, c1, 0),
+                &WFC__A3D_GET(
+                    from, c0 * factor + factor / 2, c1 * factor + factor / 2,
+                    0),
+                (size_t)to.d23);
+        }
+    }
+}
+
+// Each pixel is replaced by the pixel of the smaller image
+// its block was downsampled to.
+// Left over pixels use the last block in their row or column.
+void wfc__upsample(
+    int factor, const struct wfc__A3d_cu8 from, struct wfc__A3d_u8 to) {
+    for (int c0 = 0; c0 < to.d03; ++c0) {
+        for (int c1 = 0; c1 < to.d13; ++c1) {
+            memcpy(&WFC__A3D_GET(to, c0, c1, 0),
+                &WFC__A3D_GET(
+                    from,
+                    wfc__min_i(c0 / factor, from.d03 - 1),
+                    wfc__min_i(c1 / factor, from.d13 - 1),
+                    0),
+                (size_t)to.d23);
+        }
+    }
+}
+
+// Steps the state until it is done, and blits it if it completed.
+// Returns the status of the run.
+int wfc__runToEnd(
+    wfc_State *state, uint64_t *seeds,
+    const unsigned char *src, unsigned char *dst) {
+    wfc_setSeed(state, (unsigned)(wfc__splitMix64(seeds) >> 32));
+
+    int status;
+    while ((status = wfc_step(state)) == 0);
+
+    if (status == wfc_completed) wfc_blit(state, src, dst);
+
+    return status;
+}
+
+// Generates the full image so that it matches the smaller one.
+// Returns the status of the run.
+int wfc__generateFine(
+    void *ctx, int n, int options, int factor, uint64_t *seeds,
+    const struct wfc__A3d_cu8 srcA, const struct wfc__A3d_u8 dstA,
+    const struct wfc__A3d_cu8 coarseSrc, const struct wfc__A3d_cu8 coarseDst) {
+    const int threads = WFC_THREADS(ctx);
+    const int bytesPerPixel = srcA.d23;
+
+    // The source, with each pixel replaced by what its block downsampled to.
+    struct wfc__A3d_u8 guide = {srcA.d03, srcA.d13, bytesPerPixel, NULL};
+    // The smaller image, upsampled to the full size.
+    struct wfc__A3d_u8 target = {dstA.d03, dstA.d13, bytesPerPixel, NULL};
+    struct wfc__A2d_b keep = {dstA.d03, dstA.d13, NULL};
+
+    guide.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(guide));
+    target.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(target));
+    keep.a = (bool*)WFC_MALLOC(ctx, WFC__A2D_SIZE(keep));
+    struct wfc__Model *model = NULL;
+    if (guide.a != NULL && target.a != NULL && keep.a != NULL) {
+        model = wfc__makeModel(ctx, threads, n, options, srcA);
+    }
+    if (model == NULL) {
+        if (keep.a != NULL) WFC_FREE(ctx, keep.a);
+        if (target.a != NULL) WFC_FREE(ctx, target.a);
+        if (guide.a != NULL) WFC_FREE(ctx, guide.a);
+        return wfc_outOfMemory;
+    }
+
+    wfc__upsample(factor, coarseSrc, guide);
+    wfc__upsample(factor, coarseDst, target);
+
+    // Only the middle of each block is restricted,
+    // which leaves patterns room to line up with blocks in different ways.
+    for (int c0 = 0; c0 < keep.d02; ++c0) {
+        for (int c1 = 0; c1 < keep.d12; ++c1) {
+            WFC__A2D_GET(keep, c0, c1) =
+                c0 % factor == factor / 2 && c0 / factor < coarseDst.d03 &&
+                c1 % factor == factor / 2 && c1 / factor < coarseDst.d13;
+        }
+    }
+
+    // Patterns only refer to source pixels by their coordinates.
+    // Passing the guide in place of the source makes kept pixels
+    // get compared against what source pixels were downsampled to.
+    const struct wfc__A3d_cu8 guideA =
+        {guide.d03, guide.d13, bytesPerPixel, guide.a};
+    wfc_State *state = wfc__initWithModel(
+        ctx, threads, model, n, options, guideA,
+        target.d03, target.d13, target.a, keep.a, wfc__sideAll, NULL);
+
+    int ret = wfc_outOfMemory;
+    if (state != NULL) ret = wfc__runToEnd(state, seeds, srcA.a, dstA.a);
+
+    wfc_free(state);
+    wfc__releaseModel(ctx, model);
+    WFC_FREE(ctx, keep.a);
+    WFC_FREE(ctx, target.a);
+    WFC_FREE(ctx, guide.a);
+
+    return ret;
+}
+
+// Generates the smaller image, then the full one to match it.
+// Returns the status of the run.
+int wfc__generateCoarseToFine(
+    void *ctx, int n, int options, int factor, uint64_t *seeds,
+    const struct wfc__A3d_cu8 srcA, const struct wfc__A3d_u8 dstA) {
+    const int bytesPerPixel = srcA.d23;
+
+    struct wfc__A3d_u8 coarseSrc =
+        {srcA.d03 / factor, srcA.d13 / factor, bytesPerPixel, NULL};
+    struct wfc__A3d_u8 coarseDst =
+        {dstA.d03 / factor, dstA.d13 / factor, bytesPerPixel, NULL};
+    if (coarseSrc.d03 < n || coarseSrc.d13 < n ||
+        coarseDst.d03 < n || coarseDst.d13 < n) {
+        return wfc_failed;
+    }
+
+    coarseSrc.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(coarseSrc));
+    coarseDst.a = (uint8_t*)WFC_MALLOC(ctx, WFC__A3D_SIZE(coarseDst));
+    if (coarseSrc.a == NULL || coarseDst.a == NULL) {
+        if (coarseDst.a != NULL) WFC_FREE(ctx, coarseDst.a);
+        if (coarseSrc.a != NULL) WFC_FREE(ctx, coarseSrc.a);
+        return wfc_outOfMemory;
+    }
+
+    wfc__downsample(factor, srcA, coarseSrc);
+
+    wfc_State *state = wfc_initEx(
+        n, options, bytesPerPixel,
+        coarseSrc.d13, coarseSrc.d03, coarseSrc.a,
+        coarseDst.d13, coarseDst.d03, NULL,
+        ctx, NULL);
+
+    int ret = wfc_outOfMemory;
+    if (state != NULL) {
+        ret = wfc__runToEnd(state, seeds, coarseSrc.a, coarseDst.a);
+    }
+    wfc_free(state);
+
+    if (ret == wfc_completed) {
+        const struct wfc__A3d_cu8 coarseSrcA =
+            {coarseSrc.d03, coarseSrc.d13, bytesPerPixel, coarseSrc.a};
+        const struct wfc__A3d_cu8 coarseDstA =
+            {coarseDst.d03, coarseDst.d13, bytesPerPixel, coarseDst.a};
+
+        ret = wfc__generateFine(
+            ctx, n, wfc__wrapOptions(options), factor, seeds,
+            srcA, dstA, coarseSrcA, coarseDstA);
+    }
+
+    WFC_FREE(ctx, coarseDst.a);
+    WFC_FREE(ctx, coarseSrc.a);
+
+    return ret;
+}
+
+int wfc_generateCoarseToFine(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    int factor, unsigned seed) {
+    if (n <= 0 ||
+        bytesPerPixel <= 0 ||
+        srcW <= 0 || srcH <= 0 || src == NULL ||
+        dstW <= 0 || dstH <= 0 || dst == NULL ||
+        n > srcW || n > srcH || n > dstW || n > dstH ||
+        factor <= 0) {
+        return wfc_callerError;
+    }
+    if (!wfc__countsFit(srcH, srcW, dstH, dstW)) {
+        return wfc_callerError;
+    }
+
+    struct wfc__A3d_cu8 srcA = {srcH, srcW, bytesPerPixel, src};
+    struct wfc__A3d_u8 dstA = {dstH, dstW, bytesPerPixel, dst};
+
+    uint64_t seeds = (uint64_t)seed << 32;
+
+    if (factor > 1) {
+        int ret = wfc__generateCoarseToFine(
+            ctx, n, options, factor, &seeds, srcA, dstA);
+        if (ret == wfc_completed || ret == wfc_outOfMemory) return ret;
+    }
+
+    wfc_State *state = wfc_initEx(
+        n, options, bytesPerPixel,
+        srcW, srcH, src,
+        dstW, dstH, NULL,
+        ctx, NULL);
+    if (state == NULL) return wfc_outOfMemory;
+
+    int ret = wfc__runToEnd(state, &seeds, src, dst);
+
+    wfc_free(state);
+
+    return ret;
+}
+
+// thread pool
+
+// Work to be run on a pool thread.
+// Structs with more data should embed this as their first member.
+struct wfc__Job {
+    struct wfc__Job *next;
+    void (*run)(struct wfc__Job *job);
+};
+
+struct wfc__Pool {
+    wfc__Mutex mutex;
+    // Signalled when a job is added to the queue.
+    wfc__Cond cond;
+    // Jobs waiting to be picked up by a worker, in FIFO order.
+    struct wfc__Job *head, *tail;
+    struct wfc__Thread threads[WFC_ASYNC_THREADS];
+    // Number of threads that were started.
+    int threadCnt;
+};
+
+// Workers run for the lifetime of the program.
+void* wfc__poolWorker(void *arg) {
+    struct wfc__Pool *pool = (struct wfc__Pool*)arg;
+
+    while (true) {
+        wfc__mutexLock(&pool->mutex);
+        while (pool->head == NULL) wfc__condWait(&pool->cond, &pool->mutex);
+        struct wfc__Job *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) pool->tail = NULL;
+        wfc__mutexUnlock(&pool->mutex);
+
+        job->run(job);
+    }
+
+    return NULL;
+}
+
+#ifdef WFC_USE_PTHREADS
+// The pool backing asynchronous runs is shared by all of them
+// and is only started once the first run is submitted.
+struct wfc__Pool wfc__asyncPool;
+pthread_once_t wfc__asyncPoolOnce = PTHREAD_ONCE_INIT;
+
+void wfc__startAsyncPool(void) {
+    struct wfc__Pool *pool = &wfc__asyncPool;
+
+    wfc__mutexInit(&pool->mutex);
+    wfc__condInit(&pool->cond);
+    pool->head = pool->tail = NULL;
+    // Workers never return, so they can't be run on this thread instead.
+    pool->threadCnt = 0;
+    for (int i = 0; i < WFC_ASYNC_THREADS; ++i) {
+        if (wfc__threadTryStart(
+                &pool->threads[pool->threadCnt], wfc__poolWorker, pool)) {
+            ++pool->threadCnt;
+        }
+    }
+}
+#endif
+
+void wfc__submitAsync(struct wfc__Job *job) {
+#ifdef WFC_USE_PTHREADS
+    pthread_once(&wfc__asyncPoolOnce, wfc__startAsyncPool);
+
+    struct wfc__Pool *pool = &wfc__asyncPool;
+
+    // Without any workers, jobs run on the calling thread.
+    if (pool->threadCnt == 0) {
+        job->run(job);
+        return;
+    }
+
+    job->next = NULL;
+    wfc__mutexLock(&pool->mutex);
+    if (pool->tail != NULL) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    wfc__condBroadcast(&pool->cond);
+    wfc__mutexUnlock(&pool->mutex);
+#else
+    job->run(job);
+#endif
+}
+
+// asynchronous API
+
+struct wfc_Async {
+    // Must be the first member, see wfc__Job.
+    struct wfc__Job job;
+    // Arguments to run WFC with.
+    void *ctx;
+    int n, options, bytesPerPixel;
+    int srcW, srcH;
+    const unsigned char *src;
+    int dstW, dstH;
+    unsigned char *dst;
+    bool *keep;
+    // Raised by wfc_cancel() and checked by the worker.
+    volatile int cancel;
+    // Written to by the worker after each step to report progress.
+    volatile int collapsedCnt;
+    // Zero until the run is done, after which it's the final status.
+    // Only written to once, while holding the mutex.
+    volatile int status;
+    wfc__Mutex mutex;
+    // Signalled when the run is done.
+    wfc__Cond cond;
+};
+
+void wfc__runAsync(struct wfc__Job *job) {
+    struct wfc_Async *async = (struct wfc_Async*)job;
+
+    int status = wfc_cancelled;
+    if (wfc__loadShared_i(&async->cancel) == 0) {
+        const bool valid = wfc__initArgsValid(
+            async->n, async->bytesPerPixel,
+            async->srcW, async->srcH, async->src,
+            async->dstW, async->dstH, async->dst, async->keep);
+        wfc_State *state = !valid ? NULL : wfc_initEx(
+            async->n, async->options, async->bytesPerPixel,
+            async->srcW, async->srcH, async->src,
+            async->dstW, async->dstH, async->dst,
+            async->ctx, async->keep);
+
+        if (state == NULL) {
+            status = valid ? wfc_outOfMemory : wfc_callerError;
+        } else {
+            wfc_setLimits(state, 0.0, &async->cancel);
+
+            while ((status = wfc_step(state)) == 0) {
+                wfc__storeShared_i(
+                    &async->collapsedCnt, wfc_collapsedCount(state));
+            }
+            wfc__storeShared_i(&async->collapsedCnt, wfc_collapsedCount(state));
+
+            if (status == wfc_completed) {
+                int code = wfc_blit(state, async->src, async->dst);
+                if (code != 0) status = code;
+            }
+
+            wfc_free(state);
+        }
+    }
+
+    wfc__mutexLock(&async->mutex);
+    wfc__storeShared_i(&async->status, status);
+    wfc__condBroadcast(&async->cond);
+    wfc__mutexUnlock(&async->mutex);
+}
+
+wfc_Async* wfc_startAsync(
+    int n, int options, int bytesPerPixel,
+    int srcW, int srcH, const unsigned char *src,
+    int dstW, int dstH, unsigned char *dst,
+    void *ctx,
+    bool *keep) {
+    wfc_Async *async = (wfc_Async*)WFC_MALLOC(ctx, sizeof(*async));
+    if (async == NULL) return NULL;
+
+    async->job.next = NULL;
+    async->job.run = wfc__runAsync;
+    async->ctx = ctx;
+    async->n = n;
+    async->options = options;
+    async->bytesPerPixel = bytesPerPixel;
+    async->srcW = srcW;
+    async->srcH = srcH;
+    async->src = src;
+    async->dstW = dstW;
+    async->dstH = dstH;
+    async->dst = dst;
+    async->keep = keep;
+    async->cancel = 0;
+    async->collapsedCnt = 0;
+    async->status = 0;
+    wfc__mutexInit(&async->mutex);
+    wfc__condInit(&async->cond);
+
+    wfc__submitAsync(&async->job);
+
+    return async;
+}
+
+int wfc_poll(const wfc_Async *async) {
+    if (async == NULL) return wfc_callerError;
+
+    return wfc__loadShared_i(&async->status);
+}
+
+int wfc_wait(wfc_Async *async) {
+    if (async == NULL) return wfc_callerError;
+
+    wfc__mutexLock(&async->mutex);
+    while (wfc__loadShared_i(&async->status) == 0) {
+        wfc__condWait(&async->cond, &async->mutex);
+    }
+    wfc__mutexUnlock(&async->mutex);
+
+    return wfc__loadShared_i(&async->status);
+}
+
+int wfc_cancel(wfc_Async *async) {
+    if (async == NULL) return wfc_callerError;
+
+    wfc__storeShared_i(&async->cancel, 1);
+
+    return 0;
+}
+
+int wfc_asyncCollapsedCount(const wfc_Async *async) {
+    if (async == NULL) return wfc_callerError;
+
+    return wfc__loadShared_i(&async->collapsedCnt);
+}
+
+void wfc_freeAsync(wfc_Async *async) {
+    if (async == NULL) return;
+
+    void *ctx = async->ctx;
+    (void)ctx;
+
+    wfc_cancel(async);
+    wfc_wait(async);
+
+    wfc__condDestroy(&async->cond);
+    wfc__mutexDestroy(&async->mutex);
+    WFC_FREE(ctx, async);
 }
 
 #endif // WFC_IMPLEMENTATION